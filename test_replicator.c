@@ -0,0 +1,1389 @@
+/* The replicator functions are static, so the tests include trlmdb.c */
+
+#include <assert.h>
+
+#include "trlmdb.c"
+
+#define TRLMDB_DATABASE_REPLICATOR "./databases/trlmdb-replicator"
+#define TRLMDB_DATABASE_REPLICATOR_1 "./databases/trlmdb-replicator-1"
+#define TRLMDB_DATABASE_REPLICATOR_2 "./databases/trlmdb-replicator-2"
+
+void test_read_time_ack(void);
+void test_write_window(void);
+void test_write_msg_consume(void);
+void test_read_frame_malformed(void);
+void test_catalog_collision(void);
+void test_applier_records(void);
+void test_range_sync(void);
+void test_snapshot(void);
+void test_msg_v2(void);
+void test_stream_compression(void);
+void test_write_lanes(void);
+void test_conn_registry(void);
+void test_send_cache(void);
+void test_reconnect(void);
+
+int main (void)
+{
+	test_read_time_ack();
+	test_write_window();
+	test_write_msg_consume();
+	test_read_frame_malformed();
+	test_catalog_collision();
+	test_applier_records();
+	test_range_sync();
+	test_snapshot();
+	test_msg_v2();
+	test_stream_compression();
+	test_write_lanes();
+	test_conn_registry();
+	test_send_cache();
+	test_reconnect();
+	printf("All tests passed\n");
+	return 0;
+}
+
+/* connected_rstate returns a connection with acks to node-2 over one end of the socket pair fds */
+static struct rstate *connected_rstate(trlmdb_env *env, struct conf_info *conf_info, int *fds)
+{
+	*conf_info = (struct conf_info) {0};
+	conf_info->node = "node-1";
+	conf_info->timeout = 1000;
+	conf_info->read_budget = 1 << 20;
+
+	struct rstate *rs = rstate_alloc_init(env, conf_info);
+	rs->remote_node = "node-2";
+	rs->node_msg_received = 1;
+	rs->read_caps = CAP_ACKS;
+	rs->write_caps = CAP_ACKS;
+
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(!rc);
+	rs->socket_fd = fds[0];
+
+	return rs;
+}
+
+/* reopen_env opens the environment in the directory path */
+static trlmdb_env *reopen_env(const char *path, unsigned int flags)
+{
+	trlmdb_env *env;
+	int rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_set_flags(env, flags);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, path, 0, 0644);
+	assert(!rc);
+
+	return env;
+}
+
+/* open_env opens an empty environment in the directory path */
+static trlmdb_env *open_env(const char *path, unsigned int flags)
+{
+	mkdir(path, 0755);
+	const char *files[] = {"data.mdb", "lock.mdb", "trlmdb.notify"};
+	for (size_t i = 0; i < sizeof files / sizeof files[0]; i++) {
+		char file[256];
+		snprintf(file, sizeof file, "%s/%s", path, files[i]);
+		unlink(file);
+	}
+
+	return reopen_env(path, flags);
+}
+
+/* copy_env copies the closed environment in the directory from to the directory to */
+static void copy_env(const char *from, const char *to)
+{
+	char from_file[256], to_file[256];
+	snprintf(from_file, sizeof from_file, "%s/data.mdb", from);
+	snprintf(to_file, sizeof to_file, "%s/data.mdb", to);
+
+	FILE *in = fopen(from_file, "rb");
+	FILE *out = fopen(to_file, "wb");
+	assert(in && out);
+
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof buf, in)) > 0) {
+		size_t nwritten = fwrite(buf, 1, n, out);
+		assert(nwritten == n);
+	}
+
+	fclose(in);
+	fclose(out);
+}
+
+/* node_time_count returns the number of node-times of node */
+static size_t node_time_count(trlmdb_env *env, char *node)
+{
+	trlmdb_txn *txn;
+	int rc = trlmdb_txn_begin(env, MDB_RDONLY, &txn);
+	assert(!rc);
+
+	size_t count = 0;
+	for (int lane = 0; lane < NLANES; lane++) {
+		MDB_cursor *cursor;
+		rc = mdb_cursor_open(txn->mdb_txn, env->dbi_node_time[lane], &cursor);
+		assert(!rc);
+
+		MDB_val key, data, time;
+		while (mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0)
+			count += node_time_split(env, &key, node, strlen(node), &time);
+		mdb_cursor_close(cursor);
+	}
+
+	trlmdb_txn_abort(txn);
+	return count;
+}
+
+/* paired_rstates returns the connections of node-1 in env_1 and node-2 in env_2 to each other, over
+ * a socket pair. Both connections use caps.
+ */
+static void paired_rstates(trlmdb_env *env_1, trlmdb_env *env_2, struct conf_info *conf_info, unsigned int caps, struct rstate **rs_1, struct rstate **rs_2)
+{
+	*conf_info = (struct conf_info) {0};
+	conf_info->timeout = 1000;
+	conf_info->read_budget = 1 << 20;
+
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(!rc);
+
+	char *nodes[] = {"node-1", "node-2"};
+	trlmdb_env *envs[] = {env_1, env_2};
+	struct rstate **rss[] = {rs_1, rs_2};
+	for (int i = 0; i < 2; i++) {
+		struct rstate *rs = rstate_alloc_init(envs[i], conf_info);
+		rs->node = nodes[i];
+		rs->remote_node = nodes[1 - i];
+		rs->node_msg_received = 1;
+		rs->read_caps = caps;
+		rs->write_caps = caps;
+		rs->socket_fd = fds[i];
+		*rss[i] = rs;
+	}
+}
+
+/* transfer writes the loaded messages of from and lets to store them */
+static void transfer(struct rstate *from, struct rstate *to)
+{
+	while (write_pending(from) && from->socket_fd != -1)
+		write_to_socket(from);
+
+	struct pollfd pollfd = {to->socket_fd, POLLIN, 0};
+	while (to->socket_fd != -1 && poll(&pollfd, 1, 0) == 1)
+		read_from_socket(to);
+
+	if (to->socket_fd != -1 && to->read_buf_loaded)
+		read_time_msg_from_buf(to);
+}
+
+/* put_value puts a value in its own txn */
+static void put_value(trlmdb_env *env, char *table, char *key, char *value)
+{
+	trlmdb_txn *txn;
+	int rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+
+	MDB_val key_val = {strlen(key), key};
+	MDB_val value_val = {strlen(value), value};
+	rc = trlmdb_put(txn, table, &key_val, &value_val);
+	assert(!rc);
+
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+}
+
+/* has_value returns 1 if the table has the value for the key */
+static int has_value(trlmdb_env *env, char *table, char *key, char *value)
+{
+	trlmdb_txn *txn;
+	int rc = trlmdb_txn_begin(env, MDB_RDONLY, &txn);
+	assert(!rc);
+
+	MDB_val key_val = {strlen(key), key};
+	MDB_val value_val;
+	rc = trlmdb_get(txn, table, &key_val, &value_val);
+	int has = rc == 0 && value_val.mv_size == strlen(value) && memcmp(value_val.mv_data, value, value_val.mv_size) == 0;
+
+	trlmdb_txn_abort(txn);
+	return has;
+}
+
+/* load_read_buf puts msg into the read buffer of rs and frees it */
+static void load_read_buf(struct rstate *rs, struct message *msg)
+{
+	assert(msg->size <= rs->read_buf_cap);
+	memcpy(rs->read_buf, msg->buf, msg->size);
+	rs->read_buf_start = 0;
+	rs->read_buf_size = msg->size;
+	rs->read_buf_loaded = 1;
+	msg_free(msg);
+}
+
+/* time_value_msg returns a v1 time message with a put time of value */
+static struct message *time_value_msg(uint8_t counter, char *key, size_t key_size, uint8_t *value, size_t value_size)
+{
+	uint8_t time[TIME_SIZE] = {0x60, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2};
+	time[TIME_SIZE - 1] = (uint8_t) (counter << 1) | 1;
+
+	struct message *msg = msg_alloc_init(256);
+	msg_append(msg, (uint8_t*) "time", 4);
+	msg_append(msg, (uint8_t*) "tf", 2);
+	msg_append(msg, time, TIME_SIZE);
+	msg_append(msg, (uint8_t*) key, key_size);
+	msg_append(msg, value, value_size);
+	return msg;
+}
+
+/* time_put_msg returns a v1 time message with a put time */
+static struct message *time_put_msg(uint8_t counter, char *key, size_t key_size)
+{
+	return time_value_msg(counter, key, key_size, (uint8_t*) "val", 3);
+}
+
+/* A time message is only acknowledged when it is stored */
+void test_read_time_ack(void)
+{
+	int rc = 0;
+
+	mkdir(TRLMDB_DATABASE_REPLICATOR, 0755);
+
+	trlmdb_env *env;
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_set_flags(env, TRLMDB_TABLE_DBIS);
+	assert(!rc);
+
+	/* The second table does not fit, so its inserts fail */
+	rc = trlmdb_env_set_maxtables(env, 1);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE_REPLICATOR, 0, 0644);
+	assert(!rc);
+
+	rc = trlmdb_node_add(env, "node-2");
+	assert(!rc);
+
+	struct conf_info conf_info;
+	int fds[2];
+	struct rstate *rs = connected_rstate(env, &conf_info, fds);
+
+	load_read_buf(rs, time_put_msg(1, "tbl-1\0key", 9));
+	read_time_msg_from_buf(rs);
+	assert(rs->socket_fd == fds[0]);
+	assert(rs->read_time_count == 1);
+	assert(rs->write_msg_loaded == 1);
+
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env, MDB_RDONLY, &txn);
+	assert(!rc);
+
+	MDB_val key = {3, "key"};
+	MDB_val val;
+	rc = trlmdb_get(txn, "tbl-1", &key, &val);
+	assert(!rc);
+	assert(val.mv_size == 3 && !memcmp(val.mv_data, "val", 3));
+	trlmdb_txn_abort(txn);
+
+	/* The insert fails with MDB_DBS_FULL, and the connection closes without an ack */
+	load_read_buf(rs, time_put_msg(2, "tbl-2\0key", 9));
+	read_time_msg_from_buf(rs);
+	assert(rs->socket_fd == -1);
+	assert(rs->write_msg_loaded == 1);
+
+	close(fds[1]);
+	rstate_free(rs);
+	trlmdb_env_close(env);
+}
+
+/* The send window doubles after a whole window is written and halves after a partial write, within
+ * its bounds.
+ */
+void test_write_window(void)
+{
+	trlmdb_env *env = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	struct conf_info conf_info;
+	int fds[2];
+	struct rstate *rs = connected_rstate(env, &conf_info, fds);
+
+	assert(rs->write_window == WRITE_WINDOW_MIN);
+	write_window_update(rs, WRITE_WINDOW_MIN, 100);
+	assert(rs->write_window == WRITE_WINDOW_MIN);
+
+	/* Less than a window does not grow the window */
+	write_window_update(rs, WRITE_WINDOW_MIN - 1, WRITE_WINDOW_MIN - 1);
+	assert(rs->write_window == WRITE_WINDOW_MIN);
+
+	uint64_t window = WRITE_WINDOW_MIN;
+	while (window < WRITE_WINDOW_MAX) {
+		write_window_update(rs, window, window);
+		window *= 2;
+		assert(rs->write_window == window);
+	}
+	write_window_update(rs, 2 * window, 2 * window);
+	assert(rs->write_window == WRITE_WINDOW_MAX);
+
+	write_window_update(rs, WRITE_WINDOW_MAX, WRITE_WINDOW_MAX - 1);
+	assert(rs->write_window == WRITE_WINDOW_MAX / 2);
+
+	close(fds[1]);
+	rstate_free(rs);
+	trlmdb_env_close(env);
+}
+
+/* push_msg loads a message of size bytes into the write ring of rs */
+static void push_msg(struct rstate *rs, uint64_t size)
+{
+	struct message *msg = write_msg_next(rs);
+	msg_reset(msg);
+	uint8_t data[256] = {0};
+	assert(size >= 28 && size - 28 <= sizeof data);
+	msg_append(msg, (uint8_t*) "test", 4);
+	msg_append(msg, data, size - 28);
+	write_msg_push(rs);
+}
+
+/* Partial writes remove the written bytes from the loaded messages across the end of the write ring */
+void test_write_msg_consume(void)
+{
+	trlmdb_env *env = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	struct conf_info conf_info;
+	int fds[2];
+	struct rstate *rs = connected_rstate(env, &conf_info, fds);
+	int cap = rs->write_msg_cap;
+
+	/* The head moves to the last slot of the ring */
+	for (int i = 0; i < cap - 1; i++)
+		push_msg(rs, 100);
+	assert(write_msg_consume(rs, (uint64_t) (cap - 1) * 100) == cap - 1);
+	assert(rs->write_msg_loaded == 0 && rs->write_bytes == 0);
+	assert(rs->write_msg_head == cap - 1);
+
+	/* Three messages wrap around the end of the ring */
+	push_msg(rs, 100);
+	push_msg(rs, 120);
+	push_msg(rs, 140);
+	assert(rs->write_msg_cap == cap);
+	assert(rs->write_bytes == 360);
+
+	assert(write_msg_consume(rs, 60) == 0);
+	assert(rs->write_msg_nwritten == 60 && rs->write_msg_head == cap - 1);
+	assert(write_msg_consume(rs, 40 + 120 + 10) == 2);
+	assert(rs->write_msg_head == 1 && rs->write_msg_loaded == 1);
+	assert(rs->write_msg_nwritten == 10 && rs->write_bytes == 130);
+
+	/* A partial write to the socket continues in the message at the head */
+	int sndbuf = 1;
+	int rc = setsockopt(rs->socket_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+	assert(!rc);
+	rc = fcntl(rs->socket_fd, F_SETFL, fcntl(rs->socket_fd, F_GETFL, 0) | O_NONBLOCK);
+	assert(rc != -1);
+	for (int i = 0; i < 4 * cap; i++)
+		push_msg(rs, 256);
+	assert(rs->write_msg_cap > cap);
+	uint64_t loaded = rs->write_bytes;
+	rs->write_window = 2 * WRITE_WINDOW_MIN;
+	write_to_socket(rs);
+	assert(rs->socket_fd != -1);
+	assert(rs->write_bytes > 0 && rs->write_bytes < loaded);
+	assert(rs->write_window == WRITE_WINDOW_MIN);
+
+	/* The socket has exactly the bytes that were removed from the loaded messages */
+	uint8_t buf[4096];
+	uint64_t nread = 0;
+	ssize_t n;
+	while ((n = recv(fds[1], buf, sizeof buf, MSG_DONTWAIT)) > 0)
+		nread += n;
+	assert(nread == loaded - rs->write_bytes);
+
+	close(fds[1]);
+	rstate_free(rs);
+	trlmdb_env_close(env);
+}
+
+/* A malformed frame closes the connection, and the time messages after it are not acknowledged */
+void test_read_frame_malformed(void)
+{
+	int rc = 0;
+
+	mkdir(TRLMDB_DATABASE_REPLICATOR, 0755);
+
+	trlmdb_env *env;
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE_REPLICATOR, 0, 0644);
+	assert(!rc);
+
+	struct conf_info conf_info;
+	int fds[2];
+	struct rstate *rs = connected_rstate(env, &conf_info, fds);
+
+	/* Frames are not switched on, so the frame is malformed */
+	struct message *msg = msg_alloc_init(256);
+	msg_append(msg, (uint8_t*) "frme", 4);
+	struct message *record = time_put_msg(3, "tbl-1\0key", 9);
+	msg_append(msg, record->buf, record->size);
+	msg_free(record);
+	record = time_put_msg(4, "tbl-1\0key", 9);
+	msg_append(msg, record->buf, record->size);
+	msg_free(record);
+
+	load_read_buf(rs, msg);
+	read_time_msg_from_buf(rs);
+	assert(rs->socket_fd == -1);
+	assert(rs->write_msg_loaded == 0);
+
+	close(fds[1]);
+	rstate_free(rs);
+	trlmdb_env_close(env);
+}
+
+/* A replicated catalog row that gives the id of a table to another table name closes the connection */
+void test_catalog_collision(void)
+{
+	trlmdb_env *env_1 = open_env(TRLMDB_DATABASE_REPLICATOR_1, TRLMDB_TABLE_IDS);
+	trlmdb_env *env_2 = open_env(TRLMDB_DATABASE_REPLICATOR_2, TRLMDB_TABLE_IDS);
+
+	int rc = trlmdb_node_add(env_1, "node-2");
+	assert(!rc);
+	rc = trlmdb_node_add(env_2, "node-1");
+	assert(!rc);
+
+	/* The two table names have the same id */
+	assert(table_id("tbl-472988", 10) == table_id("tbl-1027046", 11));
+	put_value(env_1, "tbl-472988", "key", "val-1");
+	put_value(env_2, "tbl-0", "key", "val-2");
+	put_value(env_2, "tbl-1027046", "key", "val-2");
+
+	struct conf_info conf_info;
+	struct rstate *rs_1, *rs_2;
+	paired_rstates(env_1, env_2, &conf_info, CAP_ACKS | CAP_TABLE_IDS, &rs_1, &rs_2);
+
+	load_write_msg(rs_2);
+	transfer(rs_2, rs_1);
+
+	/* The times before the colliding catalog row are stored, but none are acknowledged */
+	assert(rs_1->socket_fd == -1);
+	assert(rs_1->write_msg_loaded == 0);
+	assert(has_value(env_1, "tbl-0", "key", "val-2"));
+	assert(has_value(env_1, "tbl-472988", "key", "val-1"));
+
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env_1, MDB_RDONLY, &txn);
+	assert(!rc);
+	MDB_val name;
+	rc = trlmdb_catalog_get(txn, table_id("tbl-472988", 10), &name);
+	assert(!rc);
+	assert(name.mv_size == 10 && !memcmp(name.mv_data, "tbl-472988", 10));
+	trlmdb_txn_abort(txn);
+
+	close(rs_2->socket_fd);
+	rstate_free(rs_1);
+	rstate_free(rs_2);
+	trlmdb_env_close(env_1);
+	trlmdb_env_close(env_2);
+}
+
+/* The connection handles the caps message itself and leaves only the time messages to the applier */
+void test_applier_records(void)
+{
+	trlmdb_env *env = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+
+	struct conf_info conf_info;
+	int fds[2];
+	struct rstate *rs = connected_rstate(env, &conf_info, fds);
+	rs->applier = applier_create(env);
+
+	struct message *msg = msg_alloc_init(256);
+	write_caps(msg, "caps", CAP_ACKS | CAP_FRAMES);
+	load_read_buf(rs, msg);
+	msg = time_put_msg(5, "tbl-1\0key", 9);
+	memcpy(rs->read_buf + rs->read_buf_size, msg->buf, msg->size);
+	rs->read_buf_size += msg->size;
+	msg_free(msg);
+
+	read_time_msgs(rs, NULL);
+	assert(rs->caps_msg_received);
+	assert(rs->remote_caps == (CAP_ACKS | CAP_FRAMES));
+	assert(rs->napply_recs == 1);
+	assert(rs->read_time_count == 0);
+	assert(!has_value(env, "tbl-1", "key", "val"));
+
+	int rc = applier_run(rs->applier, rs);
+	assert(!rc);
+	assert(rs->napply_recs == 0);
+	assert(rs->read_time_count == 1);
+	assert(has_value(env, "tbl-1", "key", "val"));
+
+	close(fds[1]);
+	rstate_free(rs);
+	trlmdb_env_close(env);
+}
+
+/* Range reconciliation removes the node-times of the matching ranges on both nodes and splits the
+ * differing range until it is small enough for the time messages.
+ */
+void test_range_sync(void)
+{
+	trlmdb_env *env_1 = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	trlmdb_env *env_2 = open_env(TRLMDB_DATABASE_REPLICATOR_2, 0);
+	trlmdb_env_close(env_2);
+
+	/* Both nodes have the same 200 times, and node-1 has one more */
+	trlmdb_txn *txn;
+	int rc = trlmdb_txn_begin(env_1, 0, &txn);
+	assert(!rc);
+	for (int i = 0; i < 200; i++) {
+		char key[16];
+		snprintf(key, sizeof key, "key-%d", i);
+		MDB_val key_val = {strlen(key), key};
+		MDB_val value_val = {3, "val"};
+		rc = trlmdb_put(txn, "tbl-1", &key_val, &value_val);
+		assert(!rc);
+	}
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+	trlmdb_env_close(env_1);
+
+	copy_env(TRLMDB_DATABASE_REPLICATOR_1, TRLMDB_DATABASE_REPLICATOR_2);
+	env_1 = reopen_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	env_2 = reopen_env(TRLMDB_DATABASE_REPLICATOR_2, 0);
+	put_value(env_1, "tbl-1", "key-200", "val");
+
+	rc = trlmdb_node_add(env_1, "node-2");
+	assert(!rc);
+	rc = trlmdb_node_add(env_2, "node-1");
+	assert(!rc);
+	assert(node_time_count(env_1, "node-2") == 201);
+	assert(node_time_count(env_2, "node-1") == 200);
+
+	/* The whole range splits in RANGE_SYNC_PARTS parts of 13 times, and the last part has 6 */
+	struct range range = {.lo_size = 0, .hi_size = 0};
+	struct range parts[RANGE_SYNC_PARTS];
+	rc = trlmdb_txn_begin(env_1, MDB_RDONLY, &txn);
+	assert(!rc);
+	rc = range_stats(txn, &range);
+	assert(!rc);
+	assert(range.count == 201);
+	int nparts = range_split(txn, &range, parts);
+	assert(nparts == RANGE_SYNC_PARTS);
+	uint64_t total = 0;
+	for (int i = 0; i < nparts; i++) {
+		assert(parts[i].count == (i < nparts - 1 ? 13 : 6));
+		total += parts[i].count;
+	}
+	assert(total == range.count);
+	assert(parts[0].lo_size == 0 && parts[nparts - 1].hi_size == 0);
+	trlmdb_txn_abort(txn);
+
+	struct conf_info conf_info;
+	struct rstate *rs_1, *rs_2;
+	paired_rstates(env_1, env_2, &conf_info, CAP_ACKS | CAP_RANGE_SYNC, &rs_1, &rs_2);
+
+	start_range_sync(rs_1);
+	assert(rs_1->sync_state == SYNC_RUNNING);
+	assert(rs_1->sync_outstanding == 1);
+	assert(rs_1->write_msg_loaded == 1);
+
+	/* The whole range differs and splits */
+	transfer(rs_1, rs_2);
+	assert(rs_2->write_msg_loaded == 1);
+	transfer(rs_2, rs_1);
+	assert(rs_1->sync_outstanding == RANGE_SYNC_PARTS);
+	assert(rs_1->write_msg_loaded == RANGE_SYNC_PARTS);
+	assert(node_time_count(env_1, "node-2") == 201);
+
+	/* The first parts match, and the last part is left to the time messages */
+	transfer(rs_1, rs_2);
+	assert(rs_2->write_msg_loaded == RANGE_SYNC_PARTS);
+	assert(node_time_count(env_2, "node-1") == 5);
+	transfer(rs_2, rs_1);
+	assert(rs_1->socket_fd != -1 && rs_2->socket_fd != -1);
+	assert(rs_1->sync_outstanding == 0);
+	assert(rs_1->sync_state == SYNC_NONE);
+	assert(rs_1->write_msg_loaded == 0);
+	assert(node_time_count(env_1, "node-2") == 6);
+	assert(!trlmdb_node_sync_pending(env_1, "node-2"));
+	assert(trlmdb_node_sync_pending(env_2, "node-1"));
+
+	close(rs_2->socket_fd);
+	rstate_free(rs_1);
+	rstate_free(rs_2);
+	trlmdb_env_close(env_1);
+	trlmdb_env_close(env_2);
+}
+
+/* snapshot_write writes a node message, the snap header of node-1 and the bytes of a copy to the
+ * socket pair fds and closes the writing end.
+ */
+static void snapshot_write(int *fds, const char *copy, size_t size)
+{
+	struct message *msg = msg_alloc_init(64);
+	write_node(msg, "node-1");
+	int rc = write_all(fds[0], msg->buf, msg->size);
+	assert(!rc);
+	write_snap(msg, "node-1");
+	rc = write_all(fds[0], msg->buf, msg->size);
+	assert(!rc);
+	rc = write_all(fds[0], (uint8_t*) copy, size);
+	assert(!rc);
+	close(fds[0]);
+	msg_free(msg);
+}
+
+struct snapshot_server {
+	trlmdb_env *env;
+	int listen_fd;
+};
+
+/* snapshot_serve accepts one connection and answers its snap message as node-1 */
+static void *snapshot_serve(void *arg)
+{
+	struct snapshot_server *server = arg;
+	int socket_fd = accept(server->listen_fd, NULL, NULL);
+	assert(socket_fd != -1);
+
+	uint8_t buf[256];
+	uint64_t size = 0;
+	struct message *msg = NULL;
+	while (!msg) {
+		ssize_t nread = read(socket_fd, buf + size, sizeof buf - size);
+		assert(nread > 0);
+		size += nread;
+		msg = msg_from_buf(buf, size);
+	}
+
+	struct conf_info conf_info = {0};
+	char *accept_node[] = {"node-2"};
+	conf_info.node = "node-1";
+	conf_info.timeout = 1000;
+	conf_info.naccept = 1;
+	conf_info.accept_node = accept_node;
+	struct rstate *rs = rstate_alloc_init(server->env, &conf_info);
+	rs->socket_fd = socket_fd;
+
+	send_snapshot(rs, msg);
+	assert(rs->socket_fd == -1);
+
+	msg_free(msg);
+	rstate_free(rs);
+	return NULL;
+}
+
+/* A snapshot is copied with its header and trailer, and a truncated copy is rejected */
+void test_snapshot(void)
+{
+	char path[256];
+	mkdir(TRLMDB_DATABASE_REPLICATOR_2, 0755);
+	snprintf(path, sizeof path, "%s/data.mdb.snap", TRLMDB_DATABASE_REPLICATOR_2);
+
+	/* The node message before the header is skipped, and the trailer is removed */
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(!rc);
+	snapshot_write(fds, "copy" SNAP_TRAILER, 4 + SNAP_TRAILER_SIZE);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert(fd != -1);
+	struct message *header = NULL;
+	rc = read_snapshot(fds[1], fd, &header);
+	assert(!rc);
+	char *node = read_snap(header);
+	assert(node && strcmp(node, "node-1") == 0);
+	free(node);
+	msg_free(header);
+
+	char copy[16];
+	ssize_t nread = pread(fd, copy, sizeof copy, 0);
+	assert(nread == 4 && !memcmp(copy, "copy", 4));
+	close(fd);
+	close(fds[1]);
+
+	/* A copy without the whole trailer is truncated */
+	rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(!rc);
+	snapshot_write(fds, "copy" SNAP_TRAILER, 4 + SNAP_TRAILER_SIZE - 1);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert(fd != -1);
+	header = NULL;
+	rc = read_snapshot(fds[1], fd, &header);
+	assert(rc == EIO);
+	msg_free(header);
+	close(fd);
+	close(fds[1]);
+	unlink(path);
+
+	/* node-2 bootstraps from the snapshot of node-1 */
+	trlmdb_env *env_1 = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	put_value(env_1, "tbl-1", "key", "val");
+	rc = trlmdb_node_add(env_1, "node-2");
+	assert(!rc);
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env_1, 0, &txn);
+	assert(!rc);
+	rc = trlmdb_node_sync_done(txn, "node-2");
+	assert(!rc);
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+	assert(!trlmdb_node_sync_pending(env_1, "node-2"));
+
+	struct snapshot_server server = {env_1, socket(AF_INET, SOCK_STREAM, 0)};
+	assert(server.listen_fd != -1);
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof addr;
+	rc = bind(server.listen_fd, (struct sockaddr*) &addr, addr_len);
+	assert(!rc);
+	rc = listen(server.listen_fd, 1);
+	assert(!rc);
+	rc = getsockname(server.listen_fd, (struct sockaddr*) &addr, &addr_len);
+	assert(!rc);
+
+	pthread_t thread;
+	rc = pthread_create(&thread, NULL, snapshot_serve, &server);
+	assert(!rc);
+
+	char address[32];
+	snprintf(address, sizeof address, "127.0.0.1:%d", ntohs(addr.sin_port));
+	char *connect_node[] = {"node-1"};
+	char *connect_address[] = {address};
+	struct conf_info conf_info = {0};
+	conf_info.node = "node-2";
+	conf_info.database = TRLMDB_DATABASE_REPLICATOR_2;
+	conf_info.bootstrap_node = "node-1";
+	conf_info.nconnect = 1;
+	conf_info.connect_node = connect_node;
+	conf_info.connect_address = connect_address;
+	conf_info.connect_timeout = 1000;
+
+	snprintf(path, sizeof path, "%s/data.mdb", TRLMDB_DATABASE_REPLICATOR_2);
+	unlink(path);
+	assert(bootstrap_database(&conf_info) == 1);
+	rc = pthread_join(thread, NULL);
+	assert(!rc);
+	close(server.listen_fd);
+
+	/* The snapshot restarts the reconciliation of node-2 */
+	assert(trlmdb_node_sync_pending(env_1, "node-2"));
+	snprintf(path, sizeof path, "%s/data.mdb.snap", TRLMDB_DATABASE_REPLICATOR_2);
+	assert(access(path, F_OK) == -1);
+
+	/* An existing database is not replaced */
+	assert(bootstrap_database(&conf_info) == 0);
+
+	trlmdb_env *env_2 = reopen_env(TRLMDB_DATABASE_REPLICATOR_2, 0);
+	assert(has_value(env_2, "tbl-1", "key", "val"));
+
+	trlmdb_env_close(env_1);
+	trlmdb_env_close(env_2);
+}
+
+/* v2_round_trip checks that msg is the same after msg_to_v2 and msg_decode_v2, and that every prefix
+ * of the v2 message is incomplete.
+ */
+static void v2_round_trip(struct message *msg, struct message *decoded)
+{
+	struct message *v2 = msg_alloc_init(msg->size);
+	int rc = msg_copy(v2, msg->buf, msg->size);
+	assert(!rc);
+	rc = msg_to_v2(v2);
+	assert(!rc);
+	assert(v2->size < msg->size);
+
+	uint64_t consumed;
+	rc = msg_decode_v2(v2->buf, v2->size, &consumed, decoded);
+	assert(!rc);
+	assert(consumed == v2->size);
+	assert(decoded->size == msg->size && !memcmp(decoded->buf, msg->buf, msg->size));
+
+	for (uint64_t size = 0; size < v2->size; size++) {
+		rc = msg_decode_v2(v2->buf, size, &consumed, decoded);
+		assert(rc == 1);
+	}
+
+	msg_free(v2);
+}
+
+/* Every v2 type and flag round-trips, and invalid lengths are rejected */
+void test_msg_v2(void)
+{
+	struct message *msg = msg_alloc_init(256);
+	struct message *decoded = msg_alloc_init(256);
+	uint8_t data[200];
+	memset(data, 'd', sizeof data);
+
+	/* The flag field of a time message is tested below */
+	for (size_t type = 0; type < sizeof v2_types / sizeof v2_types[0]; type++) {
+		if (strcmp(v2_types[type], "time") == 0)
+			continue;
+		msg_reset(msg);
+		msg_append(msg, (uint8_t*) v2_types[type], 4);
+		msg_append(msg, data, 0);
+		msg_append(msg, data, sizeof data);
+		v2_round_trip(msg, decoded);
+	}
+
+	const char *flags[] = {"ff", "ft", "tf", "tt", "ffz", "ftz", "tfz", "ttz", "ffc", "ftc", "tfc", "ttc"};
+	for (size_t i = 0; i < sizeof flags / sizeof flags[0]; i++) {
+		struct message *time = time_put_msg(1, "tbl-1\0key", 9);
+		msg_reset(msg);
+		msg_append(msg, (uint8_t*) "time", 4);
+		msg_append(msg, (uint8_t*) flags[i], strlen(flags[i]));
+		for (uint64_t field = 2; field < msg_get_count(time); field++) {
+			uint8_t *field_data;
+			uint64_t field_size;
+			msg_get_elem(time, field, &field_data, &field_size);
+			msg_append(msg, field_data, field_size);
+		}
+		msg_free(time);
+		v2_round_trip(msg, decoded);
+	}
+
+	/* A length varint without its last byte, a field past the end, and a length over 10 bytes */
+	uint8_t field_varint[] = {3, 7, 0x85, 0x80};
+	uint8_t field_size[] = {3, 7, 5, 'a'};
+	uint8_t length_varint[VARINT_MAX_SIZE];
+	memset(length_varint, 0xff, sizeof length_varint);
+	uint64_t consumed;
+	assert(msg_decode_v2(field_varint, sizeof field_varint, &consumed, decoded) == EINVAL);
+	assert(msg_decode_v2(field_size, sizeof field_size, &consumed, decoded) == EINVAL);
+	assert(msg_decode_v2(length_varint, sizeof length_varint, &consumed, decoded) == EINVAL);
+	assert(msg_decode_v2(length_varint, sizeof length_varint - 1, &consumed, decoded) == 1);
+
+	/* A message that can not be decoded closes the connection */
+	trlmdb_env *env = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	struct conf_info conf_info;
+	int fds[2];
+	struct rstate *rs = connected_rstate(env, &conf_info, fds);
+	rs->read_caps |= CAP_WIRE_V2;
+	memcpy(rs->read_buf, field_size, sizeof field_size);
+	rs->read_buf_size = sizeof field_size;
+	rs->read_buf_loaded = 1;
+	read_time_msg_from_buf(rs);
+	assert(rs->socket_fd == -1);
+
+	close(fds[1]);
+	rstate_free(rs);
+	trlmdb_env_close(env);
+	msg_free(msg);
+	msg_free(decoded);
+}
+
+/* relay moves size bytes from the socket from to the socket to */
+static void relay(int from, int to, size_t size)
+{
+	uint8_t buf[4096];
+	while (size > 0) {
+		ssize_t nread = read(from, buf, size < sizeof buf ? size : sizeof buf);
+		assert(nread > 0);
+		int rc = write_all(to, buf, nread);
+		assert(!rc);
+		size -= nread;
+	}
+}
+
+/* relay_available moves the bytes that can be read from the socket from to the socket to */
+static void relay_available(int from, int to)
+{
+	uint8_t buf[4096];
+	ssize_t nread;
+	while ((nread = recv(from, buf, sizeof buf, MSG_DONTWAIT)) > 0) {
+		int rc = write_all(to, buf, nread);
+		assert(!rc);
+	}
+}
+
+/* A compressed stream is read when the opts message and the first compressed bytes arrive together,
+ * when a block is split across reads, and when the read budget leaves blocks compressed.
+ */
+void test_stream_compression(void)
+{
+	trlmdb_env *env_1 = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	trlmdb_env *env_2 = open_env(TRLMDB_DATABASE_REPLICATOR_2, 0);
+
+	/* The test relays the bytes from the socket of rs_1 to the socket of rs_2 */
+	struct conf_info conf_info_1, conf_info_2;
+	int fds_1[2], fds_2[2];
+	struct rstate *rs_1 = connected_rstate(env_1, &conf_info_1, fds_1);
+	struct rstate *rs_2 = connected_rstate(env_2, &conf_info_2, fds_2);
+	int rc = fcntl(rs_1->socket_fd, F_SETFL, fcntl(rs_1->socket_fd, F_GETFL, 0) | O_NONBLOCK);
+	assert(rc != -1);
+
+	rs_1->compress_stream = 1;
+	rs_1->remote_caps = CAP_ACKS | CAP_STREAM_LZ;
+	send_opts_msg(rs_1);
+	uint64_t opts_size = rs_1->write_bytes;
+	assert(rs_1->zwrite && rs_1->write_plain == 1);
+
+	/* Three values of random bytes make at least three blocks */
+	enum {NVALUES = 3, VALUE_SIZE = 50000};
+	uint8_t *values = tr_malloc(NVALUES * VALUE_SIZE);
+	srand(1);
+	for (int i = 0; i < NVALUES * VALUE_SIZE; i++)
+		values[i] = (uint8_t) rand();
+	for (int i = 0; i < NVALUES; i++) {
+		char key[16];
+		snprintf(key, sizeof key, "tbl-1%ckey-%d", 0, i);
+		struct message *msg = time_value_msg(i + 1, key, 11, values + i * VALUE_SIZE, VALUE_SIZE);
+		rc = msg_copy(write_msg_next(rs_1), msg->buf, msg->size);
+		assert(!rc);
+		write_msg_push(rs_1);
+		msg_free(msg);
+	}
+
+	/* The plain opts message and the first compressed bytes arrive in the same read */
+	write_to_socket(rs_1);
+	assert(rs_1->write_plain == 0);
+	write_to_socket(rs_1);
+	relay(fds_1[1], fds_2[1], opts_size + 10);
+	read_from_socket(rs_2);
+	assert(rs_2->read_buf_size == opts_size + 10);
+	read_time_msg_from_buf(rs_2);
+	assert(rs_2->socket_fd == fds_2[0]);
+	assert(rs_2->read_caps & CAP_STREAM_LZ);
+	assert(rs_2->zread && rs_2->zread_size == 10);
+	assert(!rs_2->read_buf_loaded && rs_2->read_buf_size == 0);
+
+	/* The rest of the first block is split across reads */
+	relay(fds_1[1], fds_2[1], 100);
+	read_from_socket(rs_2);
+	assert(rs_2->zread_size == 110);
+	assert(!rs_2->read_buf_loaded);
+
+	/* The read budget leaves the blocks after the first one compressed */
+	rs_2->read_budget = 1024;
+	int pending = 0;
+	struct pollfd pollfd = {fds_1[1], POLLIN, 0};
+	while (write_pending(rs_1) || poll(&pollfd, 1, 0) == 1) {
+		if (write_pending(rs_1))
+			write_to_socket(rs_1);
+		relay_available(fds_1[1], fds_2[1]);
+	}
+	assert(rs_1->socket_fd != -1);
+
+	struct pollfd pollfd_2 = {rs_2->socket_fd, POLLIN, 0};
+	while (rs_2->read_buf_loaded || rs_2->zread_pending || poll(&pollfd_2, 1, 0) == 1) {
+		if (rs_2->read_buf_loaded) {
+			read_time_msg_from_buf(rs_2);
+		} else {
+			read_from_socket(rs_2);
+			pending |= rs_2->zread_pending;
+		}
+		assert(rs_2->socket_fd != -1);
+	}
+	assert(pending);
+	assert(rs_2->read_time_count == NVALUES);
+
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env_2, MDB_RDONLY, &txn);
+	assert(!rc);
+	for (int i = 0; i < NVALUES; i++) {
+		char key[16];
+		MDB_val key_val = {snprintf(key, sizeof key, "key-%d", i), key};
+		MDB_val value_val;
+		rc = trlmdb_get(txn, "tbl-1", &key_val, &value_val);
+		assert(!rc);
+		assert(value_val.mv_size == VALUE_SIZE && !memcmp(value_val.mv_data, values + i * VALUE_SIZE, VALUE_SIZE));
+	}
+	trlmdb_txn_abort(txn);
+
+	free(values);
+	close(fds_1[1]);
+	close(fds_2[1]);
+	rstate_free(rs_1);
+	rstate_free(rs_2);
+	trlmdb_env_close(env_1);
+	trlmdb_env_close(env_2);
+}
+
+/* loaded_lanes describes the loaded messages of rs with one letter each: H for a time of the table
+ * "hi", L for a time of another table and c for a chunk.
+ */
+static void loaded_lanes(struct rstate *rs, char *lanes, size_t size)
+{
+	assert((size_t) rs->write_msg_loaded < size);
+	for (int i = 0; i < rs->write_msg_loaded; i++) {
+		struct message *msg = rs->write_msg[(rs->write_msg_head + i) % rs->write_msg_cap];
+		uint8_t *key;
+		uint64_t key_size;
+		if (msg_is_type(msg, "chnk")) {
+			lanes[i] = 'c';
+		} else {
+			assert(msg_is_type(msg, "time"));
+			msg_get_elem(msg, 3, &key, &key_size);
+			lanes[i] = key_size > 3 && !memcmp(key, "hi", 3) ? 'H' : 'L';
+		}
+	}
+	lanes[rs->write_msg_loaded] = '\0';
+}
+
+/* The high lane sends priority_weight times for each time of the normal lane, and the chunks of a
+ * value are sent together with its time.
+ */
+void test_write_lanes(void)
+{
+	trlmdb_env *env = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	char *tables[] = {"hi"};
+	int rc = trlmdb_tables_priority_set(env, tables, 1);
+	assert(!rc);
+	rc = trlmdb_node_add(env, "node-2");
+	assert(!rc);
+
+	/* The first time of the normal lane is a value of three chunks */
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+	MDB_val key_val = {5, "key-0"};
+	trlmdb_blob *blob;
+	rc = trlmdb_blob_put(txn, "lo", &key_val, &blob);
+	assert(!rc);
+	char *big = tr_malloc(2 * CHUNK_SIZE + 100);
+	memset(big, 'b', 2 * CHUNK_SIZE + 100);
+	rc = trlmdb_blob_write(blob, big, 2 * CHUNK_SIZE + 100);
+	assert(!rc);
+	free(big);
+	rc = trlmdb_blob_close(blob);
+	assert(!rc);
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+	put_value(env, "lo", "key-1", "val");
+	put_value(env, "lo", "key-2", "val");
+	for (int i = 0; i < 7; i++) {
+		char key[16];
+		snprintf(key, sizeof key, "key-%d", i);
+		put_value(env, "hi", key, "val");
+	}
+
+	struct conf_info conf_info;
+	int fds[2];
+	struct rstate *rs = connected_rstate(env, &conf_info, fds);
+	rs->priority_weight = 3;
+	rs->lane_credit = 3;
+	rs->write_caps = CAP_ACKS | CAP_CHUNKS;
+	rs->write_window = WRITE_WINDOW_MAX;
+	load_write_msg(rs);
+
+	char lanes[64];
+	loaded_lanes(rs, lanes, sizeof lanes);
+	assert(strcmp(lanes, "HHHcccLHHHLHL") == 0);
+
+	close(fds[1]);
+	rstate_free(rs);
+	trlmdb_env_close(env);
+}
+
+/* registered_conn returns a connection of node with remote_node, made by node if connect is set. Its
+ * wake_fd is the writing end of the pipe fds.
+ */
+static struct rstate *registered_conn(trlmdb_env *env, struct conf_info *conf_info, char *node, char *remote_node, int connect, int *fds)
+{
+	*conf_info = (struct conf_info) {0};
+	conf_info->node = node;
+	conf_info->timeout = 1000;
+
+	struct rstate *rs = rstate_alloc_init(env, conf_info);
+	rs->remote_node = remote_node;
+	rs->connect_node = connect ? strdup(remote_node) : NULL;
+	int rc = pipe(fds);
+	assert(!rc);
+	rs->wake_fd = fds[1];
+	return rs;
+}
+
+/* Of the two connections between two nodes, the one made by the node with the smaller name is kept,
+ * whichever node message is read first.
+ */
+void test_conn_registry(void)
+{
+	trlmdb_env *env = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	char *names[][2] = {{"node-1", "node-2"}, {"node-2", "node-1"}};
+
+	for (int i = 0; i < 2; i++) {
+		char *node = names[i][0];
+		char *remote_node = names[i][1];
+		int connect_kept = strcmp(node, remote_node) < 0;
+
+		for (int connect_first = 0; connect_first < 2; connect_first++) {
+			struct conn_registry *registry = conn_registry_create();
+			struct conf_info conf_info_accept, conf_info_connect;
+			int fds_accept[2], fds_connect[2];
+			struct rstate *accepted = registered_conn(env, &conf_info_accept, node, remote_node, 0, fds_accept);
+			struct rstate *connected = registered_conn(env, &conf_info_connect, node, remote_node, 1, fds_connect);
+			struct rstate *first = connect_first ? connected : accepted;
+			struct rstate *second = connect_first ? accepted : connected;
+			struct rstate *kept = connect_kept ? connected : accepted;
+			int *fds_first = connect_first ? fds_connect : fds_accept;
+
+			assert(conn_preferred(connected) == connect_kept);
+			assert(conn_preferred(accepted) == !connect_kept);
+			assert(!conn_waiting(registry, connected));
+
+			assert(conn_register(registry, first) == 0);
+			assert(!first->duplicate);
+			int rc = conn_register(registry, second);
+			if (second == kept) {
+				/* The first connection is told to close, and its thread is woken */
+				assert(rc == 0);
+				assert(first->duplicate);
+				uint64_t wake;
+				ssize_t nread = read(fds_first[0], &wake, sizeof wake);
+				assert(nread == sizeof wake && wake == 1);
+				conn_unregister(registry, first);
+			} else {
+				assert(rc == EEXIST);
+				assert(!second->registered);
+				assert(!first->duplicate);
+			}
+			assert(registry->nconns == 1 && registry->conns[0] == kept);
+
+			/* The connect connection waits while the accepted connection that is kept lasts */
+			assert(conn_waiting(registry, connected) == (kept == accepted));
+
+			close(fds_accept[0]);
+			close(fds_accept[1]);
+			close(fds_connect[0]);
+			close(fds_connect[1]);
+			rstate_free(accepted);
+			rstate_free(connected);
+			free(registry->conns);
+			pthread_mutex_destroy(&registry->mutex);
+			free(registry);
+		}
+	}
+
+	trlmdb_env_close(env);
+}
+
+/* loaded_msg returns the loaded message i of rs */
+static struct message *loaded_msg(struct rstate *rs, int i)
+{
+	assert(i < rs->write_msg_loaded);
+	return rs->write_msg[(rs->write_msg_head + i) % rs->write_msg_cap];
+}
+
+/* msg_time returns the time field of a v1 time message */
+static MDB_val msg_time(struct message *msg)
+{
+	uint8_t *data;
+	uint64_t size;
+	msg_get_elem(msg, 2, &data, &size);
+	return (MDB_val) {size, data};
+}
+
+/* A time message that is loaded for one remote node is copied from the send cache for another remote
+ * node with the same capabilities.
+ */
+void test_send_cache(void)
+{
+	trlmdb_env *env = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	int rc = trlmdb_node_add(env, "node-2");
+	assert(!rc);
+	rc = trlmdb_node_add(env, "node-3");
+	assert(!rc);
+	put_value(env, "tbl-1", "key-1", "val");
+	put_value(env, "tbl-1", "key-2", "val");
+
+	/* A chunked value */
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+	MDB_val key_val = {5, "key-3"};
+	trlmdb_blob *blob;
+	rc = trlmdb_blob_put(txn, "tbl-1", &key_val, &blob);
+	assert(!rc);
+	rc = trlmdb_blob_write(blob, "val", 3);
+	assert(!rc);
+	rc = trlmdb_blob_close(blob);
+	assert(!rc);
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+
+	struct send_cache *cache = send_cache_create();
+	unsigned int caps = CAP_ACKS | CAP_CHUNKS;
+	struct conf_info conf_info[3];
+	int fds[3][2];
+	struct rstate *rs[3];
+	char *remote_nodes[] = {"node-2", "node-3", "node-3"};
+	for (int i = 0; i < 3; i++) {
+		rs[i] = connected_rstate(env, conf_info + i, fds[i]);
+		rs[i]->remote_node = remote_nodes[i];
+		rs[i]->write_caps = i < 2 ? caps : caps | CAP_COMPACT_TIME;
+		rs[i]->send_cache = cache;
+	}
+
+	/* The two put messages are cached, and the chunk and time messages of the chunked value are not */
+	load_write_msg(rs[0]);
+	assert(rs[0]->write_msg_loaded == 4);
+	struct message *msg = msg_alloc_init(256);
+	uint64_t bytes = 0;
+	for (int i = 0; i < 4; i++) {
+		struct message *loaded = loaded_msg(rs[0], i);
+		if (!msg_is_type(loaded, "time"))
+			continue;
+		MDB_val time = msg_time(loaded);
+		rc = send_cache_get(cache, &time, caps, msg);
+		if (i < 2) {
+			assert(!rc);
+			assert(msg->size == loaded->size && !memcmp(msg->buf, loaded->buf, msg->size));
+			bytes += msg->size;
+		} else {
+			assert(rc == MDB_NOTFOUND);
+		}
+		assert(send_cache_get(cache, &time, caps | CAP_COMPACT_TIME, msg) == MDB_NOTFOUND);
+	}
+	assert(cache->bytes == bytes);
+
+	/* The cached messages are marked, so the copies from the cache can be told apart */
+	for (int i = 0; i < SEND_CACHE_SLOTS; i++) {
+		struct send_entry *entry = cache->slots[i];
+		if (entry)
+			entry->buf[entry->size - 1] = 'L';
+	}
+
+	load_write_msg(rs[1]);
+	assert(rs[1]->write_msg_loaded == 4);
+	for (int i = 0; i < 2; i++) {
+		struct message *loaded = loaded_msg(rs[1], i);
+		assert(loaded->buf[loaded->size - 1] == 'L');
+	}
+
+	/* Another remote node with other caps misses the cache, and its messages are cached too */
+	load_write_msg(rs[2]);
+	assert(rs[2]->write_msg_loaded == 4);
+	for (int i = 0; i < 2; i++) {
+		struct message *loaded = loaded_msg(rs[2], i);
+		assert(loaded->buf[loaded->size - 1] == 'l');
+	}
+	assert(cache->bytes > bytes);
+
+	/* A message with data from the memory map is not cached */
+	bytes = cache->bytes;
+	uint8_t time_buf[TIME_SIZE] = {0x70};
+	MDB_val time = {TIME_SIZE, time_buf};
+	msg_reset(msg);
+	msg_append(msg, (uint8_t*) "time", 4);
+	msg_append_ext(msg, (uint8_t*) "val", 3);
+	send_cache_put(cache, &time, caps, msg);
+	assert(cache->bytes == bytes);
+	assert(send_cache_get(cache, &time, caps, msg) == MDB_NOTFOUND);
+
+	/* The entries take at most SEND_CACHE_MAX_BYTES */
+	uint8_t *value = tr_malloc(SEND_CACHE_RECORD_MAX);
+	memset(value, 'v', SEND_CACHE_RECORD_MAX);
+	int nputs = 2 * SEND_CACHE_MAX_BYTES / SEND_CACHE_RECORD_MAX;
+	int ncached = 0;
+	for (int i = 0; i < nputs; i++) {
+		encode_uint64(time_buf + 8, i);
+		msg_reset(msg);
+		msg_append(msg, (uint8_t*) "time", 4);
+		msg_append(msg, value, SEND_CACHE_RECORD_MAX - 32);
+		send_cache_put(cache, &time, caps, msg);
+		assert(cache->bytes <= SEND_CACHE_MAX_BYTES);
+	}
+	for (int i = 0; i < nputs; i++) {
+		encode_uint64(time_buf + 8, i);
+		ncached += send_cache_get(cache, &time, caps, msg) == 0;
+	}
+	assert(ncached > 0 && ncached < nputs);
+	assert(cache->bytes > SEND_CACHE_MAX_BYTES - SEND_CACHE_RECORD_MAX);
+	free(value);
+
+	for (int i = 0; i < 3; i++) {
+		close(fds[i][1]);
+		rstate_free(rs[i]);
+	}
+	for (int i = 0; i < SEND_CACHE_SLOTS; i++) {
+		if (cache->slots[i])
+			send_entry_release(cache, cache->slots[i]);
+	}
+	assert(cache->bytes == 0);
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+	msg_free(msg);
+	trlmdb_env_close(env);
+}
+
+/* The reconnect delay backs off within its bounds after failed connects, such as a refused
+ * non-blocking connect, and is reset by a node message.
+ */
+void test_reconnect(void)
+{
+	trlmdb_env *env = open_env(TRLMDB_DATABASE_REPLICATOR_1, 0);
+	struct conf_info conf_info = {0};
+	conf_info.node = "node-1";
+	conf_info.timeout = 1000;
+	conf_info.connect_timeout = 1000;
+	conf_info.reconnect_min = 100;
+	conf_info.reconnect_max = 1000;
+	conf_info.read_budget = 1 << 20;
+	struct rstate *rs = rstate_alloc_init(env, &conf_info);
+	rs->connect_node = strdup("node-2");
+
+	/* The port of a closed listening socket refuses the connect */
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(listen_fd != -1);
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof addr;
+	int rc = bind(listen_fd, (struct sockaddr*) &addr, addr_len);
+	assert(!rc);
+	rc = getsockname(listen_fd, (struct sockaddr*) &addr, &addr_len);
+	assert(!rc);
+	close(listen_fd);
+
+	char servname[16];
+	snprintf(servname, sizeof servname, "%d", ntohs(addr.sin_port));
+	rs->connect_hostname = strdup("127.0.0.1");
+	rs->connect_servname = strdup(servname);
+
+	assert(reconnect_delay(rs) == 0);
+	for (int failures = 1; failures <= 8; failures++) {
+		connect_to_remote(rs);
+		assert(rs->socket_fd != -1 && rs->connecting);
+		struct pollfd pollfd = {rs->socket_fd, POLLOUT, 0};
+		rc = poll(&pollfd, 1, 1000);
+		assert(rc == 1);
+		rs->socket_writable = 1;
+		connect_finish(rs);
+		assert(rs->socket_fd == -1 && !rs->connecting);
+		assert(rs->connect_failures == failures);
+
+		int backoff = 100;
+		for (int i = 1; i < failures && backoff < 1000; i++)
+			backoff *= 2;
+		if (backoff > 1000)
+			backoff = 1000;
+		for (int i = 0; i < 100; i++) {
+			int delay = reconnect_delay(rs);
+			assert(delay >= conf_info.reconnect_min / 2 && delay <= conf_info.reconnect_max);
+			assert(delay >= backoff / 2 && delay <= backoff);
+		}
+	}
+
+	/* The node message of the remote node resets the delay */
+	int fds[2];
+	rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(!rc);
+	rs->socket_fd = fds[0];
+	struct message *msg = msg_alloc_init(64);
+	write_node(msg, "node-2");
+	load_read_buf(rs, msg);
+	read_node_msg_from_buf(rs);
+	assert(rs->node_msg_received);
+	assert(rs->connect_failures == 0);
+	assert(reconnect_delay(rs) == 0);
+
+	close(fds[1]);
+	free(rs->remote_node);
+	rstate_free(rs);
+	trlmdb_env_close(env);
+}
@@ -2,16 +2,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "trlmdb.h"
 
 #define TRLMDB_DATABASE "./databases/trlmdb-single"
+#define TRLMDB_DATABASE_IDS "./databases/trlmdb-single-ids"
+#define TRLMDB_DATABASE_COMPACT "./databases/trlmdb-single-compact"
+#define TRLMDB_DATABASE_DBIS "./databases/trlmdb-single-dbis"
 
 void test(void);
+void test_codec(void);
+void test_table_ids(void);
+void test_compact_time(void);
+void test_blob(void);
+void test_table_dbis(void);
 
 int main (void)
 {
 	test();
+	test_codec();
+	test_table_ids();
+	test_compact_time();
+	test_blob();
+	test_table_dbis();
 	printf("All tests passed\n");
 	return 0;
 }
@@ -321,3 +336,451 @@ void test(void)
 	
 	trlmdb_env_close(env_1);
 }
+
+void test_codec(void)
+{
+	int rc = 0;
+
+	trlmdb_env *env;
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_set_codec(env, 100, 0);
+	assert(rc == EINVAL);
+
+	rc = trlmdb_env_set_codec(env, TRLMDB_CODEC_LZ, 64);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE, 0, 0644);
+	assert(!rc);
+
+	char buf[4000];
+	for (size_t i = 0; i < sizeof buf; i++) {
+		buf[i] = "{\"key\": \"value\", \"n\": 12}"[i % 28] + (i % 1000 == 0);
+	}
+
+	char *table = "table-codec";
+	MDB_val key_1 = {5, "key_1"};
+	MDB_val val_1 = {sizeof buf, buf};
+	MDB_val key_2 = {5, "key_2"};
+	MDB_val val_2 = {10, "short-val2"};
+
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+
+	rc = trlmdb_put(txn, table, &key_1, &val_1);
+	assert(!rc);
+
+	rc = trlmdb_put(txn, table, &key_2, &val_2);
+	assert(!rc);
+
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+
+	rc = trlmdb_txn_begin(env, MDB_RDONLY, &txn);
+	assert(!rc);
+
+	MDB_val val, val_again;
+	rc = trlmdb_get(txn, table, &key_1, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&val, &val_1));
+
+	rc = trlmdb_get(txn, table, &key_2, &val_again);
+	assert(!rc);
+	assert(!cmp_mdb_val(&val_again, &val_2));
+	assert(!cmp_mdb_val(&val, &val_1));
+
+	trlmdb_cursor *cursor;
+	rc = trlmdb_cursor_open(txn, table, &cursor);
+	assert(!rc);
+
+	rc = trlmdb_cursor_first(cursor);
+	assert(!rc);
+
+	MDB_val key;
+	rc = trlmdb_cursor_get(cursor, &key, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&key, &key_1));
+	assert(!cmp_mdb_val(&val, &val_1));
+
+	trlmdb_cursor_close(cursor);
+	trlmdb_txn_abort(txn);
+	trlmdb_env_close(env);
+}
+
+void test_table_ids(void)
+{
+	int rc = 0;
+
+	mkdir(TRLMDB_DATABASE_IDS, 0755);
+
+	trlmdb_env *env;
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_set_flags(env, TRLMDB_TABLE_IDS);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE_IDS, 0, 0644);
+	assert(!rc);
+
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+
+	char *table_1 = "a-rather-long-table-name-1";
+	char *table_2 = "a-rather-long-table-name-2";
+	MDB_val key_1 = {5, "key_1"};
+	MDB_val val_1 = {5, "val_1"};
+	MDB_val key_2 = {5, "key_2"};
+	MDB_val val_2 = {5, "val_2"};
+
+	rc = trlmdb_put(txn, table_1, &key_1, &val_1);
+	assert(!rc);
+
+	rc = trlmdb_put(txn, table_2, &key_1, &val_2);
+	assert(!rc);
+
+	rc = trlmdb_put(txn, table_2, &key_2, &val_2);
+	assert(!rc);
+
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+
+	trlmdb_env_close(env);
+
+	/* The flags are stored in the database */
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE_IDS, 0, 0644);
+	assert(!rc);
+
+	rc = trlmdb_txn_begin(env, MDB_RDONLY, &txn);
+	assert(!rc);
+
+	MDB_val key, val;
+	rc = trlmdb_get(txn, table_1, &key_1, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&val, &val_1));
+
+	rc = trlmdb_get(txn, table_2, &key_1, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&val, &val_2));
+
+	trlmdb_cursor *cursor;
+	rc = trlmdb_cursor_open(txn, table_2, &cursor);
+	assert(!rc);
+
+	rc = trlmdb_cursor_last(cursor);
+	assert(!rc);
+
+	rc = trlmdb_cursor_get(cursor, &key, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&key, &key_2));
+
+	rc = trlmdb_cursor_prev(cursor);
+	assert(!rc);
+
+	rc = trlmdb_cursor_get(cursor, &key, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&key, &key_1));
+
+	rc = trlmdb_cursor_prev(cursor);
+	assert(rc == MDB_NOTFOUND);
+
+	trlmdb_cursor_close(cursor);
+	trlmdb_txn_abort(txn);
+	trlmdb_env_close(env);
+}
+
+void test_compact_time(void)
+{
+	int rc = 0;
+
+	mkdir(TRLMDB_DATABASE_COMPACT, 0755);
+
+	trlmdb_env *env;
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_set_flags(env, TRLMDB_COMPACT_TIME);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE_COMPACT, 0, 0644);
+	assert(!rc);
+
+	/* More than 64 operations make the counter longer than a byte */
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+
+	char key_buf[16];
+	MDB_val val_1 = {5, "val_1"};
+	MDB_val val_2 = {5, "val_2"};
+	for (int i = 0; i < 300; i++) {
+		MDB_val key = {sprintf(key_buf, "key_%d", i), key_buf};
+		rc = trlmdb_put(txn, "table", &key, &val_1);
+		assert(!rc);
+	}
+
+	for (int i = 0; i < 300; i += 2) {
+		MDB_val key = {sprintf(key_buf, "key_%d", i), key_buf};
+		rc = trlmdb_del(txn, "table", &key);
+		assert(!rc);
+	}
+
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+
+	/* A later transaction wins over a higher counter in an earlier one */
+	rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+
+	MDB_val key_1 = {5, "key_1"};
+	rc = trlmdb_put(txn, "table", &key_1, &val_2);
+	assert(!rc);
+
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+
+	rc = trlmdb_txn_begin(env, MDB_RDONLY, &txn);
+	assert(!rc);
+
+	MDB_val val;
+	for (int i = 0; i < 300; i++) {
+		MDB_val key = {sprintf(key_buf, "key_%d", i), key_buf};
+		rc = trlmdb_get(txn, "table", &key, &val);
+		if (i % 2 == 0) {
+			assert(rc == MDB_NOTFOUND);
+		} else {
+			assert(!rc);
+			assert(!cmp_mdb_val(&val, i == 1 ? &val_2 : &val_1));
+		}
+	}
+
+	trlmdb_txn_abort(txn);
+	trlmdb_env_close(env);
+
+	/* The del of key_0 has counter 600, and the put of key_1 has counter 1 */
+	MDB_env *mdb_env;
+	rc = mdb_env_create(&mdb_env);
+	assert(!rc);
+
+	rc = mdb_env_set_maxdbs(mdb_env, 16);
+	assert(!rc);
+
+	rc = mdb_env_open(mdb_env, TRLMDB_DATABASE_COMPACT, MDB_RDONLY, 0644);
+	assert(!rc);
+
+	MDB_txn *mdb_txn;
+	rc = mdb_txn_begin(mdb_env, NULL, MDB_RDONLY, &mdb_txn);
+	assert(!rc);
+
+	MDB_dbi dbi;
+	rc = mdb_dbi_open(mdb_txn, "db_key_to_time", 0, &dbi);
+	assert(!rc);
+
+	MDB_val table_key = {11, "table\0key_0"};
+	MDB_val time_val;
+	rc = mdb_get(mdb_txn, dbi, &table_key, &time_val);
+	assert(!rc);
+	assert(time_val.mv_size == 15);
+
+	table_key = (MDB_val) {11, "table\0key_1"};
+	rc = mdb_get(mdb_txn, dbi, &table_key, &time_val);
+	assert(!rc);
+	assert(time_val.mv_size == 13);
+
+	mdb_txn_abort(mdb_txn);
+	mdb_env_close(mdb_env);
+}
+
+void test_blob(void)
+{
+	int rc = 0;
+
+	trlmdb_env *env;
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE, 0, 0644);
+	assert(!rc);
+
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+
+	/* Three full chunks and a partial one */
+	size_t blob_size = 3 * 65536 + 1000;
+	uint8_t *buf = malloc(blob_size);
+	for (size_t i = 0; i < blob_size; i++) {
+		buf[i] = (uint8_t) (i * 7 + i / 1000);
+	}
+
+	MDB_val key = {4, "blob"};
+	trlmdb_blob *blob;
+	rc = trlmdb_blob_put(txn, "blobs", &key, &blob);
+	assert(!rc);
+
+	for (size_t offset = 0; offset < blob_size; offset += 10000) {
+		size_t size = blob_size - offset < 10000 ? blob_size - offset : 10000;
+		rc = trlmdb_blob_write(blob, buf + offset, size);
+		assert(!rc);
+	}
+
+	rc = trlmdb_blob_close(blob);
+	assert(!rc);
+
+	MDB_val small_key = {5, "small"};
+	MDB_val small_val = {5, "value"};
+	rc = trlmdb_put(txn, "blobs", &small_key, &small_val);
+	assert(!rc);
+
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+
+	rc = trlmdb_txn_begin(env, MDB_RDONLY, &txn);
+	assert(!rc);
+
+	rc = trlmdb_blob_open(txn, "blobs", &key, &blob);
+	assert(!rc);
+
+	MDB_val chunk;
+	size_t offset = 0;
+	int nchunks = 0;
+	while ((rc = trlmdb_blob_read(blob, &chunk)) == 0) {
+		assert(offset + chunk.mv_size <= blob_size);
+		assert(memcmp(chunk.mv_data, buf + offset, chunk.mv_size) == 0);
+		offset += chunk.mv_size;
+		nchunks++;
+	}
+	assert(rc == MDB_NOTFOUND);
+	assert(offset == blob_size);
+	assert(nchunks == 4);
+
+	rc = trlmdb_blob_close(blob);
+	assert(!rc);
+
+	/* trlmdb_get assembles the chunks */
+	MDB_val val;
+	rc = trlmdb_get(txn, "blobs", &key, &val);
+	assert(!rc);
+	assert(val.mv_size == blob_size);
+	assert(memcmp(val.mv_data, buf, blob_size) == 0);
+
+	/* An ordinary value is a single chunk */
+	rc = trlmdb_blob_open(txn, "blobs", &small_key, &blob);
+	assert(!rc);
+
+	rc = trlmdb_blob_read(blob, &chunk);
+	assert(!rc);
+	assert(!cmp_mdb_val(&chunk, &small_val));
+
+	rc = trlmdb_blob_read(blob, &chunk);
+	assert(rc == MDB_NOTFOUND);
+
+	rc = trlmdb_blob_close(blob);
+	assert(!rc);
+
+	trlmdb_txn_abort(txn);
+	trlmdb_env_close(env);
+	free(buf);
+}
+
+void test_table_dbis(void)
+{
+	int rc = 0;
+
+	mkdir(TRLMDB_DATABASE_DBIS, 0755);
+
+	trlmdb_env *env;
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_set_flags(env, TRLMDB_TABLE_DBIS);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE_DBIS, 0, 0644);
+	assert(!rc);
+
+	trlmdb_txn *txn;
+	rc = trlmdb_txn_begin(env, 0, &txn);
+	assert(!rc);
+
+	MDB_val key_1 = {5, "key_1"};
+	MDB_val key_2 = {5, "key_2"};
+	MDB_val val_1 = {5, "val_1"};
+	MDB_val val_2 = {5, "val_2"};
+
+	rc = trlmdb_put(txn, "dbis-1", &key_1, &val_1);
+	assert(!rc);
+
+	rc = trlmdb_put(txn, "dbis-1", &key_2, &val_2);
+	assert(!rc);
+
+	rc = trlmdb_put(txn, "dbis-2", &key_1, &val_2);
+	assert(!rc);
+
+	rc = trlmdb_txn_commit(txn);
+	assert(!rc);
+
+	trlmdb_env_close(env);
+
+	/* The flags are stored in the database, and the table databases are opened again */
+	rc = trlmdb_env_create(&env);
+	assert(!rc);
+
+	rc = trlmdb_env_open(env, TRLMDB_DATABASE_DBIS, 0, 0644);
+	assert(!rc);
+
+	rc = trlmdb_txn_begin(env, MDB_RDONLY, &txn);
+	assert(!rc);
+
+	MDB_val key, val;
+	rc = trlmdb_get(txn, "dbis-2", &key_1, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&val, &val_2));
+
+	rc = trlmdb_get(txn, "dbis-2", &key_2, &val);
+	assert(rc == MDB_NOTFOUND);
+
+	rc = trlmdb_get(txn, "dbis-3", &key_1, &val);
+	assert(rc == MDB_NOTFOUND);
+
+	trlmdb_cursor *cursor;
+	rc = trlmdb_cursor_open(txn, "dbis-1", &cursor);
+	assert(!rc);
+
+	rc = trlmdb_cursor_last(cursor);
+	assert(!rc);
+
+	rc = trlmdb_cursor_get(cursor, &key, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&key, &key_2));
+	assert(!cmp_mdb_val(&val, &val_2));
+
+	rc = trlmdb_cursor_prev(cursor);
+	assert(!rc);
+
+	rc = trlmdb_cursor_get(cursor, &key, &val);
+	assert(!rc);
+	assert(!cmp_mdb_val(&key, &key_1));
+
+	rc = trlmdb_cursor_prev(cursor);
+	assert(rc == MDB_NOTFOUND);
+
+	trlmdb_cursor_close(cursor);
+
+	/* A table that does not exist is empty */
+	rc = trlmdb_cursor_open(txn, "dbis-3", &cursor);
+	assert(!rc);
+
+	rc = trlmdb_cursor_first(cursor);
+	assert(rc == MDB_NOTFOUND);
+
+	trlmdb_cursor_close(cursor);
+	trlmdb_txn_abort(txn);
+	trlmdb_env_close(env);
+}
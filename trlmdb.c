@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <ctype.h>
@@ -13,16 +14,112 @@
 #include <pthread.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#ifdef TRLMDB_ZLIB
+#include <zlib.h>
+#endif
 
 #include "lmdb.h"
+#include "trlmdb.h"
 
 #define DB_TIME_TO_KEY "db_time_to_key"
 #define DB_TIME_TO_DATA "db_time_to_data"
+#define DB_TIME_TO_ZDATA "db_time_to_zdata"
+#define DB_TIME_TO_CHUNK "db_time_to_chunk"
 #define DB_KEY_TO_TIME "db_key_to_time"
 #define DB_NODES "db_nodes"
 #define DB_NODE_TIME "db_node_time"
+#define DB_NODE_TIME_HIGH "db_node_time_high"
+#define DB_TABLE_PRIORITY "db_table_priority"
+#define DB_META "db_meta"
+
+/* The number of LMDB databases above, and the default number of table databases with TRLMDB_TABLE_DBIS */
+#define N_INTERNAL_DBS 10
+#define DEFAULT_MAX_TABLES 120
+
+/* The send window is the number of bytes that are loaded for writing. It adapts between the limits. */
+#define WRITE_WINDOW_MIN 65536
+#define WRITE_WINDOW_MAX 16777216
+#define WRITE_MSG_INIT 64
+#define WRITE_MAX_IOV 1024
+
+/* An event thread runs a connection for at most EVENT_BATCH iterations before it turns to the others */
+#define EVENT_BATCH 64
+#define EVENT_MAX_EVENTS 64
+
+/* The scan deletes the node-times that both nodes know when it has collected this many */
+#define NODE_TIME_DELS_MAX 4096
+
+/* The most read buffers and bytes that the applier commits in one txn */
+#define APPLY_MAX_JOBS 64
+#define APPLY_MAX_BYTES 16777216
+
+/* The send cache of time messages that are shared by the connections */
+#define SEND_CACHE_SLOTS 4096
+#define SEND_CACHE_RECORD_MAX 65536
+#define SEND_CACHE_MAX_BYTES 16777216
+
+#define VARINT_MAX_SIZE 10
+
+/* The most fields that msg_parse indexes */
+#define MSG_FIELDS_MAX 8
+
+/* Sizes of an encoded time, see "time stamps" below */
+#define TIME_SIZE 20
+#define TIME_MAX_SIZE 21
+
+/* Capabilities are advertised in "caps" messages and switched on in "opts" messages */
+#define CAP_CODEC_LZ 0x01
+#define CAP_CODEC_ZLIB 0x02
+#define CAP_TABLE_IDS 0x04
+#define CAP_COMPACT_TIME 0x08
+#define CAP_CHUNKS 0x10
+#define CAP_WIRE_V2 0x20
+#define CAP_FRAMES 0x40
+#define CAP_STREAM_LZ 0x80
+#define CAP_RANGE_SYNC 0x100
+#define CAP_ACKS 0x200
+
+/* Range reconciliation splits a differing range in RANGE_SYNC_PARTS ranges, unless it has at most
+ * RANGE_SYNC_LEAF times, which are left to the time messages.
+ */
+#define RANGE_SYNC_PARTS 16
+#define RANGE_SYNC_LEAF 64
+
+/* The states of range reconciliation on a connection */
+#define SYNC_NONE 0
+#define SYNC_PENDING 1
+#define SYNC_RUNNING 2
+
+/* A frame message packs time and chunk messages until it reaches either limit */
+#define FRAME_MAX_RECORDS 1000
+#define FRAME_MAX_SIZE 262144
+
+/* Values written with the blob functions are stored and replicated in chunks of this size */
+#define CHUNK_SIZE 65536
+
+/* With send_from_map, values and chunks of at least MAP_SEND_MIN bytes are written from the memory map */
+#define MAP_SEND_MIN 16384
+
+/* The node-times of the tables with priority are in a lane of their own */
+#define LANE_HIGH 0
+#define LANE_NORMAL 1
+#define NLANES 2
 
-#define N_WRITE_MSG 50
+/* Where trlmdb_insert_time_key_data stores the value of a put */
+#define STORE_DATA 0
+#define STORE_ZDATA 1
+#define STORE_CHUNKS 2
 
 /* Structs */
 
@@ -36,12 +133,43 @@ struct conf_info {
 	int nconnect;
 	char **connect_node;
 	char **connect_address;
+	unsigned int database_flags;
+	unsigned int max_tables;
+	int compress_stream;
+	char *bootstrap_node;
+	int send_from_map;
+	int event_threads;
+	int notify_interval;
+	int reconnect_min;
+	int reconnect_max;
+	int connect_timeout;
+	int group_commit;
+	int read_budget;
+	int npriority;
+	char **priority_table;
+	int priority_weight;
 };
 
 struct message {
 	uint8_t *buf;
 	uint64_t size;
 	uint64_t cap;
+	uint8_t *ext;  /* the data of the last field when it is not copied into buf */
+	uint64_t ext_size;
+};
+
+/* The fields of a message, indexed by msg_parse */
+struct msg_fields {
+	uint64_t count;
+	uint8_t *data[MSG_FIELDS_MAX];
+	uint64_t size[MSG_FIELDS_MAX];
+};
+
+struct codec {
+	const char *name;
+	unsigned int cap;
+	size_t (*compress)(const uint8_t *src, size_t size, uint8_t *dst, size_t cap);
+	int (*decompress)(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size);
 };
 
 struct time {
@@ -51,14 +179,60 @@ struct time {
 	uint64_t counter;
 };
 
+/* A table in the catalog of an environment with TRLMDB_TABLE_IDS */
+struct table_entry {
+	uint32_t id;
+	char *name;
+};
+
+/* An open table database in an environment with TRLMDB_TABLE_DBIS */
+struct table_dbi {
+	MDB_val prefix;  /* the table part of the extended keys */
+	MDB_dbi dbi;
+};
+
 struct trlmdb_env {
 	MDB_env *mdb_env;
 	uint8_t time_id[4];
 	MDB_dbi dbi_time_to_key;
 	MDB_dbi dbi_time_to_data;
+	MDB_dbi dbi_time_to_zdata;
+	MDB_dbi dbi_time_to_chunk;
 	MDB_dbi dbi_key_to_time;
 	MDB_dbi dbi_nodes;
-	MDB_dbi dbi_node_time;
+	MDB_dbi dbi_node_time[NLANES];  /* db_node_time_high and db_node_time */
+	MDB_dbi dbi_table_priority;
+	MDB_dbi dbi_meta;
+	unsigned int flags;
+	int codec;
+	size_t codec_min_size;
+	pthread_mutex_t table_mutex;
+	struct table_entry *tables;  /* committed catalog entries sorted by id */
+	size_t ntables;
+	pthread_mutex_t dbi_mutex;
+	struct table_dbi *table_dbis;  /* committed table databases sorted by prefix */
+	size_t ntable_dbis;
+	unsigned int max_tables;
+	uint64_t map_size;
+	struct commit_notify *notify;  /* the shared commit counter, or NULL */
+	pthread_mutex_t notify_mutex;
+	int *notify_fds;  /* eventfds that are written when the commit counter changes */
+	size_t nnotify_fds;
+	int notify_interval;  /* the minimum milliseconds between two writes of notify_fds */
+};
+
+/* The commit counter in the notification file of an environment */
+struct commit_notify {
+	uint32_t seq;
+	uint32_t waiters;
+};
+
+/* Decompressed values live in decode blocks until the transaction ends */
+struct decode_block {
+	struct decode_block *next;
+	size_t cap;
+	size_t used;
+	uint8_t data[];
 };
 
 struct trlmdb_txn {
@@ -66,12 +240,57 @@ struct trlmdb_txn {
 	struct trlmdb_env *env;
 	unsigned int flags;
 	struct time *time;
+	struct decode_block *decode_blocks;
+	struct table_entry *new_tables;  /* catalog entries seen in this transaction */
+	size_t n_new_tables;
+	struct table_dbi *new_table_dbis;  /* table databases opened in this transaction */
+	size_t n_new_table_dbis;
+	int dbi_locked;
+	int notify;  /* the commit inserts times */
 };
 
 struct trlmdb_cursor {
 	struct trlmdb_txn *txn;
 	MDB_cursor *mdb_cursor;
-	char *table;
+	MDB_val *prefix;  /* the extended key prefix of the table */
+};
+
+/* A range of times from lo to hi, excluding hi, in the format of the database */
+struct range {
+	uint8_t lo[TIME_MAX_SIZE];
+	size_t lo_size;  /* 0 for no lower bound */
+	uint8_t hi[TIME_MAX_SIZE];
+	size_t hi_size;  /* 0 for no upper bound */
+	uint64_t count;
+	uint64_t hash;
+};
+
+/* A time message that is sent and not acknowledged yet */
+struct sent_time {
+	uint8_t time[TIME_MAX_SIZE];
+	uint8_t size;
+	uint8_t clear;  /* the ack removes the node-time */
+};
+
+/* Keys in one buffer, each preceded by its 8 byte size */
+struct key_list {
+	uint8_t *buf;
+	size_t size;
+	size_t cap;
+	size_t count;
+};
+
+/* A blob is either written or read in chunks */
+struct trlmdb_blob {
+	struct trlmdb_txn *txn;
+	MDB_val *table_key;  /* NULL for a blob that is read */
+	uint8_t time[TIME_MAX_SIZE];
+	size_t time_size;
+	uint32_t index;  /* the next chunk */
+	uint8_t *buf;    /* the chunk that is being written */
+	size_t buf_size;
+	MDB_val value;   /* a value that is not chunked, returned as a single chunk */
+	int chunked;
 };
 
 /* Replicator state */
@@ -81,6 +300,12 @@ struct rstate {
 	int socket_fd;
 	int poll_timeout;  /* milliseconds */
 	int connect_now;
+	int connecting;  /* a non-blocking connect is in progress */
+	uint64_t connect_deadline;  /* milliseconds */
+	int connect_failures;  /* the failed connects since the last node message */
+	int connect_timeout;
+	int reconnect_min;
+	int reconnect_max;
 	char *connect_node;
 	char *connect_hostname;
 	char *connect_servname;
@@ -89,17 +314,107 @@ struct rstate {
 	int node_msg_sent;
 	int node_msg_received;
 	char *remote_node;
+	int caps_msg_sent;
+	int caps_msg_received;
+	int opts_msg_sent;
+	unsigned int remote_caps;
+	unsigned int write_caps;  /* capabilities used by messages sent to the remote node */
+	unsigned int read_caps;   /* capabilities used by messages received from the remote node */
 	uint8_t *read_buf;
 	uint64_t read_buf_cap;
+	uint64_t read_buf_start;  /* the first byte that is not parsed */
 	uint64_t read_buf_size;
 	int read_buf_loaded;
-	struct message *write_msg[N_WRITE_MSG];
-	uint64_t write_msg_nwritten;
+	struct message *read_msg;  /* the decoded v2 message */
+	struct message *read_record_msg;  /* the decoded v2 record of a frame */
+	struct message **write_msg;  /* a ring of reusable messages */
+	int write_msg_cap;
+	int write_msg_head;  /* the first loaded message */
 	int write_msg_loaded;
-	uint8_t write_time[20];
+	uint64_t write_msg_nwritten;  /* the written part of the first loaded message */
+	uint64_t write_bytes;  /* the unwritten bytes of the loaded messages */
+	uint64_t write_window;
+	struct message *record_msg;  /* a time or chunk message that is added to a frame */
+	int record_pending;  /* record_msg is written after the frame */
+	MDB_txn *send_txn[2];  /* read-only txns for values that are written from the memory map */
+	int send_txn_active[2];
+	uint64_t send_refs[2];  /* the loaded messages that point into the memory map of each txn */
+	int send_txn_cur;  /* the txn of the latest loaded messages */
+	int send_txn_load;  /* the loaded messages point into the current txn */
+	int send_from_map;
+	int compress_stream;
+	int write_plain;  /* the loaded messages that are written before the stream compression starts */
+	struct lz_stream *zwrite;  /* non-NULL when the written bytes are compressed */
+	uint8_t *zwrite_buf;
+	size_t zwrite_size;
+	size_t zwrite_nwritten;
+	struct lz_stream *zread;  /* non-NULL when the read bytes are compressed */
+	uint8_t *zread_buf;
+	uint64_t zread_cap;
+	uint64_t zread_size;
+	int zread_pending;  /* zread_buf may hold blocks that were left compressed by the read budget */
+	uint64_t read_budget;  /* the read buffer is held to this size, except for a larger message */
+	uint8_t write_time[NLANES][TIME_MAX_SIZE];  /* the last loaded time of each lane */
+	size_t write_time_size[NLANES];
+	int write_lane;  /* the lane of the last loaded time */
+	uint32_t write_chunk;  /* the next chunk of the time of write_lane, or 0 */
+	int lane_end[NLANES];  /* the lane has no more node-times in the txn of load_write_msg */
+	int lane_credit;  /* the times that the high lane may send before the normal lane */
+	int priority_weight;
+	int sync_state;
+	uint64_t sync_outstanding;  /* range sums without a result */
+	struct sent_time *sent;  /* a ring of the time messages that are not acknowledged */
+	uint64_t sent_cap;
+	uint64_t sent_head;
+	uint64_t sent_count;
+	uint64_t sent_acked;  /* the number of acknowledged time messages */
+	uint64_t read_time_count;  /* the number of time messages read with acks */
+	uint64_t read_time_acked;
+	int read_time_failed;
 	int end_of_write_loop;
 	int socket_readable;
 	int socket_writable;
+	int epoll_fd;  /* the epoll instance of the event thread, or -1 with a thread per connection */
+	uint32_t epoll_events;  /* the events socket_fd is registered for, or 0 */
+	int idle;  /* an event thread runs the connection again after an event or at idle_until */
+	uint64_t idle_until;  /* milliseconds */
+	int finished;  /* an event thread frees the connection */
+	int notify_fd;  /* an eventfd that the thread polls, written after local commits and for a duplicate, or -1 */
+	struct applier *applier;  /* the applier with group_commit, or NULL */
+	struct apply_job *apply_job;  /* the read buffer of an event thread connection at the applier, or NULL */
+	struct apply_rec *apply_recs;  /* the time, chunk and frame messages in the read buffer for the applier */
+	int napply_recs;
+	int apply_recs_cap;
+	struct key_list ack_dels;  /* the node-times of acknowledged times, deleted in the txn of the read buffer */
+	int read_buf_more;  /* the read buffer has whole messages that are left for the next txn */
+	int wake_fd;  /* an eventfd that wakes the thread or event thread of the connection, or -1 */
+	struct key_list node_time_dels;  /* node-times that are deleted after the read-only scan */
+	MDB_cursor *scan_cursor[NLANES];  /* the cursors in the lanes while messages are loaded */
+	int scan_positioned[NLANES];  /* scan_cursor is at the node-time of write_time */
+	struct send_cache *send_cache;  /* the send cache with several remote nodes, or NULL */
+	struct conn_registry *registry;  /* the connections of the replicator, or NULL */
+	int registered;  /* the connection is in the registry */
+	int duplicate;  /* another connection to the remote node is kept, so this one closes */
+};
+
+/* An event thread multiplexes its connections with epoll */
+struct event_thread {
+	pthread_t thread;
+	int epoll_fd;
+	int wake_fd;  /* an eventfd that is written when a connection is added */
+	pthread_mutex_t mutex;
+	struct rstate **added;  /* connections added by other threads, protected by mutex */
+	int nadded;
+	int added_cap;
+	struct rstate **conns;
+	int nconns;
+	int conns_cap;
+};
+
+struct event_pool {
+	struct event_thread *threads;
+	int nthreads;
+	int next;  /* the thread of the next connection */
 };
 
 /* Logging and printing */
@@ -154,12 +469,13 @@ static void print_buf(uint8_t *buf, uint64_t size)
 	printf("\n");
 }
 
-static uint8_t *encode_time(struct time *time, int is_put);
+static size_t encode_time(uint8_t *dst, struct time *time, int is_put, int compact);
 static void print_struct_time(struct time *time)
 {
-	uint8_t *encoded_time = encode_time(time, 0);
+	uint8_t encoded_time[TIME_MAX_SIZE];
+	size_t size = encode_time(encoded_time, time, 0, 0);
 	printf("encoded time = ");
-	for (size_t i = 0; i < 20; i++) {
+	for (size_t i = 0; i < size; i++) {
 		printf("%02x", encoded_time[i]);
 	}
 	printf("\n");
@@ -205,16 +521,31 @@ static void print_rstate(struct rstate *rs)
 	printf("node_msg_sent = %d\n", rs->node_msg_sent);
 	printf("node_msg_received = %d\n", rs->node_msg_received);
 	printf("remote_node = %s\n", rs->remote_node);
+	printf("caps_msg_sent = %d\n", rs->caps_msg_sent);
+	printf("caps_msg_received = %d\n", rs->caps_msg_received);
+	printf("opts_msg_sent = %d\n", rs->opts_msg_sent);
+	printf("remote_caps = %x\n", rs->remote_caps);
+	printf("write_caps = %x\n", rs->write_caps);
+	printf("read_caps = %x\n", rs->read_caps);
 	printf("read_buf_size = %llu\n", rs->read_buf_size);
 	print_buf(rs->read_buf, rs->read_buf_size);
 	printf("read_buf_cap = %llu\n", rs->read_buf_cap);
+	printf("read_buf_start = %llu\n", rs->read_buf_start);
 	printf("read_buf_loaded = %d\n", rs->read_buf_loaded);
 	printf("write_msg_nwritten = %llu\n", rs->write_msg_nwritten);
+	printf("write_msg_head = %d\n", rs->write_msg_head);
 	printf("write_msg_loaded = %d\n", rs->write_msg_loaded);
-	printf("write_msg\n");
-	print_message(rs->write_msg[rs->write_msg_loaded]);
-	printf("write_time\n");
-	print_buf(rs->write_time, 20);
+	printf("write_bytes = %llu\n", rs->write_bytes);
+	printf("write_window = %llu\n", rs->write_window);
+	if (rs->write_msg_loaded) {
+		printf("write_msg\n");
+		print_message(rs->write_msg[rs->write_msg_head]);
+	}
+	for (int lane = 0; lane < NLANES; lane++) {
+		printf("write_time lane %d\n", lane);
+		print_buf(rs->write_time[lane], rs->write_time_size[lane]);
+	}
+	printf("write_chunk = %u\n", rs->write_chunk);
 	printf("end_of_write_loop = %d\n", rs->end_of_write_loop);
 	printf("socket_readable = %d\n", rs->socket_readable);
 	printf("socket_writable = %d\n", rs->socket_writable);
@@ -243,6 +574,14 @@ static void *tr_realloc(void *ptr, size_t size)
 
 /* Util */
 
+/* time_ms returns the wall clock time in milliseconds */
+static uint64_t time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
 /* trim removes leading and trailing whitespace and returns the trimmed string. The argument string is modified. str must have a null terminator */
 static char *trim(char *str)
 {
@@ -275,6 +614,13 @@ static void encode_uint64(uint8_t *dst, const uint64_t src)
 	encode_uint32(dst + 4, lower);
 }
 
+static uint32_t decode_uint32(uint8_t *buf)
+{
+	uint32_t be;
+	memcpy(&be, buf, 4);
+	return ntohl(be);
+}
+
 static uint64_t decode_uint64(uint8_t *buf)
 {
 	uint64_t upper = (uint64_t) ntohl(*(uint32_t*) buf);
@@ -283,6 +629,44 @@ static uint64_t decode_uint64(uint8_t *buf)
 	return (upper << 32) + lower;
 }
 
+/* encode_varint writes src in 7 bit groups, least significant first, and returns the size.
+ * dst must have room for VARINT_MAX_SIZE bytes.
+ */
+static size_t encode_varint(uint8_t *dst, uint64_t src)
+{
+	size_t n = 0;
+	while (src >= 0x80) {
+		dst[n++] = (uint8_t) (src | 0x80);
+		src >>= 7;
+	}
+	dst[n++] = (uint8_t) src;
+	return n;
+}
+
+static size_t varint_size(uint64_t src)
+{
+	size_t n = 1;
+	while (src >= 0x80) {
+		src >>= 7;
+		n++;
+	}
+	return n;
+}
+
+/* decode_varint returns the number of bytes read, or 0 if buf does not contain a whole varint */
+static size_t decode_varint(uint8_t *buf, uint64_t size, uint64_t *dst)
+{
+	uint64_t value = 0;
+	for (size_t n = 0; n < size && n < VARINT_MAX_SIZE; n++) {
+		value |= (uint64_t) (buf[n] & 0x7f) << (7 * n);
+		if (!(buf[n] & 0x80)) {
+			*dst = value;
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
 /*
  *  Conf file
  *
@@ -309,6 +693,7 @@ struct conf_info *parse_conf_file(const char *conf_file)
 {
 	struct conf_info *conf_info = tr_malloc(sizeof *conf_info);
 	*conf_info = (struct conf_info){0};
+	conf_info->notify_interval = -1;
 
 	FILE *file;
 	if ((file = fopen(conf_file, "r")) == NULL)
@@ -335,6 +720,43 @@ struct conf_info *parse_conf_file(const char *conf_file)
 			conf_info->port = strdup(right);
 		} else if (strcmp(left, "timeout") == 0) {
 			conf_info->timeout = strtol(right, NULL, 10);
+		} else if (strcmp(left, "table_ids") == 0) {
+			if (strcmp(right, "yes") == 0)
+				conf_info->database_flags |= TRLMDB_TABLE_IDS;
+		} else if (strcmp(left, "compact_time") == 0) {
+			if (strcmp(right, "yes") == 0)
+				conf_info->database_flags |= TRLMDB_COMPACT_TIME;
+		} else if (strcmp(left, "table_dbis") == 0) {
+			if (strcmp(right, "yes") == 0)
+				conf_info->database_flags |= TRLMDB_TABLE_DBIS;
+		} else if (strcmp(left, "max_tables") == 0) {
+			conf_info->max_tables = strtol(right, NULL, 10);
+		} else if (strcmp(left, "compress_stream") == 0) {
+			conf_info->compress_stream = strcmp(right, "yes") == 0;
+		} else if (strcmp(left, "send_from_map") == 0) {
+			conf_info->send_from_map = strcmp(right, "yes") == 0;
+		} else if (strcmp(left, "priority") == 0) {
+			conf_info->npriority++;
+			conf_info->priority_table = tr_realloc(conf_info->priority_table, conf_info->npriority * sizeof *conf_info->priority_table);
+			conf_info->priority_table[conf_info->npriority - 1] = strdup(right);
+		} else if (strcmp(left, "priority_weight") == 0) {
+			conf_info->priority_weight = strtol(right, NULL, 10);
+		} else if (strcmp(left, "read_budget") == 0) {
+			conf_info->read_budget = strtol(right, NULL, 10);
+		} else if (strcmp(left, "group_commit") == 0) {
+			conf_info->group_commit = strcmp(right, "yes") == 0;
+		} else if (strcmp(left, "reconnect_min") == 0) {
+			conf_info->reconnect_min = strtol(right, NULL, 10);
+		} else if (strcmp(left, "reconnect_max") == 0) {
+			conf_info->reconnect_max = strtol(right, NULL, 10);
+		} else if (strcmp(left, "connect_timeout") == 0) {
+			conf_info->connect_timeout = strtol(right, NULL, 10);
+		} else if (strcmp(left, "notify_interval") == 0) {
+			conf_info->notify_interval = strtol(right, NULL, 10);
+		} else if (strcmp(left, "event_threads") == 0) {
+			conf_info->event_threads = strtol(right, NULL, 10);
+		} else if (strcmp(left, "bootstrap") == 0) {
+			conf_info->bootstrap_node = strdup(right);
 		} else if (strcmp(left, "accept") == 0) {
 			conf_info->naccept++;
 			conf_info->accept_node = tr_realloc(conf_info->accept_node, conf_info->naccept);
@@ -369,10 +791,44 @@ struct conf_info *parse_conf_file(const char *conf_file)
 	if (conf_info->naccept == 0 && conf_info->nconnect == 0)
 		log_fatal_err("There is no accept or connect nodes in the conf file");
 
+	if (conf_info->bootstrap_node) {
+		int found = 0;
+		for (int i = 0; i < conf_info->nconnect; i++) {
+			if (strcmp(conf_info->bootstrap_node, conf_info->connect_node[i]) == 0)
+				found = 1;
+		}
+		if (!found)
+			log_fatal_err("The bootstrap node is not a connect node");
+	}
+
 	if (conf_info->timeout == 0) {
 		conf_info->timeout = 1000;
 	}
 
+	if (conf_info->notify_interval < 0) {
+		conf_info->notify_interval = 100;
+	}
+
+	if (conf_info->reconnect_min <= 0) {
+		conf_info->reconnect_min = 100;
+	}
+
+	if (conf_info->reconnect_max < conf_info->reconnect_min) {
+		conf_info->reconnect_max = conf_info->reconnect_min > 10000 ? conf_info->reconnect_min : 10000;
+	}
+
+	if (conf_info->connect_timeout <= 0) {
+		conf_info->connect_timeout = 5000;
+	}
+
+	if (conf_info->read_budget <= 0) {
+		conf_info->read_budget = 4194304;
+	}
+
+	if (conf_info->priority_weight <= 0) {
+		conf_info->priority_weight = 8;
+	}
+
 	return conf_info;
 }
 
@@ -386,6 +842,8 @@ static struct message *msg_alloc_init(uint64_t cap)
 	msg->cap = cap;
 	encode_uint64(msg->buf, 8);
 	msg->size = 8;
+	msg->ext = NULL;
+	msg->ext_size = 0;
 
 	return msg;
 }
@@ -400,13 +858,15 @@ static void msg_reset(struct message *msg)
 {
 	encode_uint64(msg->buf, 8);
 	msg->size = 8;
+	msg->ext = NULL;
+	msg->ext_size = 0;
 }
 
 struct message *msg_from_buf(uint8_t *buf, uint64_t buf_size)
 {
 	if (buf_size < 8) return NULL;
 	uint64_t size = decode_uint64(buf);
-	if (buf_size < size) return NULL;
+	if (size < 8 || buf_size < size) return NULL;
 
 	struct message *msg = msg_alloc_init(size);
 	msg->size = size;
@@ -415,6 +875,25 @@ struct message *msg_from_buf(uint8_t *buf, uint64_t buf_size)
 	return msg;
 }
 
+/* msg_view makes msg a view of the v1 message at the start of buf without copying it. It returns 1 if
+ * buf does not contain a whole message. A view is only valid while buf is unchanged and must not be
+ * freed.
+ */
+static int msg_view(uint8_t *buf, uint64_t buf_size, struct message *msg)
+{
+	if (buf_size < 8) return 1;
+	uint64_t size = decode_uint64(buf);
+	if (size < 8 || buf_size < size) return 1;
+
+	msg->buf = buf;
+	msg->size = size;
+	msg->cap = size;
+	msg->ext = NULL;
+	msg->ext_size = 0;
+
+	return 0;
+}
+
 static int msg_append(struct message *msg, uint8_t *data, uint64_t size)
 {
 	uint64_t new_cap = msg->size + 8 + size;
@@ -436,6 +915,66 @@ static int msg_append(struct message *msg, uint8_t *data, uint64_t size)
 	return 0;
 }
 
+/* msg_copy makes msg a copy of the whole message of size bytes at data, in any wire format */
+static int msg_copy(struct message *msg, uint8_t *data, uint64_t size)
+{
+	if (size > msg->cap) {
+		uint8_t *realloc_buf = realloc(msg->buf, size);
+		if (!realloc_buf) return 1;
+		msg->buf = realloc_buf;
+		msg->cap = size;
+	}
+
+	memcpy(msg->buf, data, size);
+	msg->size = size;
+	msg->ext = NULL;
+	msg->ext_size = 0;
+
+	return 0;
+}
+
+/* msg_append_ext appends a last field whose data is not copied. The data must stay in place until
+ * the message is written.
+ */
+static int msg_append_ext(struct message *msg, uint8_t *data, uint64_t size)
+{
+	if (msg->size + 8 > msg->cap) {
+		uint8_t *realloc_buf = realloc(msg->buf, msg->size + 8);
+		if (!realloc_buf) return 1;
+		msg->buf = realloc_buf;
+		msg->cap = msg->size + 8;
+	}
+
+	encode_uint64(msg->buf + msg->size, size);
+	msg->size += 8;
+	msg->ext = data;
+	msg->ext_size = size;
+
+	encode_uint64(msg->buf, msg->size + size);
+
+	return 0;
+}
+
+/* msg_wire_size is the size of msg on the network */
+static uint64_t msg_wire_size(struct message *msg)
+{
+	return msg->size + msg->ext_size;
+}
+
+/* msg_wire_copy copies size bytes of msg on the network, starting at offset, to dst */
+static void msg_wire_copy(struct message *msg, uint64_t offset, uint8_t *dst, uint64_t size)
+{
+	if (offset < msg->size) {
+		uint64_t n = msg->size - offset < size ? msg->size - offset : size;
+		memcpy(dst, msg->buf + offset, n);
+		dst += n;
+		offset += n;
+		size -= n;
+	}
+	if (size > 0)
+		memcpy(dst, msg->ext + offset - msg->size, size);
+}
+
 static uint64_t msg_get_count(struct message *msg)
 {
 	uint8_t *buf = msg->buf + 8;
@@ -471,1190 +1010,5263 @@ static int msg_get_elem(struct message *msg, uint64_t index, uint8_t **data, uin
 	return MDB_NOTFOUND;
 }
 
-/* replicator state */
-
-static struct rstate *rstate_alloc_init(struct trlmdb_env *env, struct conf_info *conf_info)
+/* msg_parse indexes the fields of msg in one pass. It returns EINVAL if the fields do not exactly fill
+ * the message or if there are more than MSG_FIELDS_MAX of them.
+ */
+static int msg_parse(struct message *msg, struct msg_fields *fields)
 {
-	struct rstate *rs = tr_malloc(sizeof *rs);
-	*rs = (struct rstate) {0};
-	
-	rs->node = conf_info->node;
-	rs->env = env;
-	rs->socket_fd = -1;
-	rs->poll_timeout = conf_info->timeout;
-	rs->naccept = conf_info->naccept;
-	rs->accept_node = conf_info->accept_node;
-	rs->read_buf_cap = 10000; 
-	rs->read_buf = tr_malloc(rs->read_buf_cap);
-	for (int i = 0; i < N_WRITE_MSG; i++) {
-		rs->write_msg[i] = msg_alloc_init(256);
+	uint8_t *buf = msg->buf + 8;
+	uint64_t remaining = msg->size - 8;
+	uint64_t count = 0;
+	while (remaining > 0) {
+		if (remaining < 8 || count == MSG_FIELDS_MAX)
+			return EINVAL;
+		uint64_t length = decode_uint64(buf);
+		if (length > remaining - 8)
+			return EINVAL;
+		fields->data[count] = buf + 8;
+		fields->size[count] = length;
+		count++;
+		remaining -= 8 + length;
+		buf += 8 + length;
 	}
-	
-	return rs;
+	fields->count = count;
+	return 0;
 }
 
-static void rstate_free(struct rstate *rs)
+/* msg_fields_type returns 1 if the first field is the 4 byte type */
+static int msg_fields_type(struct msg_fields *fields, const char *type)
 {
-	free(rs->connect_node);
-	free(rs->connect_hostname);
-	free(rs->connect_servname);
-	for (int i = 0; i < N_WRITE_MSG; i++) {
-		msg_free(rs->write_msg[i]);
-	}
-	free(rs->read_buf);
-	free(rs);
+	return fields->count > 0 && fields->size[0] == 4 && memcmp(fields->data[0], type, 4) == 0;
 }
 
-/* time stamps Operations, put or del, have time stamps.  A time stamp, called time here, is 20
- * bytes long.  Time is composed as follows.  
- *
- * 4 bytes: number of seconds since the unix epoch. The time is fixed at the beginning of the
- *  transaction
- * 
- * 4 bytes: fration second after the unix epoch. The fraction is in steps of 1/ 2^32.
+/* msg_is_type returns 1 if the first field of msg is the 4 byte type */
+static int msg_is_type(struct message *msg, const char *type)
+{
+	uint8_t *data;
+	uint64_t size;
+	return msg_get_elem(msg, 0, &data, &size) == 0 && size == 4 && memcmp(data, type, 4) == 0;
+}
+
+/* Wire protocol v2
  *
- * 4 bytes: A random id for each environment. This number will break ties in the unlikely event
- * of two simultaneous transactions on separate nodes.
+ * Messages are built in the format above, which is version 1 of the wire protocol. A replicator that
+ * switches on the capability "wire-v2" in its "opts" message sends all following messages in the
+ * shorter version 2 format
  *
- * 8 bytes: A counter within each transaction. The counter increaes by two, and the last bit is 1
- * for a put operation and 0 for a del operation.
+ * v2-message = length type(1) field-1-length field-1 ...
  *
- * Node-time is the concatenation of a node name and time.
+ * where the lengths are varints and length counts the bytes after itself. The type byte replaces the
+ * 4 byte type field. In a time message, the flag field is replaced by a single byte of flag bits.
  */
 
-static struct time *time_gettimeofday(struct time *time)
-{
-	struct timeval tv;
-	int rc = gettimeofday(&tv, NULL);
-	if (rc)
-		log_fatal_err("gettimeofday failed");
-	
-	encode_uint32(time->seconds, (uint32_t) tv.tv_sec);
-	uint64_t usec = (uint64_t) tv.tv_usec;
-	uint64_t frac_sec = (usec << 32) / 1000000;
-	encode_uint32(time->fraction, (uint32_t) frac_sec);
+#define V2_FLAG_LOCAL_KNOWS 0x01
+#define V2_FLAG_REMOTE_KNOWS 0x02
+#define V2_FLAG_ZDATA 0x04
+#define V2_FLAG_CHUNKS 0x08
 
-	return time;
+static const char *v2_types[] = {"node", "caps", "opts", "time", "chnk", "frme", "rsum", "rres", "ackn"};
+
+static int v2_type_code(uint8_t *type, uint64_t size)
+{
+	if (size != 4)
+		return -1;
+	for (size_t i = 0; i < sizeof v2_types / sizeof v2_types[0]; i++) {
+		if (memcmp(type, v2_types[i], 4) == 0)
+			return (int) i + 1;
+	}
+	return -1;
 }
 
-static struct time *time_inc(struct time *time)
+static int v2_flag_encode(uint8_t *flag, uint64_t size, uint8_t *bits)
 {
-	time->counter += 2;
-	return time;
+	if (size != 2 && size != 3)
+		return EINVAL;
+	*bits = 0;
+	if (flag[0] == 't')
+		*bits |= V2_FLAG_LOCAL_KNOWS;
+	if (flag[1] == 't')
+		*bits |= V2_FLAG_REMOTE_KNOWS;
+	if (size == 3)
+		*bits |= flag[2] == 'z' ? V2_FLAG_ZDATA : V2_FLAG_CHUNKS;
+	return 0;
 }
 
-static struct time *time_prepare(struct time *time)
+static uint64_t v2_flag_decode(uint8_t bits, uint8_t *flag)
 {
-	time_gettimeofday(time);
-	time->counter = 0;
-	return time;
+	flag[0] = bits & V2_FLAG_LOCAL_KNOWS ? 't' : 'f';
+	flag[1] = bits & V2_FLAG_REMOTE_KNOWS ? 't' : 'f';
+	if (bits & V2_FLAG_ZDATA) {
+		flag[2] = 'z';
+		return 3;
+	}
+	if (bits & V2_FLAG_CHUNKS) {
+		flag[2] = 'c';
+		return 3;
+	}
+	return 2;
 }
 
-static uint8_t *encode_time(struct time *time, int is_put)
+/* msg_to_v2 rewrites msg in place in the v2 format. A v2 message is never longer than the v1
+ * message, and every byte is written at or before the position it is read from.
+ */
+static int msg_to_v2(struct message *msg)
 {
-	uint8_t *encoded = malloc(20);
-	if (!encoded)
-		return NULL;
+	uint64_t count = msg_get_count(msg);
+	uint8_t *data;
+	uint64_t size;
+	if (count == 0 || msg_get_elem(msg, 0, &data, &size))
+		return EINVAL;
+	int type = v2_type_code(data, size);
+	if (type < 0)
+		return EINVAL;
+	int is_time = memcmp(v2_types[type - 1], "time", 4) == 0;
 
-	memcpy(encoded, time->seconds, 4);
-	memcpy(encoded + 4, time->fraction, 4);
-	memcpy(encoded + 8, time->id, 4);
+	uint64_t length = 1;
+	for (uint64_t i = 1; i < count; i++) {
+		msg_get_elem(msg, i, &data, &size);
+		length += is_time && i == 1 ? 1 : varint_size(size) + size;
+	}
+	if (msg->ext)
+		length += varint_size(msg->ext_size) + msg->ext_size;
+
+	uint8_t *src = msg->buf + 8 + 8 + 4;
+	uint8_t *dst = msg->buf;
+	dst += encode_varint(dst, length);
+	*dst++ = (uint8_t) type;
+	for (uint64_t i = 1; i < count; i++) {
+		size = decode_uint64(src);
+		src += 8;
+		if (is_time && i == 1) {
+			uint8_t bits;
+			if (v2_flag_encode(src, size, &bits))
+				return EINVAL;
+			*dst++ = bits;
+		} else {
+			dst += encode_varint(dst, size);
+			memmove(dst, src, size);
+			dst += size;
+		}
+		src += size;
+	}
 
-	uint64_t counter = time->counter + (is_put ? 1 : 0);
-	encode_uint64(encoded + 12, counter);
-	
-	return encoded;
+	/* The data of the last field stays in place */
+	if (msg->ext)
+		dst += encode_varint(dst, msg->ext_size);
+
+	msg->size = dst - msg->buf;
+	return 0;
 }
 
-static int time_is_put(uint8_t *time)
+/* msg_decode_v2 decodes a v2 message at the start of buf into the v1 message msg, whose buffer is
+ * reused. It returns 1 if buf does not contain a whole message, EINVAL if a length is invalid and
+ * ENOMEM if msg can not grow. Otherwise it sets consumed to the size of the v2 message. A message of
+ * unknown type is decoded as an empty message.
+ */
+static int msg_decode_v2(uint8_t *buf, uint64_t buf_size, uint64_t *consumed, struct message *msg)
 {
-	return *(time + 19) & 1;
+	uint64_t length;
+	size_t n = decode_varint(buf, buf_size, &length);
+	if (n == 0)
+		return buf_size < VARINT_MAX_SIZE ? 1 : EINVAL;
+	if (buf_size - n < length)
+		return 1;
+	*consumed = n + length;
+
+	msg_reset(msg);
+	if (length == 0)
+		return 0;
+
+	uint8_t *src = buf + n;
+	uint8_t *end = src + length;
+	int type = *src++;
+	if (type < 1 || type > (int) (sizeof v2_types / sizeof v2_types[0]))
+		return 0;
+	if (msg_append(msg, (uint8_t*) v2_types[type - 1], 4))
+		return ENOMEM;
+
+	int is_time = memcmp(v2_types[type - 1], "time", 4) == 0;
+	for (uint64_t i = 1; src < end; i++) {
+		if (is_time && i == 1) {
+			uint8_t flag[3];
+			if (msg_append(msg, flag, v2_flag_decode(*src++, flag)))
+				return ENOMEM;
+			continue;
+		}
+		uint64_t size;
+		n = decode_varint(src, end - src, &size);
+		if (n == 0 || (uint64_t) (end - src - n) < size) {
+			msg_reset(msg);
+			return EINVAL;
+		}
+		if (msg_append(msg, src + n, size))
+			return ENOMEM;
+		src += n + size;
+	}
+
+	return 0;
 }
 
-static int time_cmp(uint8_t *time1, uint8_t *time2)
+/* replicator state */
+
+/* rstate_stream_end switches off the stream compression of a connection */
+static void rstate_stream_end(struct rstate *rs)
 {
-	return memcmp(time1, time2, 20);
+	free(rs->zwrite);
+	free(rs->zwrite_buf);
+	free(rs->zread);
+	free(rs->zread_buf);
+	rs->zwrite = NULL;
+	rs->zwrite_buf = NULL;
+	rs->zwrite_size = 0;
+	rs->zwrite_nwritten = 0;
+	rs->zread = NULL;
+	rs->zread_buf = NULL;
+	rs->zread_cap = 0;
+	rs->zread_size = 0;
+	rs->zread_pending = 0;
+	rs->write_plain = 0;
 }
 
-static uint8_t *encode_node_time(char *node, size_t node_size, uint8_t *time)
+/* write_msg_next returns the message after the loaded messages in the ring, which grows when it is full */
+static struct message *write_msg_next(struct rstate *rs)
 {
-	uint8_t *node_time = malloc(node_size + 20);
-	if (!node_time)
-		return NULL;
-	memcpy(node_time, node, node_size);
-	memcpy(node_time + node_size, time, 20);
+	if (rs->write_msg_loaded == rs->write_msg_cap) {
+		int cap = 2 * rs->write_msg_cap;
+		struct message **ring = tr_malloc(cap * sizeof *ring);
+		for (int i = 0; i < rs->write_msg_cap; i++) {
+			ring[i] = rs->write_msg[(rs->write_msg_head + i) % rs->write_msg_cap];
+		}
+		for (int i = rs->write_msg_cap; i < cap; i++) {
+			ring[i] = msg_alloc_init(256);
+		}
+		free(rs->write_msg);
+		rs->write_msg = ring;
+		rs->write_msg_cap = cap;
+		rs->write_msg_head = 0;
+	}
 
-	return node_time;
+	return rs->write_msg[(rs->write_msg_head + rs->write_msg_loaded) % rs->write_msg_cap];
 }
 
-/* Network code */
+/* write_msg_push adds the message returned by write_msg_next to the loaded messages */
+static void write_msg_push(struct rstate *rs)
+{
+	struct message *msg = write_msg_next(rs);
+	rs->write_bytes += msg_wire_size(msg);
+	if (msg->ext)
+		rs->send_refs[rs->send_txn_cur]++;
+	rs->write_msg_loaded++;
+}
 
-/* create_listener returns a valid fd. It exists if there are errors. */
-static int create_listener(const char *hostname, const char *servname)
+/* write_msg_push_record adds rs->record_msg to the loaded messages */
+static void write_msg_push_record(struct rstate *rs)
 {
-	struct addrinfo hints = {0};
+	write_msg_next(rs);
+	int index = (rs->write_msg_head + rs->write_msg_loaded) % rs->write_msg_cap;
+	struct message *msg = rs->write_msg[index];
+	rs->write_msg[index] = rs->record_msg;
+	rs->record_msg = msg;
+	rs->record_pending = 0;
+	write_msg_push(rs);
+}
 
-	hints.ai_flags = AI_PASSIVE;
-	hints.ai_family = PF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+/* send_txn_release releases the snapshot of a send txn, so that LMDB can reuse its pages */
+static void send_txn_release(struct rstate *rs, int i)
+{
+	if (rs->send_txn_active[i])
+		mdb_txn_reset(rs->send_txn[i]);
+	rs->send_txn_active[i] = 0;
+	rs->send_refs[i] = 0;
+}
 
-	struct addrinfo *res;
-	int status = getaddrinfo(hostname, servname, &hints, &res);
-	if (status)
-		log_fatal_err("getaddrinfo error: %s\n", gai_strerror(status));
+/* send_txn_get returns a fresh read-only txn for the values of the next loaded messages, or NULL if
+ * the values must be copied. The two send txns alternate, so a snapshot is only held while the
+ * messages of about two loads are written. The messages of the other txn are always loaded before
+ * those of the current txn.
+ */
+static MDB_txn *send_txn_get(struct rstate *rs)
+{
+	if (!rs->send_from_map)
+		return NULL;
 
-	int listen_fd = -1;
-	struct addrinfo *addrinfo;
-	for (addrinfo = res; addrinfo != NULL; addrinfo = addrinfo->ai_next) {
-		listen_fd = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol);
-		if (listen_fd == -1)
-			continue;
+	int i = rs->send_txn_cur;
+	if (rs->send_refs[i] > 0)
+		i = 1 - i;
+	if (rs->send_refs[i] > 0)
+		return NULL;
 
-		int socket_option_value = 1;
-		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &socket_option_value, sizeof(int));
-		
-		if (bind(listen_fd, addrinfo->ai_addr, addrinfo->ai_addrlen) == -1)
-			log_fatal_err("bind error: %s\n", strerror(errno));
-
-		break;
+	int rc;
+	if (!rs->send_txn[i]) {
+		rc = mdb_txn_begin(rs->env->mdb_env, NULL, MDB_RDONLY, &rs->send_txn[i]);
+		if (rc)
+			rs->send_txn[i] = NULL;
+	} else {
+		if (rs->send_txn_active[i])
+			mdb_txn_reset(rs->send_txn[i]);
+		rc = mdb_txn_renew(rs->send_txn[i]);
 	}
 
-	if (addrinfo == NULL) {
-		fprintf(stderr, "Check that the host and port are correct, that the port is not used by another process and that the process has the right permission\n");
-		return -1;
-	}
+	rs->send_txn_active[i] = rc == 0;
+	if (rc)
+		return NULL;
+	rs->send_txn_cur = i;
+	return rs->send_txn[i];
+}
 
-	freeaddrinfo(res);
+/* send_txn_unref is called when a message that points into the memory map is written */
+static void send_txn_unref(struct rstate *rs)
+{
+	int i = rs->send_refs[1 - rs->send_txn_cur] > 0 ? 1 - rs->send_txn_cur : rs->send_txn_cur;
+	if (--rs->send_refs[i] == 0)
+		send_txn_release(rs, i);
+}
+
+static struct rstate *rstate_alloc_init(struct trlmdb_env *env, struct conf_info *conf_info)
+{
+	struct rstate *rs = tr_malloc(sizeof *rs);
+	*rs = (struct rstate) {0};
 	
-	int backlog = 20;
-	if (listen(listen_fd, backlog) == -1)
-		log_fatal_err("listen error: %s\n", strerror(errno));
+	rs->node = conf_info->node;
+	rs->env = env;
+	rs->socket_fd = -1;
+	rs->epoll_fd = -1;
+	rs->notify_fd = -1;
+	rs->wake_fd = -1;
+	rs->poll_timeout = conf_info->timeout;
+	rs->connect_timeout = conf_info->connect_timeout;
+	rs->reconnect_min = conf_info->reconnect_min;
+	rs->reconnect_max = conf_info->reconnect_max;
+	rs->naccept = conf_info->naccept;
+	rs->accept_node = conf_info->accept_node;
+	rs->read_budget = conf_info->read_budget;
+	rs->priority_weight = conf_info->priority_weight;
+	rs->lane_credit = conf_info->priority_weight;
+	rs->read_buf_cap = 10000; 
+	rs->read_buf = tr_malloc(rs->read_buf_cap);
+	rs->read_msg = msg_alloc_init(256);
+	rs->read_record_msg = msg_alloc_init(256);
+	rs->write_msg_cap = WRITE_MSG_INIT;
+	rs->write_msg = tr_malloc(rs->write_msg_cap * sizeof *rs->write_msg);
+	for (int i = 0; i < rs->write_msg_cap; i++) {
+		rs->write_msg[i] = msg_alloc_init(256);
+	}
+	rs->write_window = WRITE_WINDOW_MIN;
+	rs->record_msg = msg_alloc_init(256);
+	rs->compress_stream = conf_info->compress_stream;
+	rs->send_from_map = conf_info->send_from_map;
+	
+	return rs;
+}
 
-	return listen_fd;
+static void env_notify_remove_fd(struct trlmdb_env *env, int fd);
+
+static void rstate_free(struct rstate *rs)
+{
+	free(rs->connect_node);
+	free(rs->connect_hostname);
+	free(rs->connect_servname);
+	for (int i = 0; i < rs->write_msg_cap; i++) {
+		msg_free(rs->write_msg[i]);
+	}
+	free(rs->write_msg);
+	msg_free(rs->record_msg);
+	for (int i = 0; i < 2; i++) {
+		if (rs->send_txn[i])
+			mdb_txn_abort(rs->send_txn[i]);
+	}
+	free(rs->sent);
+	free(rs->node_time_dels.buf);
+	free(rs->apply_recs);
+	free(rs->ack_dels.buf);
+	rstate_stream_end(rs);
+	free(rs->read_buf);
+	msg_free(rs->read_msg);
+	msg_free(rs->read_record_msg);
+	if (rs->notify_fd != -1) {
+		env_notify_remove_fd(rs->env, rs->notify_fd);
+		close(rs->notify_fd);
+	}
+	free(rs);
 }
 
-static void accept_loop(int listen_fd, struct trlmdb_env *env, struct conf_info *conf_info, void *(*handler)(void*))
+/* connection registry
+ *
+ * If two replicators connect to each other, there can be two connections between them, which both
+ * send all times. The registry has the connections that have received a node message. When a node
+ * has a connection it made and a connection it accepted with the same remote node, it keeps the
+ * connection made by the node with the smaller name and closes the other, so both nodes keep the same
+ * connection. A connect connection to a node with a smaller name does not connect while an accepted
+ * connection from that node is registered. Two accepted connections from the same node are both kept,
+ * because the older one may be a stale connection of a restarted remote node.
+ */
+
+struct conn_registry {
+	pthread_mutex_t mutex;
+	struct rstate **conns;
+	int nconns;
+	int cap;
+};
+
+static struct conn_registry *conn_registry_create(void)
 {
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	struct conn_registry *registry = tr_malloc(sizeof *registry);
+	pthread_mutex_init(&registry->mutex, NULL);
+	registry->conns = NULL;
+	registry->nconns = 0;
+	registry->cap = 0;
+	return registry;
+}
 
-	for (;;) {
-		struct sockaddr_storage remote_addr;
-		socklen_t remote_addr_len = sizeof remote_addr;
+/* conn_preferred returns 1 if the connection with the remote node was made by the node with the smaller name */
+static int conn_preferred(struct rstate *rs)
+{
+	int local_smaller = strcmp(rs->node, rs->remote_node) < 0;
+	return (rs->connect_node != NULL) == local_smaller;
+}
 
-		printf("ready to accept\n");
-		int accepted_fd = accept(listen_fd, (struct sockaddr *) &remote_addr, &remote_addr_len);
-		printf("accepted = %d\n", accepted_fd);
-		if (accepted_fd == -1)
+/* conn_register adds rs after its node message. It returns EEXIST if rs is the duplicate of a
+ * registered connection and must be closed. A registered connection that is the duplicate of rs is
+ * told to close.
+ */
+static int conn_register(struct conn_registry *registry, struct rstate *rs)
+{
+	pthread_mutex_lock(&registry->mutex);
+	for (int i = 0; i < registry->nconns; i++) {
+		struct rstate *other = registry->conns[i];
+		if ((other->connect_node != NULL) == (rs->connect_node != NULL) || strcmp(other->remote_node, rs->remote_node) != 0)
 			continue;
+		if (!conn_preferred(rs)) {
+			pthread_mutex_unlock(&registry->mutex);
+			return EEXIST;
+		}
+		__atomic_store_n(&other->duplicate, 1, __ATOMIC_SEQ_CST);
+		/* The thread or event thread of the other connection is woken, so it closes now */
+		uint64_t one = 1;
+		if (other->wake_fd != -1 && write(other->wake_fd, &one, sizeof one) != sizeof one && errno != EAGAIN)
+			perror("write");
+	}
 
-		int on = 1;
-		setsockopt(accepted_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on);
+	if (registry->nconns == registry->cap) {
+		registry->cap = registry->cap ? 2 * registry->cap : 16;
+		registry->conns = tr_realloc(registry->conns, registry->cap * sizeof *registry->conns);
+	}
+	registry->conns[registry->nconns++] = rs;
+	rs->registered = 1;
+	pthread_mutex_unlock(&registry->mutex);
+	return 0;
+}
 
-		/* int rc = fcntl(accepted_fd, F_SETFL, fcntl(accepted_fd, F_GETFL, 0) | O_NONBLOCK); */
-		/* if (rc == -1) { */
-			/* perror("accept"); */
-			/* continue; */
-		/* } */
-		
-		struct rstate *rs = rstate_alloc_init(env, conf_info);
-		rs->socket_fd = accepted_fd;
-		
-		pthread_t thread;
-		if (pthread_create(&thread, &attr,handler, rs))
-			log_fatal_err("error creatng a new thread\n");
+static void conn_unregister(struct conn_registry *registry, struct rstate *rs)
+{
+	pthread_mutex_lock(&registry->mutex);
+	for (int i = 0; i < registry->nconns; i++) {
+		if (registry->conns[i] == rs) {
+			registry->conns[i] = registry->conns[--registry->nconns];
+			break;
+		}
 	}
+	rs->registered = 0;
+	pthread_mutex_unlock(&registry->mutex);
 }
 
-static int create_connection(const char *hostname, const char *servname)
+/* conn_waiting returns 1 if the connect connection rs should not connect, because the connection
+ * accepted from its remote node is kept instead.
+ */
+static int conn_waiting(struct conn_registry *registry, struct rstate *rs)
 {
-	struct addrinfo hints = {0};
+	if (strcmp(rs->node, rs->connect_node) < 0)
+		return 0;
+
+	int waiting = 0;
+	pthread_mutex_lock(&registry->mutex);
+	for (int i = 0; i < registry->nconns; i++) {
+		struct rstate *other = registry->conns[i];
+		if (!other->connect_node && strcmp(other->remote_node, rs->connect_node) == 0)
+			waiting = 1;
+	}
+	pthread_mutex_unlock(&registry->mutex);
+	return waiting;
+}
 
-	hints.ai_flags = AI_PASSIVE;
-	hints.ai_family = PF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+/* close_socket closes the connection to the remote node */
+static void close_socket(struct rstate *rs)
+{
+	if (rs->registered)
+		conn_unregister(rs->registry, rs);
+	__atomic_store_n(&rs->duplicate, 0, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	if (rs->epoll_events)
+		epoll_ctl(rs->epoll_fd, EPOLL_CTL_DEL, rs->socket_fd, NULL);
+#endif
+	rs->epoll_events = 0;
+	close(rs->socket_fd);
+	rs->socket_fd = -1;
+	if (rs->connecting)
+		rs->connect_failures++;
+	rs->connecting = 0;
+	rs->socket_readable = 0;
+	rs->socket_writable = 0;
+}
 
-	struct addrinfo *res;
-	int rc;
+/* time stamps Operations, put or del, have time stamps.  A time stamp, called time here, is 20
+ * bytes long.  Time is composed as follows.  
+ *
+ * 4 bytes: number of seconds since the unix epoch. The time is fixed at the beginning of the
+ *  transaction
+ * 
+ * 4 bytes: fration second after the unix epoch. The fraction is in steps of 1/ 2^32.
+ *
+ * 4 bytes: A random id for each environment. This number will break ties in the unlikely event
+ * of two simultaneous transactions on separate nodes.
+ *
+ * 8 bytes: A counter within each transaction. The counter increaes by two, and the last bit is 1
+ * for a put operation and 0 for a del operation.
+ *
+ * A database with the flag TRLMDB_COMPACT_TIME stores the counter as a variable length integer
+ * instead. A counter below 0x80 is a single byte. A larger counter is the byte 0x80 + n followed by
+ * the n significant bytes of the counter in big endian order. Most compact times are 13 bytes, and
+ * compact times sort in the same order as the 20 byte times. The last bit is still the put bit.
+ *
+ * Node-time is the concatenation of a node name and time. With compact times, a null byte separates
+ * the node name and the time.
+ */
 
-	printf("hostname = %s, servname = %s\n", hostname, servname);
+static struct time *time_gettimeofday(struct time *time)
+{
+	struct timeval tv;
+	int rc = gettimeofday(&tv, NULL);
+	if (rc)
+		log_fatal_err("gettimeofday failed");
 	
-	if ((rc = getaddrinfo(hostname, servname, &hints, &res))) {
-		log_stderr("getaddrinfo error: %s\n", gai_strerror(rc));
-		return -1;
-	}
+	encode_uint32(time->seconds, (uint32_t) tv.tv_sec);
+	uint64_t usec = (uint64_t) tv.tv_usec;
+	uint64_t frac_sec = (usec << 32) / 1000000;
+	encode_uint32(time->fraction, (uint32_t) frac_sec);
 
-	int socket_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (socket_fd == -1) {
-		freeaddrinfo(res);
-		return -1;
+	return time;
+}
+
+static struct time *time_inc(struct time *time)
+{
+	time->counter += 2;
+	return time;
+}
+
+static struct time *time_prepare(struct time *time)
+{
+	time_gettimeofday(time);
+	time->counter = 0;
+	return time;
+}
+
+static size_t encode_counter(uint8_t *dst, uint64_t counter)
+{
+	if (counter < 0x80) {
+		dst[0] = (uint8_t) counter;
+		return 1;
 	}
 
-	int on = 1;
-	setsockopt(socket_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on);
+	size_t n = 1;
+	while (n < 8 && (counter >> (8 * n)) != 0)
+		n++;
 
-	rc = connect(socket_fd, res->ai_addr, res->ai_addrlen);
-	if (rc == -1) {
-		freeaddrinfo(res);
-		log_stderr("connect error to %s:%s. Trying again later\n", hostname, servname);
-		perror("connect:");
-		return -1;
+	dst[0] = (uint8_t) (0x80 + n);
+	for (size_t i = 0; i < n; i++) {
+		dst[1 + i] = (uint8_t) (counter >> (8 * (n - 1 - i)));
 	}
+	return 1 + n;
+}
 
-	rc = fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK);
-	if (rc == -1) {
-		perror("fcntl in connect");
-		freeaddrinfo(res);
-		return -1;
-	}		
-	
-	printf("connected to %s:%s\n", hostname, servname);
+/* encode_time writes the time to dst, which must have room for TIME_MAX_SIZE bytes, and returns the size */
+static size_t encode_time(uint8_t *dst, struct time *time, int is_put, int compact)
+{
+	memcpy(dst, time->seconds, 4);
+	memcpy(dst + 4, time->fraction, 4);
+	memcpy(dst + 8, time->id, 4);
 
-	freeaddrinfo(res);
-	
-	return socket_fd;
+	uint64_t counter = time->counter + (is_put ? 1 : 0);
+	if (!compact) {
+		encode_uint64(dst + 12, counter);
+		return TIME_SIZE;
+	}
+
+	return 12 + encode_counter(dst + 12, counter);
 }
 
-/* node message */
-static char *read_node(struct message *msg)
+/* decode_time is the inverse of encode_time. The put bit is left in the counter.
+ * It returns EINVAL if the time is malformed.
+ */
+static int decode_time(struct time *time, uint8_t *src, size_t size, int compact)
 {
-	uint64_t count = msg_get_count(msg);
-	if (count != 2)
-		return NULL;
+	if (size < 13)
+		return EINVAL;
 
-	uint8_t *data;
-	uint64_t size;
-	
-	msg_get_elem(msg, 0, &data, &size);
-	if (size != 4 || memcmp(data, "node", 4) != 0)
-		return NULL;
+	memcpy(time->seconds, src, 4);
+	memcpy(time->fraction, src + 4, 4);
+	memcpy(time->id, src + 8, 4);
 
-	msg_get_elem(msg, 1, &data, &size);
+	if (!compact) {
+		if (size != TIME_SIZE)
+			return EINVAL;
+		time->counter = decode_uint64(src + 12);
+		return 0;
+	}
 
-	char *node = tr_malloc(size + 1);
+	if (src[12] < 0x80) {
+		time->counter = src[12];
+		return size == 13 ? 0 : EINVAL;
+	}
 
-	memcpy(node, data, size);
-	node[size] = '\0';
+	size_t n = src[12] - 0x80;
+	if (n < 1 || n > 8 || size != 13 + n)
+		return EINVAL;
 
-	return node;
+	/* Only the shortest encoding is valid, otherwise equal times could differ */
+	if (n == 1 ? src[13] < 0x80 : src[13] == 0)
+		return EINVAL;
+
+	time->counter = 0;
+	for (size_t i = 0; i < n; i++) {
+		time->counter = (time->counter << 8) | src[13 + i];
+	}
+	return 0;
 }
 
-static void write_node(struct message *msg, const char *node)
+/* time_convert converts a time between the 20 byte and the compact encoding. dst must have room for
+ * TIME_MAX_SIZE bytes. It returns the size of the converted time, or 0 if src is malformed.
+ */
+static size_t time_convert(uint8_t *dst, uint8_t *src, size_t size, int src_compact, int dst_compact)
 {
-	msg_reset(msg);
-	msg_append(msg, (uint8_t*) "node", 4); 
-	msg_append(msg, (uint8_t*)node, strlen(node));
+	struct time time;
+	if (decode_time(&time, src, size, src_compact))
+		return 0;
+	return encode_time(dst, &time, 0, dst_compact);
 }
 
-/* The trlmdb functions. trlmdb is a wrapper around the lmdb functions. trlmdb contrls the lmdb
- * database, and all dataase access should go throught these functions.
- */  
-
-int trlmdb_env_create(struct trlmdb_env **env)
+static int time_is_put(MDB_val *time)
 {
-	*env = malloc(sizeof **env);
-	if (!*env) return ENOMEM;
+	return *((uint8_t*) time->mv_data + time->mv_size - 1) & 1;
+}
 
-	**env = (struct trlmdb_env) {0}; 
-	
-	encode_uint32((*env)->time_id, arc4random());
-	
-	int rc = mdb_env_create(&((*env)->mdb_env));
-	if (rc) {
-		free(*env);
-		return rc;
-	}
+static int time_cmp(MDB_val *time1, MDB_val *time2)
+{
+	size_t size = time1->mv_size < time2->mv_size ? time1->mv_size : time2->mv_size;
+	int cmp = memcmp(time1->mv_data, time2->mv_data, size);
+	if (cmp)
+		return cmp;
+	return (time1->mv_size > time2->mv_size) - (time1->mv_size < time2->mv_size);
+}
 
-	mdb_env_set_maxdbs((*env)->mdb_env, 5);
-	uint64_t map_size = (uint64_t)4096 * 4096 * 300;
-	mdb_env_set_mapsize((*env)->mdb_env, map_size);
-	
-	return rc;
+static int env_compact_time(struct trlmdb_env *env)
+{
+	return (env->flags & TRLMDB_COMPACT_TIME) != 0;
 }
 
-int trlmdb_env_set_mapsize(struct trlmdb_env *env, uint64_t size)
+/* node_time_prefix_len is the length of the node part of a node-time */
+static size_t node_time_prefix_len(struct trlmdb_env *env, size_t node_len)
 {
-	return mdb_env_set_mapsize(env->mdb_env, size);	
+	return env_compact_time(env) ? node_len + 1 : node_len;
 }
 
-int trlmdb_env_open(struct trlmdb_env *env, const char *path, unsigned int flags, mdb_mode_t mode)
+/* encode_node_time allocates node_time->mv_data, which is freed by the caller */
+static int encode_node_time(struct trlmdb_env *env, char *node, size_t node_len, MDB_val *time, MDB_val *node_time)
 {
-	int rc = 0;
+	size_t prefix_len = node_time_prefix_len(env, node_len);
+	uint8_t *data = malloc(prefix_len + time->mv_size);
+	if (!data)
+		return ENOMEM;
 
-	rc = mdb_env_open(env->mdb_env, path, flags, mode);
-	if (rc) return rc;
+	memcpy(data, node, node_len);
+	if (prefix_len > node_len)
+		data[node_len] = 0;
+	memcpy(data + prefix_len, time->mv_data, time->mv_size);
 
-	MDB_txn *txn;
-	rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
-	if (rc) goto cleanup_env;
+	node_time->mv_size = prefix_len + time->mv_size;
+	node_time->mv_data = data;
+	return 0;
+}
 
-	rc = mdb_dbi_open(txn, DB_TIME_TO_KEY, MDB_CREATE, &env->dbi_time_to_key);
-	if (rc) goto cleanup_txn;
+/* node_time_split returns 1 and sets time if node_time belongs to node, and 0 otherwise */
+static int node_time_split(struct trlmdb_env *env, MDB_val *node_time, char *node, size_t node_len, MDB_val *time)
+{
+	size_t prefix_len = node_time_prefix_len(env, node_len);
+	uint8_t *data = node_time->mv_data;
+	if (node_time->mv_size <= prefix_len || memcmp(data, node, node_len) != 0)
+		return 0;
 
-	rc = mdb_dbi_open(txn, DB_TIME_TO_DATA, MDB_CREATE, &env->dbi_time_to_data);
-	if (rc) goto cleanup_txn;
+	if (env_compact_time(env) ? data[node_len] != 0 : node_time->mv_size != node_len + TIME_SIZE)
+		return 0;
 
-	rc = mdb_dbi_open(txn, DB_KEY_TO_TIME, MDB_CREATE, &env->dbi_key_to_time);
-	if (rc) goto cleanup_txn;
+	time->mv_size = node_time->mv_size - prefix_len;
+	time->mv_data = data + prefix_len;
+	return 1;
+}
 
-	rc = mdb_dbi_open(txn, DB_NODES, MDB_CREATE, &env->dbi_nodes);
-	if (rc) goto cleanup_txn;
+/* Value compression
+ *
+ * Values of put operations are either stored as they are in db_time_to_data or compressed in
+ * db_time_to_zdata. A compressed value has the form
+ *
+ * codec(1) raw-size(8) compressed-bytes
+ *
+ * The codec byte is an index into the codecs table below. A value is only compressed if it is at
+ * least codec_min_size bytes long and the compressed form is smaller than the value itself.
+ * The replicator sends compressed values as they are to remote nodes that know the codec.
+ */
 
-	rc = mdb_dbi_open(txn, DB_NODE_TIME, MDB_CREATE, &env->dbi_node_time);
-	if (rc) goto cleanup_txn;
-	
-	rc = mdb_txn_commit(txn);
-	if (rc) goto cleanup_env;
-	
+/* lz is a small LZ77 variant in the style of LZ4. A compressed block is a sequence of
+ *
+ * token(1) [literal-length-bytes] literals [offset(2) [match-length-bytes]]
+ *
+ * The upper four bits of the token are the literal length and the lower four bits the match length
+ * minus 4. The value 15 means that more length bytes follow, each adding up to 255. The last
+ * sequence has no match. Offsets are big-endian and at most 65535 bytes back.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op == oend) return NULL;
+		*op++ = 255;
+	}
+	if (op == oend) return NULL;
+	*op++ = (uint8_t) len;
+	return op;
+}
+
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+	do {
+		if (*ip == iend) return EINVAL;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/* lz_put_sequence returns NULL if dst is too small. A match_len of 0 means no match. */
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+	if (op == oend) return NULL;
+	uint8_t *token = op++;
+	*token = (uint8_t) ((lit_len < 15 ? lit_len : 15) << 4);
+	if (lit_len >= 15 && !(op = lz_put_length(op, oend, lit_len - 15)))
+		return NULL;
+
+	if ((size_t) (oend - op) < lit_len) return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len == 0) return op;
+
+	if (oend - op < 2) return NULL;
+	*op++ = (uint8_t) (offset >> 8);
+	*op++ = (uint8_t) offset;
+
+	size_t len = match_len - LZ_MIN_MATCH;
+	*token |= len < 15 ? len : 15;
+	if (len >= 15 && !(op = lz_put_length(op, oend, len - 15)))
+		return NULL;
+
+	return op;
+}
+
+/* lz_compress_dict compresses the bytes from start to end of base. Matches can refer back to the bytes
+ * before start, the dictionary. table holds positions in base plus one, and 0 is empty. It returns the
+ * compressed size or 0 if the result does not fit in cap bytes.
+ */
+static size_t lz_compress_dict(uint32_t *table, const uint8_t *base, size_t start, size_t end, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = base + start;
+	const uint8_t *anchor = ip;
+	const uint8_t *iend = base + end;
+	const uint8_t *ilimit = end - start < LZ_MIN_MATCH ? ip : iend - LZ_MIN_MATCH;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + cap;
+
+	if (end >= UINT32_MAX) return 0;
+
+	while (ip < ilimit) {
+		uint32_t h = lz_hash(ip);
+		uint32_t pos = (uint32_t) (ip - base);
+		uint32_t candidate = table[h];
+		table[h] = pos + 1;
+
+		if (!candidate || pos - (candidate - 1) > LZ_MAX_OFFSET || memcmp(base + candidate - 1, ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		const uint8_t *ref = base + candidate - 1;
+		size_t len = LZ_MIN_MATCH;
+		while (ip + len < iend && ref[len] == ip[len]) len++;
+
+		op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+		if (!op) return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	return op ? op - dst : 0;
+}
+
+/* lz_compress returns the compressed size or 0 if the result does not fit in cap bytes */
+static size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = {0};
+	return lz_compress_dict(table, src, 0, size, dst, cap);
+}
+
+/* lz_decompress_dict decompresses src to raw_size bytes at base + start. Matches can refer back to
+ * the bytes before start. It returns 0 on success and EINVAL otherwise.
+ */
+static int lz_decompress_dict(const uint8_t *src, size_t size, uint8_t *base, size_t start, size_t raw_size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + size;
+	uint8_t *op = base + start;
+	uint8_t *oend = op + raw_size;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && lz_get_length(&ip, iend, &lit_len))
+			return EINVAL;
+		if ((size_t) (iend - ip) < lit_len || (size_t) (oend - op) < lit_len)
+			return EINVAL;
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return EINVAL;
+		size_t offset = ((size_t) ip[0] << 8) | ip[1];
+		ip += 2;
+
+		size_t match_len = token & 15;
+		if (match_len == 15 && lz_get_length(&ip, iend, &match_len))
+			return EINVAL;
+		match_len += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t) (op - base) || (size_t) (oend - op) < match_len)
+			return EINVAL;
+
+		/* byte by byte since the match can overlap the output */
+		const uint8_t *ref = op - offset;
+		for (size_t i = 0; i < match_len; i++) {
+			op[i] = ref[i];
+		}
+		op += match_len;
+	}
+
+	return op == oend ? 0 : EINVAL;
+}
+
+/* lz_decompress returns 0 if src decompresses to exactly raw_size bytes and EINVAL otherwise */
+static int lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size)
+{
+	return lz_decompress_dict(src, size, dst, 0, raw_size);
+}
+
+/* Stream compression
+ *
+ * A replicator can compress the byte stream of a connection with lz. The stream is cut in blocks
+ *
+ * block = raw-size compressed-size compressed-bytes
+ *
+ * where the sizes are varints and a compressed size of 0 means that the raw bytes follow. Matches can
+ * refer back to the previous LZ_STREAM_HISTORY bytes of the stream, so table names, keys and values
+ * that repeat across messages compress well. The hash table of the compressor is kept between blocks.
+ */
+
+#define LZ_STREAM_BLOCK 65536
+#define LZ_STREAM_HISTORY (LZ_MAX_OFFSET + 1)
+#define LZ_STREAM_MAX_HEADER (2 * VARINT_MAX_SIZE)
+
+struct lz_stream {
+	size_t size;  /* the bytes in buf */
+	uint32_t table[1 << LZ_HASH_BITS];
+	uint8_t buf[LZ_STREAM_HISTORY + LZ_STREAM_BLOCK];
+};
+
+static struct lz_stream *lz_stream_alloc(void)
+{
+	struct lz_stream *stream = tr_malloc(sizeof *stream);
+	stream->size = 0;
+	memset(stream->table, 0, sizeof stream->table);
+	return stream;
+}
+
+/* lz_stream_reserve returns room for size bytes after the history, size is at most LZ_STREAM_BLOCK */
+static uint8_t *lz_stream_reserve(struct lz_stream *stream, size_t size)
+{
+	if (stream->size + size > sizeof stream->buf) {
+		size_t shift = stream->size - LZ_STREAM_HISTORY;
+		memmove(stream->buf, stream->buf + shift, LZ_STREAM_HISTORY);
+		stream->size = LZ_STREAM_HISTORY;
+		for (size_t i = 0; i < sizeof stream->table / sizeof stream->table[0]; i++) {
+			stream->table[i] = stream->table[i] > shift ? stream->table[i] - shift : 0;
+		}
+	}
+	return stream->buf + stream->size;
+}
+
+/* lz_stream_compress writes a block of the size bytes that were written at lz_stream_reserve. dst must
+ * have room for LZ_STREAM_MAX_HEADER + size bytes. It returns the size of the block.
+ */
+static size_t lz_stream_compress(struct lz_stream *stream, size_t size, uint8_t *dst)
+{
+	size_t start = stream->size;
+	stream->size += size;
+
+	uint8_t *op = dst + encode_varint(dst, size);
+	uint8_t compressed[LZ_STREAM_BLOCK];
+	size_t compressed_size = lz_compress_dict(stream->table, stream->buf, start, stream->size, compressed, size - 1);
+	if (compressed_size == 0) {
+		op += encode_varint(op, 0);
+		memcpy(op, stream->buf + start, size);
+		return op + size - dst;
+	}
+
+	op += encode_varint(op, compressed_size);
+	memcpy(op, compressed, compressed_size);
+	return op + compressed_size - dst;
+}
+
+/* lz_stream_decompress decodes the block at the start of src. It returns ENOENT if src does not hold
+ * a whole block and EINVAL if the block is invalid. On success, consumed is the size of the block and
+ * raw points to the raw bytes in the history.
+ */
+static int lz_stream_decompress(struct lz_stream *stream, uint8_t *src, size_t size, size_t *consumed, uint8_t **raw, size_t *raw_size)
+{
+	uint64_t block_size, compressed_size;
+	size_t n1 = decode_varint(src, size, &block_size);
+	if (n1 == 0)
+		return size < VARINT_MAX_SIZE ? ENOENT : EINVAL;
+	size_t n2 = decode_varint(src + n1, size - n1, &compressed_size);
+	if (n2 == 0)
+		return size - n1 < VARINT_MAX_SIZE ? ENOENT : EINVAL;
+	if (block_size == 0 || block_size > LZ_STREAM_BLOCK || compressed_size >= block_size)
+		return EINVAL;
+
+	size_t data_size = compressed_size == 0 ? block_size : compressed_size;
+	if (size - n1 - n2 < data_size)
+		return ENOENT;
+
+	uint8_t *dst = lz_stream_reserve(stream, block_size);
+	uint8_t *data = src + n1 + n2;
+	if (compressed_size == 0) {
+		memcpy(dst, data, block_size);
+	} else if (lz_decompress_dict(data, compressed_size, stream->buf, stream->size, block_size)) {
+		return EINVAL;
+	}
+
+	stream->size += block_size;
+	*consumed = n1 + n2 + data_size;
+	*raw = dst;
+	*raw_size = block_size;
+	return 0;
+}
+
+#ifdef TRLMDB_ZLIB
+static size_t zlib_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t cap)
+{
+	uLongf dst_len = cap;
+	if (compress2(dst, &dst_len, src, size, Z_BEST_SPEED) != Z_OK)
+		return 0;
+	return dst_len;
+}
+
+static int zlib_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size)
+{
+	uLongf dst_len = raw_size;
+	if (uncompress(dst, &dst_len, src, size) != Z_OK || dst_len != raw_size)
+		return EINVAL;
+	return 0;
+}
+#endif
+
+static const struct codec codecs[] = {
+	[TRLMDB_CODEC_LZ] = {"lz", CAP_CODEC_LZ, lz_compress, lz_decompress},
+#ifdef TRLMDB_ZLIB
+	[TRLMDB_CODEC_ZLIB] = {"zlib", CAP_CODEC_ZLIB, zlib_compress, zlib_decompress},
+#endif
+};
+
+/* codec_find returns NULL for TRLMDB_CODEC_NONE and codecs that are not compiled in */
+static const struct codec *codec_find(int codec)
+{
+	if (codec <= 0 || codec >= (int) (sizeof codecs / sizeof codecs[0]) || !codecs[codec].compress)
+		return NULL;
+	return codecs + codec;
+}
+
+/* codec_caps returns the capabilities for the codecs that are compiled in */
+static unsigned int codec_caps(void)
+{
+	unsigned int caps = 0;
+	for (size_t i = 0; i < sizeof codecs / sizeof codecs[0]; i++) {
+		if (codecs[i].compress)
+			caps |= codecs[i].cap;
+	}
+	return caps;
+}
+
+/* value_compress returns a malloced compressed value, or NULL if the value should be stored as it is */
+static uint8_t *value_compress(struct trlmdb_env *env, MDB_val *data, size_t *size)
+{
+	const struct codec *codec = codec_find(env->codec);
+	if (!codec || data->mv_size < env->codec_min_size || data->mv_size <= 10)
+		return NULL;
+
+	/* The compressed value including the header must be smaller than the raw value */
+	uint8_t *buf = malloc(data->mv_size - 1);
+	if (!buf)
+		return NULL;
+
+	size_t compressed_size = codec->compress(data->mv_data, data->mv_size, buf + 9, data->mv_size - 10);
+	if (!compressed_size) {
+		free(buf);
+		return NULL;
+	}
+
+	buf[0] = (uint8_t) env->codec;
+	encode_uint64(buf + 1, data->mv_size);
+	*size = 9 + compressed_size;
+
+	return buf;
+}
+
+/* value_codec returns the codec of a compressed value, or NULL if the value is malformed */
+static const struct codec *value_codec(MDB_val *compressed)
+{
+	if (compressed->mv_size < 9)
+		return NULL;
+	return codec_find(*(uint8_t*)compressed->mv_data);
+}
+
+/* txn_decode_alloc returns memory that stays valid until the transaction is committed or aborted */
+static uint8_t *txn_decode_alloc(struct trlmdb_txn *txn, size_t size)
+{
+	struct decode_block *block = txn->decode_blocks;
+	if (!block || block->cap - block->used < size) {
+		size_t cap = size < 65536 ? 65536 : size;
+		block = malloc(sizeof *block + cap);
+		if (!block)
+			return NULL;
+		block->cap = cap;
+		block->used = 0;
+		block->next = txn->decode_blocks;
+		txn->decode_blocks = block;
+	}
+
+	uint8_t *mem = block->data + block->used;
+	block->used += size;
+	return mem;
+}
+
+static void txn_decode_free(struct trlmdb_txn *txn)
+{
+	while (txn->decode_blocks) {
+		struct decode_block *next = txn->decode_blocks->next;
+		free(txn->decode_blocks);
+		txn->decode_blocks = next;
+	}
+}
+
+static int value_decompress(struct trlmdb_txn *txn, MDB_val *compressed, MDB_val *data)
+{
+	const struct codec *codec = value_codec(compressed);
+	if (!codec)
+		return EINVAL;
+
+	uint8_t *buf = compressed->mv_data;
+	uint64_t raw_size = decode_uint64(buf + 1);
+	if (raw_size > SIZE_MAX)
+		return EINVAL;
+
+	uint8_t *raw = txn_decode_alloc(txn, raw_size);
+	if (!raw)
+		return ENOMEM;
+
+	int rc = codec->decompress(buf + 9, compressed->mv_size - 9, raw, raw_size);
+	if (rc)
+		return rc;
+
+	data->mv_size = raw_size;
+	data->mv_data = raw;
+	return 0;
+}
+
+/* Network code */
+
+/* create_listener returns a valid fd. It exists if there are errors. */
+static int create_listener(const char *hostname, const char *servname)
+{
+	struct addrinfo hints = {0};
+
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = PF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *res;
+	int status = getaddrinfo(hostname, servname, &hints, &res);
+	if (status)
+		log_fatal_err("getaddrinfo error: %s\n", gai_strerror(status));
+
+	int listen_fd = -1;
+	struct addrinfo *addrinfo;
+	for (addrinfo = res; addrinfo != NULL; addrinfo = addrinfo->ai_next) {
+		listen_fd = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol);
+		if (listen_fd == -1)
+			continue;
+
+		int socket_option_value = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &socket_option_value, sizeof(int));
+		
+		if (bind(listen_fd, addrinfo->ai_addr, addrinfo->ai_addrlen) == -1)
+			log_fatal_err("bind error: %s\n", strerror(errno));
+
+		break;
+	}
+
+	if (addrinfo == NULL) {
+		fprintf(stderr, "Check that the host and port are correct, that the port is not used by another process and that the process has the right permission\n");
+		return -1;
+	}
+
+	freeaddrinfo(res);
+	
+	int backlog = 20;
+	if (listen(listen_fd, backlog) == -1)
+		log_fatal_err("listen error: %s\n", strerror(errno));
+
+	return listen_fd;
+}
+
+static void *replicator_loop(void *arg);
+static struct event_pool *event_pool_create(struct trlmdb_env *env, int nthreads);
+static void event_pool_add(struct event_pool *pool, struct rstate *rs);
+static void event_pool_join(struct event_pool *pool);
+static void notify_start(struct trlmdb_env *env, int interval);
+static struct applier *applier_create(struct trlmdb_env *env);
+
+/* accept_loop runs each accepted connection in its own thread, or hands it to the event pool */
+static void accept_loop(int listen_fd, struct trlmdb_env *env, struct conf_info *conf_info, struct event_pool *pool, struct applier *applier, struct send_cache *send_cache, struct conn_registry *registry)
+{
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (;;) {
+		struct sockaddr_storage remote_addr;
+		socklen_t remote_addr_len = sizeof remote_addr;
+
+		printf("ready to accept\n");
+		int accepted_fd = accept(listen_fd, (struct sockaddr *) &remote_addr, &remote_addr_len);
+		printf("accepted = %d\n", accepted_fd);
+		if (accepted_fd == -1)
+			continue;
+
+		int on = 1;
+		setsockopt(accepted_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on);
+
+		/* Partial writes tell the replicator that the send window is too large */
+		int rc = fcntl(accepted_fd, F_SETFL, fcntl(accepted_fd, F_GETFL, 0) | O_NONBLOCK);
+		if (rc == -1) {
+			perror("accept");
+			close(accepted_fd);
+			continue;
+		}
+		
+		struct rstate *rs = rstate_alloc_init(env, conf_info);
+		rs->socket_fd = accepted_fd;
+		rs->applier = applier;
+		rs->send_cache = send_cache;
+		rs->registry = registry;
+
+		if (pool) {
+			event_pool_add(pool, rs);
+			continue;
+		}
+		
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, replicator_loop, rs))
+			log_fatal_err("error creatng a new thread\n");
+	}
+}
+
+/* create_connection returns a non-blocking socket that connects to hostname:servname, or -1. If
+ * connecting is NULL, it waits at most timeout milliseconds for the connect to finish. Otherwise it
+ * sets *connecting to 1 if the connect is still in progress.
+ */
+static int create_connection(const char *hostname, const char *servname, int timeout, int *connecting)
+{
+	struct addrinfo hints = {0};
+
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = PF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *res;
+	int rc;
+
+	printf("hostname = %s, servname = %s\n", hostname, servname);
+	
+	if ((rc = getaddrinfo(hostname, servname, &hints, &res))) {
+		log_stderr("getaddrinfo error: %s\n", gai_strerror(rc));
+		return -1;
+	}
+
+	int socket_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (socket_fd == -1) {
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt(socket_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on);
+
+	rc = fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK);
+	if (rc == -1) {
+		perror("fcntl in connect");
+		close(socket_fd);
+		freeaddrinfo(res);
+		return -1;
+	}		
+
+	int in_progress = 0;
+	rc = connect(socket_fd, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if (rc == -1 && errno == EINPROGRESS) {
+		in_progress = 1;
+		rc = 0;
+	}
+
+	/* Wait for the connect */
+	if (rc == 0 && in_progress && !connecting) {
+		struct pollfd pollfd = {socket_fd, POLLOUT, 0};
+		int err = 0;
+		socklen_t len = sizeof err;
+		if (poll(&pollfd, 1, timeout) != 1) {
+			err = ETIMEDOUT;
+		} else if (getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+			err = errno;
+		}
+		errno = err;
+		rc = err ? -1 : 0;
+		in_progress = 0;
+	}
+
+	if (rc == -1) {
+		log_stderr("connect error to %s:%s: %s. Trying again later\n", hostname, servname, strerror(errno));
+		close(socket_fd);
+		return -1;
+	}
+
+	if (connecting)
+		*connecting = in_progress;
+	if (!in_progress)
+		printf("connected to %s:%s\n", hostname, servname);
+	
+	return socket_fd;
+}
+
+/* node message */
+static char *read_node(struct message *msg)
+{
+	struct msg_fields fields;
+	if (msg_parse(msg, &fields) || fields.count != 2 || !msg_fields_type(&fields, "node"))
+		return NULL;
+
+	uint64_t size = fields.size[1];
+	char *node = tr_malloc(size + 1);
+
+	memcpy(node, fields.data[1], size);
+	node[size] = '\0';
+
+	return node;
+}
+
+static void write_node(struct message *msg, const char *node)
+{
+	msg_reset(msg);
+	msg_append(msg, (uint8_t*) "node", 4); 
+	msg_append(msg, (uint8_t*)node, strlen(node));
+}
+
+/* caps and opts messages
+ *
+ * A "caps" message lists the capabilities of the sender and is sent right after the node message.
+ * An "opts" message lists the capabilities that the sender uses in all following messages. It is
+ * only sent after the remote capabilities are known. Old replicators ignore both messages.
+ */
+
+static const char *cap_names[] = {"codec-lz", "codec-zlib", "table-ids", "compact-time", "chunks", "wire-v2", "frames", "stream-lz", "range-sync", "acks"};
+
+/* env_caps returns the capabilities of a replicator for the environment. Compact times are
+ * converted when the database uses 20 byte times, so all replicators can use them on the network.
+ */
+static unsigned int env_caps(struct trlmdb_env *env)
+{
+	unsigned int caps = codec_caps() | CAP_COMPACT_TIME | CAP_CHUNKS | CAP_WIRE_V2 | CAP_FRAMES | CAP_STREAM_LZ | CAP_RANGE_SYNC | CAP_ACKS;
+	if (env->flags & TRLMDB_TABLE_IDS)
+		caps |= CAP_TABLE_IDS;
+	return caps;
+}
+
+static void write_caps(struct message *msg, const char *type, unsigned int caps)
+{
+	msg_reset(msg);
+	msg_append(msg, (uint8_t*) type, 4);
+	for (size_t i = 0; i < sizeof cap_names / sizeof cap_names[0]; i++) {
+		if (caps & (1u << i))
+			msg_append(msg, (uint8_t*) cap_names[i], strlen(cap_names[i]));
+	}
+}
+
+/* read_caps returns 0 and fills in caps if msg is a message of the given type. Unknown
+ * capabilities are ignored.
+ */
+static int read_caps(struct message *msg, const char *type, unsigned int *caps)
+{
+	uint8_t *data;
+	uint64_t size;
+
+	if (msg_get_elem(msg, 0, &data, &size) || size != 4 || memcmp(data, type, 4) != 0)
+		return EINVAL;
+
+	*caps = 0;
+	uint64_t count = msg_get_count(msg);
+	for (uint64_t i = 1; i < count; i++) {
+		msg_get_elem(msg, i, &data, &size);
+		for (size_t j = 0; j < sizeof cap_names / sizeof cap_names[0]; j++) {
+			if (size == strlen(cap_names[j]) && memcmp(data, cap_names[j], size) == 0)
+				*caps |= 1u << j;
+		}
+	}
+
+	return 0;
+}
+
+/* Table catalog cache
+ *
+ * An environment with TRLMDB_TABLE_IDS caches the catalog entries that are known to be committed,
+ * so that puts do not have to look up the catalog. Entries seen by a transaction are added to the
+ * cache when the transaction commits.
+ */
+
+static struct table_entry *table_entry_find(struct table_entry *tables, size_t ntables, uint32_t id)
+{
+	size_t lo = 0;
+	size_t hi = ntables;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (tables[mid].id == id) return tables + mid;
+		if (tables[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* table_entry_match returns 1 if the entry has the table name, 0 if the name differs and -1 if there is no entry */
+static int table_entry_match(struct table_entry *entry, const char *table, size_t table_len)
+{
+	if (!entry) return -1;
+	return strlen(entry->name) == table_len && memcmp(entry->name, table, table_len) == 0;
+}
+
+static int txn_table_add(struct trlmdb_txn *txn, uint32_t id, const char *table, size_t table_len)
+{
+	struct table_entry *new_tables = realloc(txn->new_tables, (txn->n_new_tables + 1) * sizeof *new_tables);
+	if (!new_tables)
+		return ENOMEM;
+	txn->new_tables = new_tables;
+
+	char *name = strndup(table, table_len);
+	if (!name)
+		return ENOMEM;
+
+	new_tables[txn->n_new_tables++] = (struct table_entry) {id, name};
+	return 0;
+}
+
+/* txn_table_lookup looks for the id among the committed entries and the entries of the transaction */
+static int txn_table_lookup(struct trlmdb_txn *txn, uint32_t id, const char *table, size_t table_len)
+{
+	struct trlmdb_env *env = txn->env;
+
+	pthread_mutex_lock(&env->table_mutex);
+	int match = table_entry_match(table_entry_find(env->tables, env->ntables, id), table, table_len);
+	pthread_mutex_unlock(&env->table_mutex);
+
+	for (size_t i = 0; match == -1 && i < txn->n_new_tables; i++) {
+		if (txn->new_tables[i].id == id)
+			match = table_entry_match(txn->new_tables + i, table, table_len);
+	}
+
+	return match;
+}
+
+/* txn_tables_commit moves the entries of a committed transaction to the cache of the environment */
+static void txn_tables_commit(struct trlmdb_txn *txn)
+{
+	struct trlmdb_env *env = txn->env;
+
+	pthread_mutex_lock(&env->table_mutex);
+	for (size_t i = 0; i < txn->n_new_tables; i++) {
+		struct table_entry *entry = txn->new_tables + i;
+		if (table_entry_find(env->tables, env->ntables, entry->id))
+			continue;
+
+		struct table_entry *tables = realloc(env->tables, (env->ntables + 1) * sizeof *tables);
+		if (!tables)
+			break;
+		env->tables = tables;
+
+		size_t pos = env->ntables;
+		while (pos > 0 && tables[pos - 1].id > entry->id) {
+			tables[pos] = tables[pos - 1];
+			pos--;
+		}
+		tables[pos] = *entry;
+		env->ntables++;
+		entry->name = NULL;
+	}
+	pthread_mutex_unlock(&env->table_mutex);
+}
+
+static void txn_tables_free(struct trlmdb_txn *txn)
+{
+	for (size_t i = 0; i < txn->n_new_tables; i++) {
+		free(txn->new_tables[i].name);
+	}
+	free(txn->new_tables);
+	txn->new_tables = NULL;
+	txn->n_new_tables = 0;
+}
+
+/* Table databases
+ *
+ * An environment with TRLMDB_TABLE_DBIS keeps the key to time mapping of each table in a separate
+ * LMDB database named "t:" and the table name, or "i:" and the hexadecimal table id in an
+ * environment with TRLMDB_TABLE_IDS. The keys are the extended keys without the table part. The
+ * databases are created on first use and are listed in the main LMDB database.
+ *
+ * LMDB requires that a transaction that opens a database ends before another transaction opens a
+ * database. A transaction that opens a database therefore holds dbi_mutex until it ends. The
+ * databases that exist when the environment is opened are opened right away, and the handles
+ * opened by a transaction are added to the cache of the environment when the transaction commits.
+ */
+
+static int prefix_cmp(MDB_val *prefix1, MDB_val *prefix2)
+{
+	size_t size = prefix1->mv_size < prefix2->mv_size ? prefix1->mv_size : prefix2->mv_size;
+	int cmp = memcmp(prefix1->mv_data, prefix2->mv_data, size);
+	if (cmp)
+		return cmp;
+	return (prefix1->mv_size > prefix2->mv_size) - (prefix1->mv_size < prefix2->mv_size);
+}
+
+static struct table_dbi *table_dbi_find(struct table_dbi *dbis, size_t ndbis, MDB_val *prefix)
+{
+	size_t lo = 0;
+	size_t hi = ndbis;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = prefix_cmp(&dbis[mid].prefix, prefix);
+		if (cmp == 0) return dbis + mid;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* table_dbi_insert inserts a copy of prefix in the sorted array dbis */
+static int table_dbi_insert(struct table_dbi **dbis, size_t *ndbis, MDB_val *prefix, MDB_dbi dbi)
+{
+	if (table_dbi_find(*dbis, *ndbis, prefix))
+		return 0;
+
+	struct table_dbi *new_dbis = realloc(*dbis, (*ndbis + 1) * sizeof *new_dbis);
+	if (!new_dbis)
+		return ENOMEM;
+	*dbis = new_dbis;
+
+	uint8_t *data = malloc(prefix->mv_size);
+	if (!data)
+		return ENOMEM;
+	memcpy(data, prefix->mv_data, prefix->mv_size);
+
+	size_t pos = *ndbis;
+	while (pos > 0 && prefix_cmp(&new_dbis[pos - 1].prefix, prefix) > 0) {
+		new_dbis[pos] = new_dbis[pos - 1];
+		pos--;
+	}
+	new_dbis[pos] = (struct table_dbi) {{prefix->mv_size, data}, dbi};
+	(*ndbis)++;
+	return 0;
+}
+
+static void table_dbis_free(struct table_dbi *dbis, size_t ndbis)
+{
+	for (size_t i = 0; i < ndbis; i++) {
+		free(dbis[i].prefix.mv_data);
+	}
+	free(dbis);
+}
+
+/* table_dbi_name returns the malloced name of the database of the table with the prefix */
+static char *table_dbi_name(struct trlmdb_env *env, MDB_val *prefix)
+{
+	if (env->flags & TRLMDB_TABLE_IDS) {
+		char *name = malloc(11);
+		if (name)
+			snprintf(name, 11, "i:%08x", decode_uint32(prefix->mv_data));
+		return name;
+	}
+
+	size_t table_len = prefix->mv_size - 1;
+	char *name = malloc(table_len + 3);
+	if (!name)
+		return NULL;
+	memcpy(name, "t:", 2);
+	memcpy(name + 2, prefix->mv_data, table_len);
+	name[table_len + 2] = '\0';
+	return name;
+}
+
+/* table_dbi_prefix is the inverse of table_dbi_name. It returns 0 if name is the name of a table database */
+static int table_dbi_prefix(struct trlmdb_env *env, MDB_val *name, uint8_t *buf, size_t buf_size, MDB_val *prefix)
+{
+	uint8_t *data = name->mv_data;
+	if (env->flags & TRLMDB_TABLE_IDS) {
+		if (name->mv_size != 10 || memcmp(data, "i:", 2) != 0)
+			return EINVAL;
+		uint32_t id = 0;
+		for (size_t i = 2; i < 10; i++) {
+			int digit = data[i] >= 'a' ? data[i] - 'a' + 10 : data[i] - '0';
+			if (digit < 0 || digit > 15)
+				return EINVAL;
+			id = (id << 4) | (uint32_t) digit;
+		}
+		encode_uint32(buf, id);
+		*prefix = (MDB_val) {4, buf};
+		return 0;
+	}
+
+	if (name->mv_size < 2 || memcmp(data, "t:", 2) != 0 || name->mv_size - 1 > buf_size)
+		return EINVAL;
+	memcpy(buf, data + 2, name->mv_size - 2);
+	buf[name->mv_size - 2] = '\0';
+	*prefix = (MDB_val) {name->mv_size - 1, buf};
+	return 0;
+}
+
+/* env_table_dbis_open opens the table databases that exist when the environment is opened */
+static int env_table_dbis_open(struct trlmdb_env *env, MDB_txn *txn)
+{
+	MDB_dbi main_dbi;
+	int rc = mdb_dbi_open(txn, NULL, 0, &main_dbi);
+	if (rc)
+		return rc;
+
+	MDB_cursor *cursor;
+	rc = mdb_cursor_open(txn, main_dbi, &cursor);
+	if (rc)
+		return rc;
+
+	uint8_t buf[512];
+	MDB_val name, data, prefix;
+	while ((rc = mdb_cursor_get(cursor, &name, &data, MDB_NEXT)) == 0) {
+		if (table_dbi_prefix(env, &name, buf, sizeof buf, &prefix))
+			continue;
+
+		char *dbi_name = table_dbi_name(env, &prefix);
+		if (!dbi_name) {
+			rc = ENOMEM;
+			break;
+		}
+
+		MDB_dbi dbi;
+		rc = mdb_dbi_open(txn, dbi_name, 0, &dbi);
+		free(dbi_name);
+		if (!rc)
+			rc = table_dbi_insert(&env->table_dbis, &env->ntable_dbis, &prefix, dbi);
+		if (rc)
+			break;
+	}
+
+	mdb_cursor_close(cursor);
+	return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+/* txn_table_dbi finds the database of the table with the prefix. It returns MDB_NOTFOUND if the
+ * database does not exist and create is zero.
+ */
+static int txn_table_dbi(struct trlmdb_txn *txn, MDB_val *prefix, int create, MDB_dbi *dbi)
+{
+	struct trlmdb_env *env = txn->env;
+
+	struct table_dbi *found = table_dbi_find(txn->new_table_dbis, txn->n_new_table_dbis, prefix);
+	if (found) {
+		*dbi = found->dbi;
+		return 0;
+	}
+
+	if (!txn->dbi_locked)
+		pthread_mutex_lock(&env->dbi_mutex);
+
+	found = table_dbi_find(env->table_dbis, env->ntable_dbis, prefix);
+	if (found) {
+		*dbi = found->dbi;
+		if (!txn->dbi_locked)
+			pthread_mutex_unlock(&env->dbi_mutex);
+		return 0;
+	}
+
+	int rc = ENOMEM;
+	char *name = table_dbi_name(env, prefix);
+	if (name) {
+		unsigned int flags = create && !(txn->flags & MDB_RDONLY) ? MDB_CREATE : 0;
+		rc = mdb_dbi_open(txn->mdb_txn, name, flags, dbi);
+		free(name);
+	}
+	if (!rc)
+		rc = table_dbi_insert(&txn->new_table_dbis, &txn->n_new_table_dbis, prefix, *dbi);
+
+	if (!rc) {
+		txn->dbi_locked = 1;
+	} else if (!txn->dbi_locked) {
+		pthread_mutex_unlock(&env->dbi_mutex);
+	}
+
+	return rc;
+}
+
+/* txn_table_dbis_end adds the handles opened by a committed transaction to the cache of the
+ * environment and releases dbi_mutex. LMDB closes the handles of an aborted transaction.
+ */
+static void txn_table_dbis_end(struct trlmdb_txn *txn, int committed)
+{
+	struct trlmdb_env *env = txn->env;
+
+	for (size_t i = 0; committed && i < txn->n_new_table_dbis; i++) {
+		struct table_dbi *entry = txn->new_table_dbis + i;
+		if (table_dbi_insert(&env->table_dbis, &env->ntable_dbis, &entry->prefix, entry->dbi))
+			break;
+	}
+
+	table_dbis_free(txn->new_table_dbis, txn->n_new_table_dbis);
+	txn->new_table_dbis = NULL;
+	txn->n_new_table_dbis = 0;
+
+	if (txn->dbi_locked) {
+		txn->dbi_locked = 0;
+		pthread_mutex_unlock(&env->dbi_mutex);
+	}
+}
+
+/* The trlmdb functions. trlmdb is a wrapper around the lmdb functions. trlmdb contrls the lmdb
+ * database, and all dataase access should go throught these functions.
+ */  
+
+int trlmdb_env_create(struct trlmdb_env **env)
+{
+	*env = malloc(sizeof **env);
+	if (!*env) return ENOMEM;
+
+	**env = (struct trlmdb_env) {0}; 
+	
+	encode_uint32((*env)->time_id, arc4random());
+	
+	int rc = mdb_env_create(&((*env)->mdb_env));
+	if (rc) {
+		free(*env);
+		return rc;
+	}
+
+	pthread_mutex_init(&(*env)->table_mutex, NULL);
+	pthread_mutex_init(&(*env)->dbi_mutex, NULL);
+	pthread_mutex_init(&(*env)->notify_mutex, NULL);
+
+	mdb_env_set_maxdbs((*env)->mdb_env, N_INTERNAL_DBS);
+	(*env)->map_size = (uint64_t)4096 * 4096 * 300;
+	mdb_env_set_mapsize((*env)->mdb_env, (*env)->map_size);
+	
+	return rc;
+}
+
+int trlmdb_env_set_mapsize(struct trlmdb_env *env, uint64_t size)
+{
+	int rc = mdb_env_set_mapsize(env->mdb_env, size);	
+	if (!rc)
+		env->map_size = size;
+	return rc;
+}
+
+int trlmdb_env_set_maxtables(struct trlmdb_env *env, unsigned int max_tables)
+{
+	int rc = mdb_env_set_maxdbs(env->mdb_env, N_INTERNAL_DBS + max_tables);
+	if (!rc)
+		env->max_tables = max_tables;
+	return rc;
+}
+
+int trlmdb_env_set_codec(struct trlmdb_env *env, int codec, size_t min_size)
+{
+	if (codec != TRLMDB_CODEC_NONE && !codec_find(codec))
+		return EINVAL;
+
+	env->codec = codec;
+	env->codec_min_size = min_size;
+	return 0;
+}
+
+int trlmdb_env_set_flags(struct trlmdb_env *env, unsigned int flags)
+{
+	if (flags & ~(TRLMDB_TABLE_IDS | TRLMDB_COMPACT_TIME | TRLMDB_TABLE_DBIS))
+		return EINVAL;
+
+	env->flags = flags;
+	if ((flags & TRLMDB_TABLE_DBIS) && env->max_tables == 0)
+		return trlmdb_env_set_maxtables(env, DEFAULT_MAX_TABLES);
+	return 0;
+}
+
+/* env_flags_load reads the flags stored in db_meta. The flags are stored when the database is
+ * created, so the requested flags are ignored for existing databases.
+ */
+static int env_flags_load(struct trlmdb_env *env, MDB_txn *txn)
+{
+	MDB_val key = {5, "flags"};
+	MDB_val data;
+	int rc = mdb_get(txn, env->dbi_meta, &key, &data);
+	if (rc == 0) {
+		if (data.mv_size != 4)
+			return EINVAL;
+		env->flags = decode_uint32(data.mv_data);
+		return 0;
+	}
+	if (rc != MDB_NOTFOUND)
+		return rc;
+
+	MDB_stat stat;
+	rc = mdb_stat(txn, env->dbi_time_to_key, &stat);
+	if (rc)
+		return rc;
+
+	/* A database from before db_meta existed */
+	if (stat.ms_entries > 0)
+		env->flags = 0;
+
+	uint8_t flags[4];
+	encode_uint32(flags, env->flags);
+	data = (MDB_val) {4, flags};
+	return mdb_put(txn, env->dbi_meta, &key, &data, 0);
+}
+
+/* Commit notifications
+ *
+ * A commit that inserts times increments a counter in the notification file next to the LMDB files,
+ * trlmdb.notify or path-notify with MDB_NOSUBDIR. All processes that open the environment share the
+ * counter. On Linux, a replicator waits for the counter to change with a futex, so local writes are
+ * replicated without waiting for the timeout.
+ */
+
+static void env_notify_open(struct trlmdb_env *env, const char *path, unsigned int flags, mdb_mode_t mode)
+{
+	if (flags & MDB_RDONLY)
+		return;
+
+	size_t path_len = strlen(path) + 16;
+	char *notify_path = malloc(path_len);
+	if (!notify_path)
+		return;
+	snprintf(notify_path, path_len, (flags & MDB_NOSUBDIR) ? "%s-notify" : "%s/trlmdb.notify", path);
+	int fd = open(notify_path, O_RDWR | O_CREAT, mode);
+	free(notify_path);
+	if (fd == -1)
+		return;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && (st.st_size >= (off_t) sizeof *env->notify || ftruncate(fd, sizeof *env->notify) == 0)) {
+		void *map = mmap(NULL, sizeof *env->notify, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED)
+			env->notify = map;
+	}
+	close(fd);
+}
+
+static void env_notify_commit(struct trlmdb_env *env)
+{
+	if (!env->notify)
+		return;
+
+	__atomic_add_fetch(&env->notify->seq, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	if (__atomic_load_n(&env->notify->waiters, __ATOMIC_SEQ_CST) > 0)
+		syscall(SYS_futex, &env->notify->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+#ifdef __linux__
+/* env_notify_wait waits until the commit counter differs from seq and returns it */
+static uint32_t env_notify_wait(struct trlmdb_env *env, uint32_t seq)
+{
+	__atomic_add_fetch(&env->notify->waiters, 1, __ATOMIC_SEQ_CST);
+	uint32_t current;
+	while ((current = __atomic_load_n(&env->notify->seq, __ATOMIC_SEQ_CST)) == seq)
+		syscall(SYS_futex, &env->notify->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+	__atomic_sub_fetch(&env->notify->waiters, 1, __ATOMIC_SEQ_CST);
+	return current;
+}
+#endif
+
+static void env_notify_add_fd(struct trlmdb_env *env, int fd)
+{
+	pthread_mutex_lock(&env->notify_mutex);
+	env->notify_fds = tr_realloc(env->notify_fds, (env->nnotify_fds + 1) * sizeof *env->notify_fds);
+	env->notify_fds[env->nnotify_fds++] = fd;
+	pthread_mutex_unlock(&env->notify_mutex);
+}
+
+static void env_notify_remove_fd(struct trlmdb_env *env, int fd)
+{
+	pthread_mutex_lock(&env->notify_mutex);
+	for (size_t i = 0; i < env->nnotify_fds; i++) {
+		if (env->notify_fds[i] == fd) {
+			env->notify_fds[i] = env->notify_fds[--env->nnotify_fds];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&env->notify_mutex);
+}
+
+int trlmdb_env_open(struct trlmdb_env *env, const char *path, unsigned int flags, mdb_mode_t mode)
+{
+	int rc = 0;
+
+	rc = mdb_env_open(env->mdb_env, path, flags, mode);
+	if (rc) return rc;
+
+	MDB_txn *txn;
+	rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
+	if (rc) goto cleanup_env;
+
+	rc = mdb_dbi_open(txn, DB_TIME_TO_KEY, MDB_CREATE, &env->dbi_time_to_key);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_TIME_TO_DATA, MDB_CREATE, &env->dbi_time_to_data);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_TIME_TO_ZDATA, MDB_CREATE, &env->dbi_time_to_zdata);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_TIME_TO_CHUNK, MDB_CREATE, &env->dbi_time_to_chunk);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_KEY_TO_TIME, MDB_CREATE, &env->dbi_key_to_time);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_NODES, MDB_CREATE, &env->dbi_nodes);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_NODE_TIME, MDB_CREATE, &env->dbi_node_time[LANE_NORMAL]);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_NODE_TIME_HIGH, MDB_CREATE, &env->dbi_node_time[LANE_HIGH]);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_TABLE_PRIORITY, MDB_CREATE, &env->dbi_table_priority);
+	if (rc) goto cleanup_txn;
+
+	rc = mdb_dbi_open(txn, DB_META, MDB_CREATE, &env->dbi_meta);
+	if (rc) goto cleanup_txn;
+
+	rc = env_flags_load(env, txn);
+	if (rc) goto cleanup_txn;
+
+	if ((env->flags & TRLMDB_TABLE_DBIS) && env->max_tables == 0) {
+		/* The database was created with table databases, which need room in the environment */
+		mdb_txn_abort(txn);
+		mdb_env_close(env->mdb_env);
+		env->mdb_env = NULL;
+		rc = mdb_env_create(&env->mdb_env);
+		if (rc) return rc;
+		mdb_env_set_mapsize(env->mdb_env, env->map_size);
+		trlmdb_env_set_maxtables(env, DEFAULT_MAX_TABLES);
+		return trlmdb_env_open(env, path, flags, mode);
+	}
+
+	if (env->flags & TRLMDB_TABLE_DBIS) {
+		rc = env_table_dbis_open(env, txn);
+		if (rc) goto cleanup_txn;
+	}
+	
+	rc = mdb_txn_commit(txn);
+	if (rc) goto cleanup_env;
+
+	env_notify_open(env, path, flags, mode);
+	goto out;
+
+cleanup_txn:
+	mdb_txn_abort(txn);
+cleanup_env:
+	mdb_env_close(env->mdb_env);
+out:
+	return rc;
+}
+
+void trlmdb_env_close(struct trlmdb_env *env)
+{
+	mdb_env_close(env->mdb_env);
+	for (size_t i = 0; i < env->ntables; i++) {
+		free(env->tables[i].name);
+	}
+	free(env->tables);
+	table_dbis_free(env->table_dbis, env->ntable_dbis);
+	pthread_mutex_destroy(&env->table_mutex);
+	pthread_mutex_destroy(&env->dbi_mutex);
+	if (env->notify)
+		munmap(env->notify, sizeof *env->notify);
+	pthread_mutex_destroy(&env->notify_mutex);
+	free(env->notify_fds);
+	free(env);
+}
+
+
+MDB_env *trlmdb_mdb_env(struct trlmdb_env *env)
+{
+	return env->mdb_env;
+}
+
+int trlmdb_txn_begin(struct trlmdb_env *env, unsigned int flags, struct trlmdb_txn **txn)
+{
+	*txn = malloc(sizeof **txn);
+	if (!*txn)
+		return ENOMEM;
+
+	**txn = (struct trlmdb_txn) {0};
+	
+	(*txn)->env = env;
+	(*txn)->flags = flags;
+	
+	(*txn)->time = malloc(sizeof *(*txn)->time);
+	if (!(*txn)->time) {
+		free(*txn);
+		return ENOMEM;
+	}
+
+	memcpy((*txn)->time->id, env->time_id, 4);
+	time_gettimeofday((*txn)->time);
+	(*txn)->time->counter = 0;
+
+	int rc = mdb_txn_begin(env->mdb_env, NULL, flags, &((*txn)->mdb_txn));
+	if (rc) {
+		free((*txn)->time);
+		free(*txn);
+	}
+
+	return rc;
+}
+
+int trlmdb_txn_commit(struct trlmdb_txn *txn)
+{
+	int rc = 0;
+
+	rc = mdb_txn_commit(txn->mdb_txn);
+	if (!rc)
+		txn_tables_commit(txn);
+	if (!rc && txn->notify)
+		env_notify_commit(txn->env);
+	txn_tables_free(txn);
+	txn_table_dbis_end(txn, !rc);
+	txn_decode_free(txn);
+	free(txn->time);
+	free(txn);
+
+	return rc;
+}
+
+void trlmdb_txn_abort(struct trlmdb_txn *txn)
+{
+	mdb_txn_abort(txn->mdb_txn);
+	txn_tables_free(txn);
+	txn_table_dbis_end(txn, 0);
+	txn_decode_free(txn);
+	free(txn->time);
+	free(txn);
+}
+
+static size_t table_prefix_len(struct trlmdb_env *env, MDB_val *table_key);
+
+/* Priority lanes
+ *
+ * The node-times of the tables with priority are in db_node_time_high instead of db_node_time. The
+ * tables are the extended key prefixes in db_table_priority, which the replicator sets from its conf
+ * file, so the writers of all processes put the node-times of a table in the same lane. The replicator
+ * loads the high lane first, and a time from the normal lane after every priority_weight times from
+ * the high lane, so a large backlog of other tables does not hold back the tables with priority.
+ */
+
+/* node_time_lane returns the lane of the node-times of the extended key */
+static int node_time_lane(struct trlmdb_env *env, MDB_txn *txn, MDB_val *key)
+{
+	MDB_val prefix = {table_prefix_len(env, key), key->mv_data};
+	MDB_val data;
+	if (prefix.mv_size > 0 && mdb_get(txn, env->dbi_table_priority, &prefix, &data) == 0)
+		return LANE_HIGH;
+	return LANE_NORMAL;
+}
+
+/* node_time_del deletes the node-time key from its lane */
+static int node_time_del(struct trlmdb_env *env, MDB_txn *txn, MDB_val *key)
+{
+	for (int lane = 0; lane < NLANES; lane++) {
+		int rc = mdb_del(txn, env->dbi_node_time[lane], key, NULL);
+		if (rc != MDB_NOTFOUND)
+			return rc;
+	}
+	return MDB_NOTFOUND;
+}
+
+static int trlmdb_node_put_time_all_nodes(struct trlmdb_env *env, MDB_txn *txn, MDB_val *time, MDB_val *key)
+{
+	MDB_dbi dbi = env->dbi_node_time[node_time_lane(env, txn, key)];
+	MDB_cursor *cursor;
+	int rc = mdb_cursor_open(txn, env->dbi_nodes, &cursor);
+	if (rc)
+		return rc;
+
+	MDB_val node_val;
+	MDB_val empty_val;
+	MDB_val node_time_val = {2, "ff"};
+
+	while ((rc = mdb_cursor_get(cursor, &node_val, &empty_val, MDB_NEXT)) == 0) {
+		MDB_val node_time_key;
+		rc = encode_node_time(env, node_val.mv_data, node_val.mv_size, time, &node_time_key);
+		if (rc)
+			break;
+		rc = mdb_put(txn, dbi, &node_time_key, &node_time_val, 0);
+		free(node_time_key.mv_data);
+		if (rc)
+			break;
+	}
+
+	mdb_cursor_close(cursor);
+
+	return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+/* key_time_dbi finds the database and the key of an extended key in the key to time mapping. With
+ * TRLMDB_TABLE_DBIS, the database of the table is created if create is non-zero.
+ */
+static int key_time_dbi(struct trlmdb_txn *txn, MDB_val *table_key, int create, MDB_dbi *dbi, MDB_val *key)
+{
+	struct trlmdb_env *env = txn->env;
+	if (!(env->flags & TRLMDB_TABLE_DBIS)) {
+		*dbi = env->dbi_key_to_time;
+		*key = *table_key;
+		return 0;
+	}
+
+	size_t prefix_len = table_prefix_len(env, table_key);
+	if (prefix_len == 0)
+		return EINVAL;
+
+	MDB_val prefix = {prefix_len, table_key->mv_data};
+	int rc = txn_table_dbi(txn, &prefix, create, dbi);
+	if (rc)
+		return rc;
+
+	key->mv_size = table_key->mv_size - prefix_len;
+	key->mv_data = (uint8_t*) table_key->mv_data + prefix_len;
+	return 0;
+}
+
+static int key_time_get(struct trlmdb_txn *txn, MDB_val *table_key, MDB_val *time)
+{
+	MDB_dbi dbi;
+	MDB_val key;
+	int rc = key_time_dbi(txn, table_key, 0, &dbi, &key);
+	if (rc)
+		return rc;
+	return mdb_get(txn->mdb_txn, dbi, &key, time);
+}
+
+/* trlmdb_insert_time_key_data inserts a time with its key and data. storage is STORE_DATA, STORE_ZDATA
+ * for a compressed value, or STORE_CHUNKS for a value whose chunks are already in db_time_to_chunk.
+ */
+static int trlmdb_insert_time_key_data(struct trlmdb_txn *txn, MDB_val *time, MDB_val *key, MDB_val *data, int storage)
+{
+	struct trlmdb_env *env = txn->env;
+
+	MDB_dbi key_dbi;
+	MDB_val dbi_key;
+	int rc = key_time_dbi(txn, key, 1, &key_dbi, &dbi_key);
+	if (rc)
+		return rc;
+
+	MDB_txn *child_txn;
+	rc = mdb_txn_begin(env->mdb_env, txn->mdb_txn, 0, &child_txn);
+	if (rc)
+		return rc;	
+
+	rc = mdb_put(child_txn, env->dbi_time_to_key, time, key, 0);
+	if (rc)
+		goto abort_child_txn;
+
+	if (time_is_put(time) && storage != STORE_CHUNKS) {
+		MDB_dbi dbi = storage == STORE_ZDATA ? env->dbi_time_to_zdata : env->dbi_time_to_data;
+		rc = mdb_put(child_txn, dbi, time, data, 0);
+		if (rc)
+			goto abort_child_txn;
+	}
+
+	int is_time_most_recent = 1;
+	MDB_val existing_time_val;
+	rc = mdb_get(child_txn, key_dbi, &dbi_key, &existing_time_val);
+	if (!rc) {
+		is_time_most_recent = time_cmp(time, &existing_time_val) > 0;
+	}
+
+	if (is_time_most_recent) {
+		rc = mdb_put(child_txn, key_dbi, &dbi_key, time, 0);
+		if (rc)
+			goto abort_child_txn;
+	}
+
+	rc = trlmdb_node_put_time_all_nodes(env, child_txn, time, key);
+	if (rc)
+		goto abort_child_txn;
+	
+	rc = mdb_txn_commit(child_txn);
+	if (!rc)
+		txn->notify = 1;
 	goto out;
+	
+abort_child_txn:
+	mdb_txn_abort(child_txn);
+out:	
+	return rc;
+}	
+
+/* Chunked values
+ *
+ * Values written with the blob functions are stored as chunk rows in db_time_to_chunk. The key of a
+ * chunk row is the time followed by a 4 byte chunk index. A chunked value has no row in
+ * db_time_to_data or db_time_to_zdata.
+ */
+
+static MDB_val encode_chunk_key(uint8_t *dst, MDB_val *time, uint32_t index)
+{
+	memcpy(dst, time->mv_data, time->mv_size);
+	encode_uint32(dst + time->mv_size, index);
+	return (MDB_val) {time->mv_size + 4, dst};
+}
+
+static int trlmdb_chunk_get(struct trlmdb_txn *txn, MDB_val *time, uint32_t index, MDB_val *chunk)
+{
+	uint8_t buf[TIME_MAX_SIZE + 4];
+	MDB_val chunk_key = encode_chunk_key(buf, time, index);
+	return mdb_get(txn->mdb_txn, txn->env->dbi_time_to_chunk, &chunk_key, chunk);
+}
+
+static int trlmdb_chunk_put(struct trlmdb_txn *txn, MDB_val *time, uint32_t index, MDB_val *chunk)
+{
+	uint8_t buf[TIME_MAX_SIZE + 4];
+	MDB_val chunk_key = encode_chunk_key(buf, time, index);
+	return mdb_put(txn->mdb_txn, txn->env->dbi_time_to_chunk, &chunk_key, chunk, 0);
+}
+
+/* trlmdb_chunks_get assembles a chunked value in memory owned by the transaction */
+static int trlmdb_chunks_get(struct trlmdb_txn *txn, MDB_val *time_val, MDB_val *data)
+{
+	MDB_val chunk;
+	size_t size = 0;
+	uint32_t nchunks = 0;
+	int rc;
+	while ((rc = trlmdb_chunk_get(txn, time_val, nchunks, &chunk)) == 0) {
+		size += chunk.mv_size;
+		nchunks++;
+	}
+	if (rc != MDB_NOTFOUND || nchunks == 0)
+		return rc;
+
+	uint8_t *buf = txn_decode_alloc(txn, size);
+	if (!buf)
+		return ENOMEM;
+
+	size_t offset = 0;
+	for (uint32_t i = 0; i < nchunks; i++) {
+		rc = trlmdb_chunk_get(txn, time_val, i, &chunk);
+		if (rc)
+			return rc;
+		memcpy(buf + offset, chunk.mv_data, chunk.mv_size);
+		offset += chunk.mv_size;
+	}
+
+	data->mv_size = size;
+	data->mv_data = buf;
+	return 0;
+}
+
+/* trlmdb_data_get gets the value for a put time and decompresses or assembles it if necessary */
+static int trlmdb_data_get(struct trlmdb_txn *txn, MDB_val *time_val, MDB_val *data)
+{
+	int rc = mdb_get(txn->mdb_txn, txn->env->dbi_time_to_data, time_val, data);
+	if (rc != MDB_NOTFOUND)
+		return rc;
+
+	MDB_val compressed;
+	rc = mdb_get(txn->mdb_txn, txn->env->dbi_time_to_zdata, time_val, &compressed);
+	if (rc == MDB_NOTFOUND)
+		return trlmdb_chunks_get(txn, time_val, data);
+	if (rc)
+		return rc;
+
+	return value_decompress(txn, &compressed, data);
+}
+
+static int trlmdb_single_get(struct trlmdb_txn *txn, MDB_val *key, MDB_val *data)
+{
+	MDB_val time_val;
+	int rc = key_time_get(txn, key, &time_val);
+	if (rc)
+		return rc;
+
+	if (!time_is_put(&time_val)) return MDB_NOTFOUND;
+
+	return trlmdb_data_get(txn, &time_val, data);
+}
+
+static int trlmdb_single_put_del(struct trlmdb_txn *txn, MDB_val *key, MDB_val *data)
+{
+	int is_put = data != NULL;
+	uint8_t time[TIME_MAX_SIZE];
+	MDB_val time_val = {encode_time(time, txn->time, is_put, env_compact_time(txn->env)), time};
+	
+	time_inc(txn->time);
+
+	int rc;
+	size_t compressed_size;
+	uint8_t *compressed = is_put ? value_compress(txn->env, data, &compressed_size) : NULL;
+	if (compressed) {
+		MDB_val compressed_val = {compressed_size, compressed};
+		rc = trlmdb_insert_time_key_data(txn, &time_val, key, &compressed_val, STORE_ZDATA);
+		free(compressed);
+	} else {
+		rc = trlmdb_insert_time_key_data(txn, &time_val, key, data, STORE_DATA);
+	}
+
+	return rc;
+}
+
+static int trlmdb_single_put(struct trlmdb_txn *txn, MDB_val *key, MDB_val *data)
+{
+	return trlmdb_single_put_del(txn, key, data);
+}
+
+static int trlmdb_single_del(struct trlmdb_txn *txn, MDB_val *key)
+{
+	MDB_val time_val;
+	int rc = key_time_get(txn, key, &time_val);
+	if (rc)
+		return rc;
+
+	if (!time_is_put(&time_val)) return MDB_NOTFOUND;
+
+	return trlmdb_single_put_del(txn, key, NULL);
+}
+
+static int trlmdb_node_put_all_times(struct trlmdb_env *env, MDB_txn *txn, char *node)
+{
+	size_t node_len = strlen(node);
+	MDB_val node_time_data = {2, "ff"};
+	
+	MDB_cursor *cursor;
+	int rc = mdb_cursor_open(txn, env->dbi_time_to_key, &cursor);
+	if (rc)
+		return rc;
+
+	MDB_val time_val, data;
+	while ((rc = mdb_cursor_get(cursor, &time_val, &data, MDB_NEXT)) == 0) {
+		MDB_val node_time_key;
+		rc = encode_node_time(env, node, node_len, &time_val, &node_time_key);
+		if (rc)
+			break;
+
+		MDB_dbi dbi = env->dbi_node_time[node_time_lane(env, txn, &data)];
+		rc = mdb_put(txn, dbi, &node_time_key, &node_time_data, 0);
+		free(node_time_key.mv_data);
+		if (rc)
+			break;
+	}
+
+	mdb_cursor_close(cursor);
+	return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+static int trlmdb_node_add(struct trlmdb_env *env, char *node)
+{
+	MDB_txn *txn;
+	int rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
+	if (rc)
+		return rc;
+
+	/* The replicator reconciles the times of a new node by ranges before it sends time messages */
+	MDB_val node_val = {strlen(node), node};
+	MDB_val data = {1, "s"};
+	rc = mdb_put(txn, env->dbi_nodes, &node_val, &data, MDB_NOOVERWRITE);
+	if (rc) {
+		mdb_txn_commit(txn);
+		return rc == MDB_KEYEXIST ? 0 : rc;
+	}
+
+	rc = trlmdb_node_put_all_times(env, txn, node);
+	if (rc) {
+		mdb_txn_abort(txn);
+		return rc;
+	}
+
+	rc = mdb_txn_commit(txn);
+	return rc;	
+}
+
+static int trlmdb_node_del(struct trlmdb_env *env, char *node)
+{
+	MDB_txn *txn;
+	int rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
+	if (rc)
+		return rc;
+
+	size_t node_len = strlen(node);
+	MDB_val node_val = {node_len, node};
+	rc = mdb_del(txn, env->dbi_nodes, &node_val, NULL);
+	if (rc) {
+		mdb_txn_abort(txn);
+		return rc;
+	}
+
+	for (int lane = 0; lane < NLANES; lane++) {
+		MDB_cursor *cursor;
+		rc = mdb_cursor_open(txn, env->dbi_node_time[lane], &cursor);
+		if (rc) {
+			mdb_txn_abort(txn);
+			return rc;
+		}
+
+		MDB_val node_time_val = {node_len, node};
+		MDB_val data, time_val;
+		rc = mdb_cursor_get(cursor, &node_time_val, &data, MDB_SET_RANGE);
+		for (;;) {
+			if (rc)
+				break;
+
+			if (node_time_split(env, &node_time_val, node, node_len, &time_val))
+				mdb_cursor_del(cursor, 0);
+
+			rc = mdb_cursor_get(cursor, &node_time_val, &data, MDB_NEXT);
+		}
+		mdb_cursor_close(cursor);
+	}
+
+	return mdb_txn_commit(txn);
+}
+
+/* trlmdb_node_sync_pending returns 1 if the times of node have not been reconciled by ranges yet */
+static int trlmdb_node_sync_pending(struct trlmdb_env *env, char *node)
+{
+	MDB_txn *txn;
+	if (mdb_txn_begin(env->mdb_env, NULL, MDB_RDONLY, &txn))
+		return 0;
+
+	MDB_val key = {strlen(node), node};
+	MDB_val data;
+	int pending = mdb_get(txn, env->dbi_nodes, &key, &data) == 0 && data.mv_size == 1 && *(char*) data.mv_data == 's';
+
+	mdb_txn_abort(txn);
+	return pending;
+}
+
+static int trlmdb_node_sync_done(struct trlmdb_txn *txn, char *node)
+{
+	MDB_val key = {strlen(node), node};
+	MDB_val data = {0, ""};
+	return mdb_put(txn->mdb_txn, txn->env->dbi_nodes, &key, &data, 0);
+}
+
+/* trlmdb_node_time_del_range removes the node-times of node with times from lo to hi, excluding hi.
+ * An empty lo or hi means no bound.
+ */
+static int trlmdb_node_time_del_range(struct trlmdb_txn *txn, char *node, MDB_val *lo, MDB_val *hi)
+{
+	struct trlmdb_env *env = txn->env;
+	size_t node_len = strlen(node);
+
+	MDB_val node_time;
+	int rc = encode_node_time(env, node, node_len, lo, &node_time);
+	if (rc)
+		return rc;
+
+	for (int lane = 0; lane < NLANES; lane++) {
+		MDB_cursor *cursor;
+		rc = mdb_cursor_open(txn->mdb_txn, env->dbi_node_time[lane], &cursor);
+		if (rc)
+			break;
+
+		MDB_val key = node_time;
+		MDB_val data, time_val;
+		rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+		while (rc == 0 && key.mv_size >= node_len && memcmp(key.mv_data, node, node_len) == 0) {
+			/* Node names that extend node are skipped */
+			if (node_time_split(env, &key, node, node_len, &time_val)) {
+				if (hi->mv_size > 0 && time_cmp(&time_val, hi) >= 0)
+					break;
+				rc = mdb_cursor_del(cursor, 0);
+			}
+			if (!rc)
+				rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+		}
+
+		mdb_cursor_close(cursor);
+		if (rc == MDB_NOTFOUND)
+			rc = 0;
+		if (rc)
+			break;
+	}
+
+	free(node_time.mv_data);
+	return rc;
+}
+
+/* trlmdb_node_sync_restart marks node for range reconciliation again. The node has a snapshot of the
+ * database, and the reconciliation removes the node-times of the times that both nodes have.
+ */
+static int trlmdb_node_sync_restart(struct trlmdb_env *env, char *node)
+{
+	MDB_txn *txn;
+	int rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
+	if (rc)
+		return rc;
+
+	MDB_val key = {strlen(node), node};
+	MDB_val data = {1, "s"};
+	rc = mdb_put(txn, env->dbi_nodes, &key, &data, 0);
+	if (rc) {
+		mdb_txn_abort(txn);
+		return rc;
+	}
+	return mdb_txn_commit(txn);
+}
+
+/* trlmdb_nodes_clear removes all nodes and node-times. A database copied from another node contains
+ * the nodes of that node.
+ */
+static int trlmdb_nodes_clear(struct trlmdb_env *env)
+{
+	MDB_txn *txn;
+	int rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
+	if (rc)
+		return rc;
+
+	rc = mdb_drop(txn, env->dbi_nodes, 0);
+	for (int lane = 0; lane < NLANES && !rc; lane++) {
+		rc = mdb_drop(txn, env->dbi_node_time[lane], 0);
+	}
+	if (rc) {
+		mdb_txn_abort(txn);
+		return rc;
+	}
+	return mdb_txn_commit(txn);
+}
+
+static int trlmdb_node_time_update(struct trlmdb_txn *txn, char *node, MDB_val *time, uint8_t* flag)
+{
+	MDB_val node_time_key;
+	int rc = encode_node_time(txn->env, node, strlen(node), time, &node_time_key);
+	if (rc)
+		return rc;
+
+	if (memcmp(flag, "tt", 2) == 0) {
+		rc = node_time_del(txn->env, txn->mdb_txn, &node_time_key);
+	} else {
+		/* The node-time stays in its lane */
+		MDB_dbi dbi = txn->env->dbi_node_time[LANE_NORMAL];
+		MDB_val data;
+		if (mdb_get(txn->mdb_txn, txn->env->dbi_node_time[LANE_HIGH], &node_time_key, &data) == 0)
+			dbi = txn->env->dbi_node_time[LANE_HIGH];
+		MDB_val node_time_data = {2, flag}; 
+		rc = mdb_put(txn->mdb_txn, dbi, &node_time_key, &node_time_data, 0);
+	}
+
+	free(node_time_key.mv_data);
+	return rc;
+}
+
+/* returns 1 if node exists, 0 if the node does not exist, and -1 for an error */
+static int trlmdb_node_exists(struct trlmdb_env *env, char *node)
+{
+	MDB_val key = {strlen(node), node};
+	MDB_val data = {0, ""};
+
+	MDB_txn *txn;
+	int rc = mdb_txn_begin(env->mdb_env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+		return -1;
+
+	rc = mdb_get(txn, env->dbi_nodes, &key, &data);
+
+	mdb_txn_commit(txn);
+
+	return rc == MDB_NOTFOUND ? 0 : 1;
+}
+
+static int trlmdb_get_key_for_time(struct trlmdb_txn *txn, MDB_val *time, MDB_val *key)
+{
+	return mdb_get(txn->mdb_txn, txn->env->dbi_time_to_key, time, key);
+}
+
+/* table_key encoding
+ *
+ * An extended key is the table name, a null byte and the key. In an environment with the flag
+ * TRLMDB_TABLE_IDS, the table name and null byte are replaced by a 4 byte table id, which is a hash
+ * of the table name. The ids are recorded in a catalog, which is stored as ordinary data in the
+ * reserved table id 0 with the table ids as keys and the table names as values. The catalog is
+ * replicated like all other data. Since the ids are computed from the names, nodes agree on the
+ * ids without any coordination. Two table names with the same id can not be used in the same
+ * database.
+ */
+
+#define CATALOG_ID 0
+
+static uint32_t table_id(const char *table, size_t table_len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < table_len; i++) {
+		h ^= (uint8_t) table[i];
+		h *= 16777619u;
+	}
+	return h == CATALOG_ID ? 1 : h;
+}
+
+/* table_prefix_len returns the length of the table part of an extended key, or 0 if the extended key is malformed */
+static size_t table_prefix_len(struct trlmdb_env *env, MDB_val *table_key)
+{
+	if (env->flags & TRLMDB_TABLE_IDS)
+		return table_key->mv_size >= 4 ? 4 : 0;
+
+	size_t table_len = strnlen(table_key->mv_data, table_key->mv_size);
+	return table_len == table_key->mv_size ? 0 : table_len + 1;
+}
+
+static MDB_val *encode_table_key(struct trlmdb_env *env, char *table, MDB_val *key)
+{
+	size_t table_len = strlen(table);
+	size_t prefix_len = env->flags & TRLMDB_TABLE_IDS ? 4 : table_len + 1;
+
+	MDB_val *table_key = malloc(sizeof *table_key);
+	if (!table_key)
+		return NULL;
+
+	table_key->mv_size = prefix_len + key->mv_size;
+	table_key->mv_data = malloc(table_key->mv_size);
+	if (!table_key->mv_data) {
+		free(table_key);
+		return NULL;
+	}
+
+	if (env->flags & TRLMDB_TABLE_IDS) {
+		encode_uint32(table_key->mv_data, table_id(table, table_len));
+	} else {
+		memcpy(table_key->mv_data, table, table_len);
+		memset((uint8_t*)table_key->mv_data + table_len, 0, 1);
+	}
+	memcpy((uint8_t*)table_key->mv_data + prefix_len, key->mv_data, key->mv_size);
+
+	return table_key;
+}
+
+static void free_table_key(MDB_val *table_key)
+{
+	free(table_key->mv_data);
+	free(table_key);
+}
+
+/* trlmdb_tables_priority_set makes the tables the ones with priority. The node-times of later
+ * inserts go to the lane of their table.
+ */
+static int trlmdb_tables_priority_set(struct trlmdb_env *env, char **tables, int ntables)
+{
+	MDB_txn *txn;
+	int rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
+	if (rc)
+		return rc;
+
+	rc = mdb_drop(txn, env->dbi_table_priority, 0);
+	for (int i = 0; i < ntables && !rc; i++) {
+		MDB_val empty = {0, ""};
+		MDB_val *prefix = encode_table_key(env, tables[i], &empty);
+		if (!prefix) {
+			rc = ENOMEM;
+			break;
+		}
+		MDB_val data = {0, ""};
+		rc = mdb_put(txn, env->dbi_table_priority, prefix, &data, 0);
+		free_table_key(prefix);
+	}
+
+	if (rc) {
+		mdb_txn_abort(txn);
+		return rc;
+	}
+	return mdb_txn_commit(txn);
+}
+
+static int remove_table_prefix(struct trlmdb_env *env, MDB_val *table_key, MDB_val *key)
+{
+	size_t prefix_len = table_prefix_len(env, table_key);
+	if (prefix_len == 0)
+		return EINVAL;
+	
+	key->mv_size = table_key->mv_size - prefix_len;
+	key->mv_data = (uint8_t*)table_key->mv_data + prefix_len;
+
+	return 0;
+}
+
+static int trlmdb_catalog_get(struct trlmdb_txn *txn, uint32_t id, MDB_val *table)
+{
+	uint8_t catalog_key[8];
+	encode_uint32(catalog_key, CATALOG_ID);
+	encode_uint32(catalog_key + 4, id);
+	MDB_val key = {8, catalog_key};
+
+	return trlmdb_single_get(txn, &key, table);
+}
+
+/* trlmdb_catalog_ensure makes sure that the catalog maps the id of the table to the table name.
+ * It returns EEXIST if another table name has the same id.
+ */
+static int trlmdb_catalog_ensure(struct trlmdb_txn *txn, const char *table, size_t table_len)
+{
+	uint32_t id = table_id(table, table_len);
+
+	int match = txn_table_lookup(txn, id, table, table_len);
+	if (match != -1)
+		return match ? 0 : EEXIST;
+
+	MDB_val name;
+	int rc = trlmdb_catalog_get(txn, id, &name);
+	if (rc == 0 && (name.mv_size != table_len || memcmp(name.mv_data, table, table_len) != 0))
+		return EEXIST;
+
+	if (rc == MDB_NOTFOUND) {
+		uint8_t catalog_key[8];
+		encode_uint32(catalog_key, CATALOG_ID);
+		encode_uint32(catalog_key + 4, id);
+		MDB_val key = {8, catalog_key};
+		MDB_val name_val = {table_len, (char*) table};
+		rc = trlmdb_single_put(txn, &key, &name_val);
+	}
+	if (rc)
+		return rc;
+
+	return txn_table_add(txn, id, table, table_len);
+}
+
+/* catalog_row_check returns EEXIST if a catalog row from a remote node gives the id of a table in the
+ * catalog to another table name, and EINVAL if the id is not the id of the name. Keys that are not
+ * catalog keys are accepted.
+ */
+static int catalog_row_check(struct trlmdb_txn *txn, MDB_val *key, MDB_val *data, int storage)
+{
+	if (key->mv_size != 8 || decode_uint32(key->mv_data) != CATALOG_ID)
+		return 0;
+
+	MDB_val name = *data;
+	if (storage == STORE_ZDATA) {
+		int rc = value_decompress(txn, data, &name);
+		if (rc)
+			return rc;
+	} else if (storage == STORE_CHUNKS) {
+		return EINVAL;
+	}
+
+	uint32_t id = decode_uint32((uint8_t*) key->mv_data + 4);
+	if (table_id(name.mv_data, name.mv_size) != id)
+		return EINVAL;
+
+	int match = txn_table_lookup(txn, id, name.mv_data, name.mv_size);
+	if (match != -1)
+		return match ? 0 : EEXIST;
+
+	MDB_val existing;
+	int rc = trlmdb_catalog_get(txn, id, &existing);
+	if (rc == MDB_NOTFOUND)
+		return 0;
+	if (rc)
+		return rc;
+	if (existing.mv_size != name.mv_size || memcmp(existing.mv_data, name.mv_data, name.mv_size) != 0)
+		return EEXIST;
+	return 0;
+}
+
+/* table_key_from_name_key converts an extended key with a table name to one with a table id.
+ * The table is added to the catalog if necessary.
+ */
+static int table_key_from_name_key(struct trlmdb_txn *txn, MDB_val *name_key, MDB_val **id_key)
+{
+	size_t table_len = strnlen(name_key->mv_data, name_key->mv_size);
+	if (table_len == name_key->mv_size)
+		return EINVAL;
+
+	int rc = trlmdb_catalog_ensure(txn, name_key->mv_data, table_len);
+	if (rc)
+		return rc;
+
+	*id_key = malloc(sizeof **id_key);
+	if (!*id_key)
+		return ENOMEM;
+
+	(*id_key)->mv_size = 4 + name_key->mv_size - table_len - 1;
+	(*id_key)->mv_data = malloc((*id_key)->mv_size);
+	if (!(*id_key)->mv_data) {
+		free(*id_key);
+		return ENOMEM;
+	}
+
+	encode_uint32((*id_key)->mv_data, table_id(name_key->mv_data, table_len));
+	memcpy((uint8_t*)(*id_key)->mv_data + 4, (uint8_t*)name_key->mv_data + table_len + 1, (*id_key)->mv_size - 4);
+
+	return 0;
+}
+
+/* table_key_to_name_key converts an extended key with a table id to one with a table name.
+ * It returns MDB_NOTFOUND for catalog keys, which only make sense with table ids, and EAGAIN if the
+ * table is not in the catalog yet.
+ */
+static int table_key_to_name_key(struct trlmdb_txn *txn, MDB_val *id_key, MDB_val **name_key)
+{
+	if (id_key->mv_size < 4)
+		return EINVAL;
+
+	uint32_t id = decode_uint32(id_key->mv_data);
+	if (id == CATALOG_ID)
+		return MDB_NOTFOUND;
+
+	MDB_val table;
+	int rc = trlmdb_catalog_get(txn, id, &table);
+	if (rc == MDB_NOTFOUND)
+		return EAGAIN;
+	if (rc)
+		return rc;
+
+	*name_key = malloc(sizeof **name_key);
+	if (!*name_key)
+		return ENOMEM;
+
+	(*name_key)->mv_size = table.mv_size + 1 + id_key->mv_size - 4;
+	(*name_key)->mv_data = malloc((*name_key)->mv_size);
+	if (!(*name_key)->mv_data) {
+		free(*name_key);
+		return ENOMEM;
+	}
+
+	memcpy((*name_key)->mv_data, table.mv_data, table.mv_size);
+	memset((uint8_t*)(*name_key)->mv_data + table.mv_size, 0, 1);
+	memcpy((uint8_t*)(*name_key)->mv_data + table.mv_size + 1, (uint8_t*)id_key->mv_data + 4, id_key->mv_size - 4);
+
+	return 0;
+}
+
+/* public functions for accessing the database */
+
+/* trlmdb_get looks up the key in the table.
+ * The table name must be null terminated.
+ * The return value is
+ * 0 at success and value will contain the result.
+ * MDB_NOTFOUND if the key was absent.
+ * ENOMEM if the operation failed due to memory allocation failure.
+ */
+
+int trlmdb_get(struct trlmdb_txn *txn, char *table, MDB_val *key, MDB_val *value)
+{
+	MDB_val *table_key = encode_table_key(txn->env, table, key);
+	if (!table_key)
+		return ENOMEM;
+
+        int rc = trlmdb_single_get(txn, table_key, value);
+	free_table_key(table_key);
+
+	return rc;
+}
+
+int trlmdb_put(struct trlmdb_txn *txn, char *table, MDB_val *key, MDB_val *value)
+{
+	if (txn->env->flags & TRLMDB_TABLE_IDS) {
+		int rc = trlmdb_catalog_ensure(txn, table, strlen(table));
+		if (rc)
+			return rc;
+	}
+
+	MDB_val *table_key = encode_table_key(txn->env, table, key);
+	if (!table_key)
+		return ENOMEM;
+
+        int rc = trlmdb_single_put(txn, table_key, value);
+	free_table_key(table_key);
+
+	return rc;
+}
+
+int trlmdb_del(struct trlmdb_txn *txn, char *table, MDB_val *key)
+{
+	MDB_val *table_key = encode_table_key(txn->env, table, key);
+	if (!table_key)
+		return ENOMEM;
+
+        int rc = trlmdb_single_del(txn, table_key);
+	free_table_key(table_key);
+
+	return rc;
+}
+
+int trlmdb_cursor_open(struct trlmdb_txn *txn, char *table, struct trlmdb_cursor **cursor)
+{
+	*cursor = malloc(sizeof **cursor);
+	if (!*cursor) return ENOMEM; 
+
+	MDB_val empty_key = {0, ""};
+	(*cursor)->txn = txn;
+	(*cursor)->prefix = encode_table_key(txn->env, table, &empty_key);
+	if (!(*cursor)->prefix) {
+		free(*cursor);
+		return ENOMEM;
+	}
+
+	/* A table database only contains the keys of the table */
+	MDB_dbi dbi = txn->env->dbi_key_to_time;
+	(*cursor)->mdb_cursor = NULL;
+	int rc = 0;
+	if (txn->env->flags & TRLMDB_TABLE_DBIS) {
+		rc = txn_table_dbi(txn, (*cursor)->prefix, 0, &dbi);
+		(*cursor)->prefix->mv_size = 0;
+	}
+
+	if (!rc)
+		rc = mdb_cursor_open(txn->mdb_txn, dbi, &((*cursor)->mdb_cursor));
+	if (rc == MDB_NOTFOUND)
+		rc = 0;
+	if (rc) {
+		free_table_key((*cursor)->prefix);
+		free(*cursor);
+	}
+	return rc;
+}
+
+void trlmdb_cursor_close(struct trlmdb_cursor *cursor){
+	if (cursor->mdb_cursor)
+		mdb_cursor_close(cursor->mdb_cursor);
+	free_table_key(cursor->prefix);
+	free(cursor);
+}
+
+static int cursor_in_table(struct trlmdb_cursor *cursor, MDB_val *key)
+{
+	MDB_val *prefix = cursor->prefix;
+	return key->mv_size >= prefix->mv_size && memcmp(prefix->mv_data, key->mv_data, prefix->mv_size) == 0;
+}
+
+int trlmdb_cursor_first(struct trlmdb_cursor *cursor)
+{
+	if (!cursor->mdb_cursor)
+		return MDB_NOTFOUND;
+
+	MDB_val key = *cursor->prefix;
+	MDB_val time_val;
+	
+	int rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_SET_RANGE);
+	while (!rc && !time_is_put(&time_val)) {
+		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_NEXT);
+	}
+		
+	if (rc)
+		return rc;
+
+	if (!cursor_in_table(cursor, &key))
+		return MDB_NOTFOUND;
+
+	return 0;
+}
+
+int trlmdb_cursor_last(struct trlmdb_cursor *cursor)
+{
+	if (!cursor->mdb_cursor)
+		return MDB_NOTFOUND;
+
+	size_t prefix_len = cursor->prefix->mv_size;
+	uint8_t *table_successor = malloc(prefix_len + 1);
+	if (!table_successor)
+		return ENOMEM;
+
+	/* The smallest extended key after the table is the prefix plus one */
+	memcpy(table_successor, cursor->prefix->mv_data, prefix_len);
+	size_t i = prefix_len;
+	while (i > 0 && ++table_successor[i - 1] == 0) i--;
+
+	MDB_val key = {prefix_len, table_successor};
+	MDB_val time_val;
+	
+	int rc = i == 0 ? MDB_NOTFOUND : mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_SET_RANGE);
+	free(table_successor);
+	if (rc) {
+		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_LAST);
+		if (rc)
+			return rc;
+	} else {
+		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_PREV);
+		if (rc)
+			return rc;
+	}
+		
+	while (!rc && !time_is_put(&time_val)) {
+		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_PREV);
+	}
+		
+	if (rc)
+		return rc;
+
+	if (!cursor_in_table(cursor, &key))
+		return MDB_NOTFOUND;
+
+	return 0;
+}
+
+int trlmdb_cursor_next(struct trlmdb_cursor *cursor)
+{
+	if (!cursor->mdb_cursor)
+		return MDB_NOTFOUND;
+
+	MDB_val key;
+	MDB_val time_val;
+
+	int rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_NEXT);
+	while (!rc && !time_is_put(&time_val)) {
+		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_NEXT);
+	}
+		
+	if (rc)
+		return rc;
+
+	if (!cursor_in_table(cursor, &key))
+		return MDB_NOTFOUND;
+
+	return 0;
+}
+
+int trlmdb_cursor_prev(struct trlmdb_cursor *cursor)
+{
+	if (!cursor->mdb_cursor)
+		return MDB_NOTFOUND;
+
+	MDB_val key;
+	MDB_val time_val;
+
+	int rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_PREV);
+	while (!rc && !time_is_put(&time_val)) {
+		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_PREV);
+	}
+		
+	if (rc)
+		return rc;
+
+	if (!cursor_in_table(cursor, &key))
+		return MDB_NOTFOUND;
+
+	return 0;
+}
+
+int trlmdb_cursor_get(struct trlmdb_cursor *cursor, MDB_val *key, MDB_val *val)
+{
+	if (!cursor->mdb_cursor)
+		return MDB_NOTFOUND;
+
+	MDB_val table_key, time_val;
+	int rc = mdb_cursor_get(cursor->mdb_cursor, &table_key, &time_val, MDB_GET_CURRENT);
+	if (rc || !time_is_put(&time_val))
+		return MDB_NOTFOUND;
+
+	if (cursor->prefix->mv_size == 0) {
+		*key = table_key;
+	} else {
+		rc = remove_table_prefix(cursor->txn->env, &table_key, key);
+		if (rc)
+			return rc;
+	}
+	
+	return trlmdb_data_get(cursor->txn, &time_val, val);
+}
+
+int trlmdb_blob_put(struct trlmdb_txn *txn, char *table, MDB_val *key, struct trlmdb_blob **blob)
+{
+	if (txn->env->flags & TRLMDB_TABLE_IDS) {
+		int rc = trlmdb_catalog_ensure(txn, table, strlen(table));
+		if (rc)
+			return rc;
+	}
+
+	*blob = malloc(sizeof **blob);
+	if (!*blob)
+		return ENOMEM;
+
+	**blob = (struct trlmdb_blob) {0};
+	(*blob)->txn = txn;
+	(*blob)->table_key = encode_table_key(txn->env, table, key);
+	(*blob)->buf = malloc(CHUNK_SIZE);
+	if (!(*blob)->table_key || !(*blob)->buf) {
+		if ((*blob)->table_key)
+			free_table_key((*blob)->table_key);
+		free((*blob)->buf);
+		free(*blob);
+		return ENOMEM;
+	}
+
+	(*blob)->time_size = encode_time((*blob)->time, txn->time, 1, env_compact_time(txn->env));
+	time_inc(txn->time);
+	(*blob)->chunked = 1;
+
+	return 0;
+}
+
+static int blob_flush(struct trlmdb_blob *blob)
+{
+	MDB_val time_val = {blob->time_size, blob->time};
+	MDB_val chunk = {blob->buf_size, blob->buf};
+	int rc = trlmdb_chunk_put(blob->txn, &time_val, blob->index, &chunk);
+	if (rc)
+		return rc;
+
+	blob->index++;
+	blob->buf_size = 0;
+	return 0;
+}
+
+int trlmdb_blob_write(struct trlmdb_blob *blob, const void *data, size_t size)
+{
+	if (!blob->table_key)
+		return EINVAL;
+
+	const uint8_t *src = data;
+	while (size > 0) {
+		size_t n = CHUNK_SIZE - blob->buf_size;
+		if (n > size)
+			n = size;
+		memcpy(blob->buf + blob->buf_size, src, n);
+		blob->buf_size += n;
+		src += n;
+		size -= n;
+
+		if (blob->buf_size == CHUNK_SIZE) {
+			int rc = blob_flush(blob);
+			if (rc)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+int trlmdb_blob_open(struct trlmdb_txn *txn, char *table, MDB_val *key, struct trlmdb_blob **blob)
+{
+	MDB_val *table_key = encode_table_key(txn->env, table, key);
+	if (!table_key)
+		return ENOMEM;
+
+	MDB_val time_val;
+	int rc = key_time_get(txn, table_key, &time_val);
+	free_table_key(table_key);
+	if (rc)
+		return rc;
+
+	if (!time_is_put(&time_val))
+		return MDB_NOTFOUND;
+
+	*blob = malloc(sizeof **blob);
+	if (!*blob)
+		return ENOMEM;
+
+	**blob = (struct trlmdb_blob) {0};
+	(*blob)->txn = txn;
+	memcpy((*blob)->time, time_val.mv_data, time_val.mv_size);
+	(*blob)->time_size = time_val.mv_size;
+
+	MDB_val chunk;
+	rc = trlmdb_chunk_get(txn, &time_val, 0, &chunk);
+	if (rc == MDB_NOTFOUND) {
+		rc = trlmdb_data_get(txn, &time_val, &(*blob)->value);
+	} else if (rc == 0) {
+		(*blob)->chunked = 1;
+	}
+
+	if (rc) {
+		free(*blob);
+		return rc;
+	}
+
+	return 0;
+}
+
+int trlmdb_blob_read(struct trlmdb_blob *blob, MDB_val *chunk)
+{
+	if (blob->table_key)
+		return EINVAL;
+
+	if (!blob->chunked) {
+		if (blob->index > 0)
+			return MDB_NOTFOUND;
+		blob->index++;
+		*chunk = blob->value;
+		return 0;
+	}
+
+	MDB_val time_val = {blob->time_size, blob->time};
+	int rc = trlmdb_chunk_get(blob->txn, &time_val, blob->index, chunk);
+	if (!rc)
+		blob->index++;
+	return rc;
+}
+
+int trlmdb_blob_close(struct trlmdb_blob *blob)
+{
+	int rc = 0;
+
+	if (blob->table_key) {
+		/* An empty blob has one empty chunk */
+		if (blob->buf_size > 0 || blob->index == 0)
+			rc = blob_flush(blob);
+
+		if (!rc) {
+			MDB_val time_val = {blob->time_size, blob->time};
+			rc = trlmdb_insert_time_key_data(blob->txn, &time_val, blob->table_key, NULL, STORE_CHUNKS);
+		}
+		free_table_key(blob->table_key);
+		free(blob->buf);
+	}
+
+	free(blob);
+	return rc;
+}
+
+/* time message */
+
+/* read_time_msg reads the msg, verifies that it is a time msg, and inserts the information in the database.
+ * caps are the capabilities used by the remote node. A third flag byte 'z' means that the value is
+ * compressed with a codec in caps. A third flag byte 'c' means that the value was sent in chunk
+ * messages, and the value field is the number of chunks. The time is compact if caps contains
+ * CAP_COMPACT_TIME. If caps contains CAP_ACKS, a time that the remote node knows is removed from
+ * db_node_time instead of being answered with "tt".
+ */
+static int read_time_msg(struct trlmdb_txn *txn, char *remote_node, unsigned int caps, struct message *msg)
+{
+	struct msg_fields fields;
+	if (msg_parse(msg, &fields))
+		return EINVAL;
+
+	uint64_t count = fields.count;
+	if (count < 3 || count > 5 || !msg_fields_type(&fields, "time"))
+		return EINVAL;
+
+	uint8_t *flag = fields.data[1];
+	uint64_t size = fields.size[1];
+	if ((size != 2 && size != 3) || (flag[0] != 't' && flag[0] != 'f') || (flag[1] != 't' && flag[1] != 'f'))
+		return EINVAL;
+
+	int storage = STORE_DATA;
+	if (size == 3) {
+		if (flag[2] == 'z') {
+			storage = STORE_ZDATA;
+		} else if (flag[2] == 'c' && (caps & CAP_CHUNKS)) {
+			storage = STORE_CHUNKS;
+		} else {
+			return EINVAL;
+		}
+	}
+	
+	uint8_t time[TIME_MAX_SIZE];
+	MDB_val time_val = {time_convert(time, fields.data[2], fields.size[2], (caps & CAP_COMPACT_TIME) != 0, env_compact_time(txn->env)), time};
+	if (time_val.mv_size == 0)
+		return EINVAL;
+
+	int is_put = time_is_put(&time_val);
+	
+	MDB_val key;
+	int key_absent = trlmdb_get_key_for_time(txn, &time_val, &key);
+	
+	if (key_absent) {
+		if (count < 4)
+			return EINVAL;
+
+		MDB_val key_val = {fields.size[3], fields.data[3]};
+
+		MDB_val data_val = {0, NULL};
+		if (is_put && count == 5) {
+			data_val = (MDB_val) {fields.size[4], fields.data[4]};
+			if (storage == STORE_ZDATA) {
+				const struct codec *codec = value_codec(&data_val);
+				if (!codec || !(codec->cap & caps))
+					return EINVAL;
+			} else if (storage == STORE_CHUNKS) {
+				if (data_val.mv_size != 4)
+					return EINVAL;
+				uint32_t nchunks = decode_uint32(data_val.mv_data);
+				MDB_val chunk;
+				for (uint32_t i = 0; i < nchunks; i++) {
+					if (trlmdb_chunk_get(txn, &time_val, i, &chunk))
+						return EINVAL;
+				}
+				if (nchunks == 0)
+					return EINVAL;
+			}
+		}
+
+		/* The remote node uses table names in its extended keys */
+		MDB_val *id_key = NULL;
+		if ((txn->env->flags & TRLMDB_TABLE_IDS) && !(caps & CAP_TABLE_IDS)) {
+			int rc = table_key_from_name_key(txn, &key_val, &id_key);
+			if (rc)
+				return rc;
+			key_val = *id_key;
+		}
+
+		/* Two tables created on different nodes may have the same id */
+		if ((txn->env->flags & TRLMDB_TABLE_IDS) && (caps & CAP_TABLE_IDS) && data_val.mv_data) {
+			int rc = catalog_row_check(txn, &key_val, &data_val, storage);
+			if (rc)
+				return rc;
+		}
+
+		int rc;
+		if (data_val.mv_data) {
+			rc = trlmdb_insert_time_key_data(txn, &time_val, &key_val, &data_val, storage);
+		} else {
+			rc = trlmdb_insert_time_key_data(txn, &time_val, &key_val, NULL, STORE_DATA);
+		}
+
+		if (id_key)
+			free_table_key(id_key);
+		if (rc)
+			return rc;
+	}
+
+	/* The remote node learns from the next ack that the time is known here */
+	if ((caps & CAP_ACKS) && flag[0] == 't')
+		flag = (uint8_t*) "tt";
+	
+	int rc = trlmdb_node_time_update(txn, remote_node, &time_val, flag);
+	return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+/* chunk message
+ *
+ * chunk-message = "chnk" time index(4) chunk
+ *
+ * The chunks of a value are sent before the time message.
+ */
+
+static int read_chunk_msg(struct trlmdb_txn *txn, unsigned int caps, struct message *msg)
+{
+	struct msg_fields fields;
+	if (msg_parse(msg, &fields) || fields.count != 4 || !(caps & CAP_CHUNKS) || !msg_fields_type(&fields, "chnk"))
+		return EINVAL;
+
+	uint8_t time[TIME_MAX_SIZE];
+	MDB_val time_val = {time_convert(time, fields.data[1], fields.size[1], (caps & CAP_COMPACT_TIME) != 0, env_compact_time(txn->env)), time};
+	if (time_val.mv_size == 0 || !time_is_put(&time_val))
+		return EINVAL;
+
+	if (fields.size[2] != 4)
+		return EINVAL;
+	uint32_t index = decode_uint32(fields.data[2]);
+
+	MDB_val key;
+	if (trlmdb_get_key_for_time(txn, &time_val, &key) == 0)
+		return 0;
+
+	MDB_val chunk = {fields.size[3], fields.data[3]};
+	return trlmdb_chunk_put(txn, &time_val, index, &chunk);
+}
+
+/* map_value looks up a value of at least MAP_SEND_MIN bytes in map_txn. The value stays in the memory
+ * map while map_txn is active, so it can be written without a copy. The snapshot of map_txn may be
+ * older than the time, and MDB_NOTFOUND means that the value is copied.
+ */
+static int map_value(MDB_txn *map_txn, MDB_dbi dbi, MDB_val *key, MDB_val *value, MDB_val *mapped)
+{
+	if (!map_txn || value->mv_size < MAP_SEND_MIN)
+		return MDB_NOTFOUND;
+
+	int rc = mdb_get(map_txn, dbi, key, mapped);
+	if (rc == 0 && mapped->mv_size != value->mv_size)
+		rc = MDB_NOTFOUND;
+	return rc;
+}
+
+static int load_chunk_msg(struct message *msg, uint8_t *msg_time, size_t msg_time_size, uint32_t index, MDB_val *chunk, int mapped)
+{
+	uint8_t index_buf[4];
+	encode_uint32(index_buf, index);
+
+	msg_reset(msg);
+	int rc = msg_append(msg, (uint8_t*) "chnk", 4);
+	if (!rc)
+		rc = msg_append(msg, msg_time, msg_time_size);
+	if (!rc)
+		rc = msg_append(msg, index_buf, 4);
+	if (!rc && mapped)
+		rc = msg_append_ext(msg, chunk->mv_data, chunk->mv_size);
+	else if (!rc)
+		rc = msg_append(msg, chunk->mv_data, chunk->mv_size);
+	return rc;
+}
+
+static int key_list_add(struct key_list *list, MDB_val *key)
+{
+	size_t new_size = list->size + 8 + key->mv_size;
+	if (new_size > list->cap) {
+		size_t cap = list->cap ? 2 * list->cap : 4096;
+		while (cap < new_size)
+			cap *= 2;
+		uint8_t *realloced = realloc(list->buf, cap);
+		if (!realloced)
+			return ENOMEM;
+		list->buf = realloced;
+		list->cap = cap;
+	}
+
+	encode_uint64(list->buf + list->size, key->mv_size);
+	memcpy(list->buf + list->size + 8, key->mv_data, key->mv_size);
+	list->size = new_size;
+	list->count++;
+	return 0;
+}
+
+/* node_time_del_keys deletes the node-times in list in txn */
+static int node_time_del_keys(struct trlmdb_env *env, MDB_txn *txn, struct key_list *list)
+{
+	int rc = 0;
+	for (size_t offset = 0; offset < list->size && !rc;) {
+		MDB_val key = {decode_uint64(list->buf + offset), list->buf + offset + 8};
+		rc = node_time_del(env, txn, &key);
+		if (rc == MDB_NOTFOUND)
+			rc = 0;
+		offset += 8 + key.mv_size;
+	}
+	return rc;
+}
+
+/* node_time_del_list deletes the node-times in list in one write txn and empties the list */
+static int node_time_del_list(struct trlmdb_env *env, struct key_list *list)
+{
+	if (list->count == 0)
+		return 0;
+
+	MDB_txn *txn;
+	int rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
+	if (rc)
+		return rc;
+
+	rc = node_time_del_keys(env, txn, list);
+	if (rc) {
+		mdb_txn_abort(txn);
+		return rc;
+	}
+	rc = mdb_txn_commit(txn);
+	if (!rc) {
+		list->size = 0;
+		list->count = 0;
+	}
+	return rc;
+}
+
+/* send cache
+ *
+ * With several remote nodes, the connections send the same time messages. A connection that has loaded
+ * a time message with a key, and the value if any, puts the message in the wire format of the
+ * connection into the send cache. The other connections with the same capabilities copy the message
+ * from the cache instead of looking up the key and value and encoding them again. The cache has
+ * SEND_CACHE_SLOTS slots, which are chosen by a hash of the time and capabilities, and a newer message
+ * replaces the message in its slot. The entries are counted, so an entry that is replaced while it is
+ * copied is freed by the last connection that releases it. Messages from the memory map, chunked
+ * messages and messages larger than SEND_CACHE_RECORD_MAX are not cached, and the entries take at
+ * most SEND_CACHE_MAX_BYTES.
+ */
+
+struct send_entry {
+	int refs;
+	unsigned int caps;
+	uint8_t time[TIME_MAX_SIZE];
+	size_t time_size;
+	uint64_t size;
+	uint8_t buf[];
+};
+
+struct send_cache {
+	pthread_mutex_t mutex;
+	uint64_t bytes;
+	struct send_entry *slots[SEND_CACHE_SLOTS];
+};
+
+static struct send_cache *send_cache_create(void)
+{
+	struct send_cache *cache = tr_malloc(sizeof *cache);
+	pthread_mutex_init(&cache->mutex, NULL);
+	cache->bytes = 0;
+	for (int i = 0; i < SEND_CACHE_SLOTS; i++) {
+		cache->slots[i] = NULL;
+	}
+	return cache;
+}
+
+static struct send_entry **send_cache_slot(struct send_cache *cache, MDB_val *time, unsigned int caps)
+{
+	uint64_t hash = 14695981039346656037ULL ^ caps;
+	uint8_t *buf = time->mv_data;
+	for (size_t i = 0; i < time->mv_size; i++) {
+		hash ^= buf[i];
+		hash *= 1099511628211ULL;
+	}
+	return cache->slots + hash % SEND_CACHE_SLOTS;
+}
+
+/* send_entry_release drops a reference to entry. The cache mutex is held. */
+static void send_entry_release(struct send_cache *cache, struct send_entry *entry)
+{
+	if (--entry->refs > 0)
+		return;
+	cache->bytes -= entry->size;
+	free(entry);
+}
+
+/* send_cache_get copies the cached message of time for caps into msg. It returns MDB_NOTFOUND if the
+ * message is not cached.
+ */
+static int send_cache_get(struct send_cache *cache, MDB_val *time, unsigned int caps, struct message *msg)
+{
+	pthread_mutex_lock(&cache->mutex);
+	struct send_entry *entry = *send_cache_slot(cache, time, caps);
+	if (!entry || entry->caps != caps || entry->time_size != time->mv_size || memcmp(entry->time, time->mv_data, time->mv_size) != 0) {
+		pthread_mutex_unlock(&cache->mutex);
+		return MDB_NOTFOUND;
+	}
+	entry->refs++;
+	pthread_mutex_unlock(&cache->mutex);
+
+	int rc = msg_copy(msg, entry->buf, entry->size) ? ENOMEM : 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	send_entry_release(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+	return rc;
+}
+
+/* send_cache_put puts the message msg of time for caps into the cache, unless it is too large */
+static void send_cache_put(struct send_cache *cache, MDB_val *time, unsigned int caps, struct message *msg)
+{
+	if (msg->ext || msg->size > SEND_CACHE_RECORD_MAX)
+		return;
+
+	struct send_entry *entry = malloc(sizeof *entry + msg->size);
+	if (!entry)
+		return;
+	entry->refs = 1;
+	entry->caps = caps;
+	memcpy(entry->time, time->mv_data, time->mv_size);
+	entry->time_size = time->mv_size;
+	entry->size = msg->size;
+	memcpy(entry->buf, msg->buf, msg->size);
+
+	pthread_mutex_lock(&cache->mutex);
+	struct send_entry **slot = send_cache_slot(cache, time, caps);
+	if (*slot)
+		send_entry_release(cache, *slot);
+	*slot = NULL;
+	if (cache->bytes + entry->size <= SEND_CACHE_MAX_BYTES) {
+		*slot = entry;
+		cache->bytes += entry->size;
+		entry = NULL;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	free(entry);
+}
+
+/* load_time_message reads from the database and writes a new message that can be sent on the network
+ * It finds the next time to send to node.
+ * It returns 0 if a msg is loaded, MDB_NOTFOUND if time is the last entry in node_time for that node 
+ * and ENOMEM if there was a memory problem.
+ * Compressed values are sent as they are if the codec is in caps, and decompressed otherwise.
+ * time has room for TIME_MAX_SIZE bytes, and time_size is 0 before the first time of node.
+ * Chunked values are sent as chunk messages if caps contains CAP_CHUNKS. chunk is the next chunk of
+ * time to send, and the time message follows the last chunk. chunk is 0 when no value is being
+ * chunked.
+ * Values and chunks that are found in map_txn are written from the memory map instead of being copied
+ * into msg. map_txn may be NULL.
+ * txn may be read-only. A node-time that both nodes know is added to dels instead of being deleted.
+ * cursor is a cursor in a lane of db_node_time of txn. If positioned is set, the cursor is at the node-time of
+ * time, and the next node-time is one step away. Otherwise the cursor is positioned by a search, and
+ * positioned is set once the cursor is at a node-time.
+ * A time message that the remote node needs in full is copied from cache if it is there, and cached
+ * is set. msg is then in the wire format of caps. cache may be NULL.
+ */ 
+static int load_time_msg(struct trlmdb_txn *txn, MDB_txn *map_txn, MDB_cursor *cursor, int *positioned, uint8_t *time, size_t *time_size, uint32_t *chunk, char *node, unsigned int caps, struct key_list *dels, struct send_cache *cache, int *cached, struct message *msg)
+{
+	size_t node_len = strlen(node);
+	MDB_val node_time_val;
+	MDB_val flag_val;
+	int rc;
+
+	if (*positioned) {
+		/* The chunks of time are being sent, or the next time follows */
+		rc = mdb_cursor_get(cursor, &node_time_val, &flag_val, *chunk > 0 ? MDB_GET_CURRENT : MDB_NEXT);
+	} else {
+		MDB_val last_time_val = {*time_size, time};
+		MDB_val node_time;
+		rc = encode_node_time(txn->env, node, node_len, &last_time_val, &node_time);
+		if (rc)
+			return rc;
+		node_time_val = node_time;
+
+		/* The chunks of time are being sent, unless the time has been removed meanwhile */
+		rc = MDB_NOTFOUND;
+		if (*chunk > 0) {
+			rc = mdb_cursor_get(cursor, &node_time_val, &flag_val, MDB_SET_KEY);
+			if (rc == MDB_NOTFOUND)
+				*chunk = 0;
+		}
+
+		if (*chunk == 0) {
+			rc = mdb_cursor_get(cursor, &node_time_val, &flag_val, MDB_SET_RANGE);
+			if (!rc && node_time_val.mv_size == node_time.mv_size && memcmp(node_time_val.mv_data, node_time.mv_data, node_time.mv_size) == 0)
+				rc = mdb_cursor_get(cursor, &node_time_val, &flag_val, MDB_NEXT);
+		}
+		free(node_time.mv_data);
+	}
+
+	if (rc)
+		return rc;
+	*positioned = 1;
+	
+	MDB_val time_val;
+	if (!node_time_split(txn->env, &node_time_val, node, node_len, &time_val))
+		return MDB_NOTFOUND;
+
+	*cached = 0;
+	if (cache && *chunk == 0 && *(uint8_t*)flag_val.mv_data == 'f') {
+		rc = send_cache_get(cache, &time_val, caps, msg);
+		if (rc != MDB_NOTFOUND) {
+			if (rc)
+				return rc;
+			memcpy(time, time_val.mv_data, time_val.mv_size);
+			*time_size = time_val.mv_size;
+			*cached = 1;
+			return 0;
+		}
+	}
+
+	uint8_t msg_time[TIME_MAX_SIZE];
+	size_t msg_time_size = time_convert(msg_time, time_val.mv_data, time_val.mv_size, env_compact_time(txn->env), (caps & CAP_COMPACT_TIME) != 0);
+	if (msg_time_size == 0)
+		return EINVAL;
+	
+	MDB_val key;
+	int key_known = !mdb_get(txn->mdb_txn, txn->env->dbi_time_to_key, &time_val, &key);
+
+	uint8_t out_flag[3];
+	out_flag[0] = key_known ? 't' : 'f';
+	out_flag[1] = *(uint8_t*)flag_val.mv_data;
+	out_flag[2] = 0;
+
+	/* The remote node uses table names in its extended keys */
+	MDB_val *name_key = NULL;
+	if (out_flag[1] == 'f' && key_known && (txn->env->flags & TRLMDB_TABLE_IDS) && !(caps & CAP_TABLE_IDS)) {
+		rc = table_key_to_name_key(txn, &key, &name_key);
+		if (rc == MDB_NOTFOUND) {
+			/* The catalog is meaningless to the remote node, so it counts as known */
+			out_flag[1] = 't';
+		} else if (rc) {
+			return rc;
+		} else {
+			key = *name_key;
+		}
+	}
+
+	int send_data = out_flag[1] == 'f' && key_known && time_is_put(&time_val);
+	MDB_val data;
+	MDB_dbi map_dbi = 0;
+	uint8_t nchunks[4];
+	if (send_data) {
+		rc = mdb_get(txn->mdb_txn, txn->env->dbi_time_to_data, &time_val, &data);
+		if (rc == 0)
+			map_dbi = txn->env->dbi_time_to_data;
+		if (rc == MDB_NOTFOUND) {
+			rc = mdb_get(txn->mdb_txn, txn->env->dbi_time_to_zdata, &time_val, &data);
+			if (rc == 0) {
+				const struct codec *codec = value_codec(&data);
+				if (codec && (codec->cap & caps)) {
+					out_flag[2] = 'z';
+					map_dbi = txn->env->dbi_time_to_zdata;
+				} else {
+					rc = value_decompress(txn, &data, &data);
+				}
+			} else if (rc == MDB_NOTFOUND && (caps & CAP_CHUNKS)) {
+				rc = trlmdb_chunk_get(txn, &time_val, *chunk, &data);
+				if (rc == 0) {
+					uint8_t chunk_key_buf[TIME_MAX_SIZE + 4];
+					MDB_val chunk_key = encode_chunk_key(chunk_key_buf, &time_val, *chunk);
+					MDB_val mapped;
+					int is_mapped = map_value(map_txn, txn->env->dbi_time_to_chunk, &chunk_key, &data, &mapped) == 0;
+					rc = load_chunk_msg(msg, msg_time, msg_time_size, *chunk, is_mapped ? &mapped : &data, is_mapped);
+					if (rc)
+						goto out;
+					memcpy(time, time_val.mv_data, time_val.mv_size);
+					*time_size = time_val.mv_size;
+					(*chunk)++;
+					goto out;
+				}
+				if (rc == MDB_NOTFOUND && *chunk > 0) {
+					/* All chunks are sent */
+					encode_uint32(nchunks, *chunk);
+					data = (MDB_val) {4, nchunks};
+					out_flag[2] = 'c';
+					rc = 0;
+				}
+			} else if (rc == MDB_NOTFOUND) {
+				rc = trlmdb_chunks_get(txn, &time_val, &data);
+			}
+		}
+		if (rc)
+			goto out;
+	}
+
+	msg_reset(msg);
+
+	rc = msg_append(msg, (uint8_t*) "time", 4);
+	if (rc)
+		goto out;
+
+	rc = msg_append(msg, out_flag, out_flag[2] ? 3 : 2);
+	if (rc)
+		goto out;
+
+	rc = msg_append(msg, msg_time, msg_time_size);
+	if (rc)
+		goto out;
+
+	if (out_flag[1] == 'f' && key_known) {
+		rc = msg_append(msg, (uint8_t*)key.mv_data, key.mv_size);
+		if (rc)
+			goto out;
+	}
+
+	if (send_data) {
+		MDB_val mapped;
+		if (map_dbi && map_value(map_txn, map_dbi, &time_val, &data, &mapped) == 0) {
+			rc = msg_append_ext(msg, (uint8_t*)mapped.mv_data, mapped.mv_size);
+		} else {
+			rc = msg_append(msg, (uint8_t*)data.mv_data, data.mv_size);
+		}
+		if (rc)
+			goto out;
+	}
+
+	memcpy(time, time_val.mv_data, time_val.mv_size);
+	*time_size = time_val.mv_size;
+	*chunk = 0;
+
+	if (out_flag[0] == 't' && out_flag[1] == 't')
+		rc = key_list_add(dels, &node_time_val);
+
+out:
+	if (name_key)
+		free_table_key(name_key);
+	return rc;
+}
+
+/* split_address splits "hostname:port" into a hostname and a service name. The port is 80 by default */
+static void split_address(const char *address, char **hostname, char **servname)
+{
+	char *colon = strchr(address, ':');
+
+	if (colon) {
+		*hostname = strndup(address, colon - address);
+		*servname = strndup(colon + 1, address + strlen(address) - colon - 1);
+	} else {
+		*hostname = strdup(address);
+		*servname = strdup("80");
+	}
+}
+
+/* Snapshot bootstrap
+ *
+ * snap-message = "snap" node
+ * snap-header-message = "snap" node
+ *
+ * A replicator with the conf option "bootstrap = remote-node" and no database file connects to the
+ * remote node before it opens the database, and sends a snap message instead of a node message. The
+ * remote node answers with a snap header, streams a compact copy of the database made by
+ * mdb_env_copyfd2 followed by SNAP_TRAILER and closes the connection. Both nodes then reconcile their
+ * times by ranges, as for a new node, so the node-times of the times in the copy are removed and the
+ * times written during the copy are sent. The new node also reconciles the copied times with its other
+ * nodes by ranges.
+ *
+ * The time id of the new node is drawn when its environment is created, so its times differ from
+ * those of the remote node.
+ */
+
+#define SNAP_TRAILER "snapdone"
+#define SNAP_TRAILER_SIZE 8
+#define SNAP_HEADER_TIMEOUT 60
+#define SNAP_READ_SIZE 1048576
+
+/* node_acceptable returns 1 if remote_node may replicate with the node */
+static int node_acceptable(struct rstate *rs, char *remote_node)
+{
+	if (rs->connect_node)
+		return strcmp(rs->connect_node, remote_node) == 0;
+
+	for (int i = 0; i < rs->naccept; i++) {
+		if (strcmp(remote_node, rs->accept_node[i]) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static int write_pending(struct rstate *rs);
+static void write_to_socket(struct rstate *rs);
+
+/* read_snap reads a snap message or snap header */
+static char *read_snap(struct message *msg)
+{
+	if (msg_get_count(msg) != 2 || !msg_is_type(msg, "snap"))
+		return NULL;
+
+	uint8_t *data;
+	uint64_t size;
+	msg_get_elem(msg, 1, &data, &size);
+	return strndup((char*) data, size);
+}
 
-cleanup_txn:
-	mdb_txn_abort(txn);
-cleanup_env:
-	mdb_env_close(env->mdb_env);
-out:
-	return rc;
+static void write_snap(struct message *msg, const char *node)
+{
+	msg_reset(msg);
+	msg_append(msg, (uint8_t*) "snap", 4);
+	msg_append(msg, (uint8_t*) node, strlen(node));
 }
 
-void trlmdb_env_close(struct trlmdb_env *env)
+/* write_all writes size bytes to the blocking socket_fd */
+static int write_all(int socket_fd, const uint8_t *buf, size_t size)
 {
-	mdb_env_close(env->mdb_env);
-	free(env);
+	while (size > 0) {
+		ssize_t nwritten = write(socket_fd, buf, size);
+		if (nwritten < 1)
+			return errno ? errno : EIO;
+		buf += nwritten;
+		size -= nwritten;
+	}
+	return 0;
 }
 
+static int socket_set_blocking(int socket_fd, int timeout)
+{
+	struct timeval tv = {timeout, 0};
+	setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	return fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) & ~O_NONBLOCK) == -1 ? errno : 0;
+}
 
-MDB_env *trlmdb_mdb_env(struct trlmdb_env *env)
+/* A snapshot job sends the copy of the database on a socket of its own */
+struct snapshot_job {
+	struct trlmdb_env *env;
+	char *node;
+	char *remote_node;
+	int socket_fd;
+};
+
+/* snapshot_send sends the snap header, the copy and the trailer, and frees job. The times written
+ * during the copy may be missing from it, so the remote node is reconciled by ranges afterwards.
+ */
+static void *snapshot_send(void *arg)
 {
-	return env->mdb_env;
+	struct snapshot_job *job = arg;
+	struct message *header = msg_alloc_init(64);
+
+	write_snap(header, job->node);
+	int rc = write_all(job->socket_fd, header->buf, header->size);
+	if (!rc)
+		rc = mdb_env_copyfd2(job->env->mdb_env, job->socket_fd, MDB_CP_COMPACT);
+	if (!rc)
+		rc = write_all(job->socket_fd, (uint8_t*) SNAP_TRAILER, SNAP_TRAILER_SIZE);
+	if (!rc)
+		rc = trlmdb_node_sync_restart(job->env, job->remote_node);
+
+	if (rc)
+		log_stderr("The snapshot for %s failed: %s\n", job->remote_node, mdb_strerror(rc));
+	else
+		printf("sent snapshot to %s\n", job->remote_node);
+
+	close(job->socket_fd);
+	msg_free(header);
+	free(job->remote_node);
+	free(job);
+	return NULL;
 }
 
-int trlmdb_txn_begin(struct trlmdb_env *env, unsigned int flags, struct trlmdb_txn **txn)
+/* send_snapshot answers a snap message from an accepted node. The connection hands its socket to a
+ * snapshot job and closes. An event thread runs the job in a thread of its own, since the copy
+ * would hold up its other connections.
+ */
+static void send_snapshot(struct rstate *rs, struct message *msg)
 {
-	*txn = malloc(sizeof **txn);
-	if (!*txn)
-		return ENOMEM;
+	char *remote_node = read_snap(msg);
+	if (!remote_node || !node_acceptable(rs, remote_node)) {
+		log_stderr("The snapshot request is not acceptable\n");
+		free(remote_node);
+		close_socket(rs);
+		return;
+	}
 
-	**txn = (struct trlmdb_txn) {0};
-	
-	(*txn)->env = env;
-	(*txn)->flags = flags;
-	
-	(*txn)->time = malloc(sizeof *(*txn)->time);
-	if (!(*txn)->time) {
-		free(*txn);
-		return ENOMEM;
+	/* The node and caps messages may be loaded already. They are small, so the blocking writes do
+	 * not wait for the remote node.
+	 */
+	int rc = socket_set_blocking(rs->socket_fd, 0);
+	while (!rc && write_pending(rs) && rs->socket_fd != -1)
+		write_to_socket(rs);
+
+	int socket_fd = -1;
+	if (!rc && rs->socket_fd != -1) {
+		socket_fd = dup(rs->socket_fd);
+		if (socket_fd == -1)
+			rc = errno;
+	}
+	if (rs->socket_fd != -1)
+		close_socket(rs);
+	if (rc)
+		log_stderr("The snapshot for %s failed: %s\n", remote_node, strerror(rc));
+	if (socket_fd == -1) {
+		free(remote_node);
+		return;
 	}
 
-	memcpy((*txn)->time->id, env->time_id, 4);
-	time_gettimeofday((*txn)->time);
-	(*txn)->time->counter = 0;
+	struct snapshot_job *job = tr_malloc(sizeof *job);
+	*job = (struct snapshot_job) {rs->env, rs->node, remote_node, socket_fd};
 
-	int rc = mdb_txn_begin(env->mdb_env, NULL, flags, &((*txn)->mdb_txn));
-	if (rc) {
-		free((*txn)->time);
-		free(*txn);
+	if (rs->epoll_fd == -1) {
+		snapshot_send(job);
+		return;
 	}
 
-	return rc;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, snapshot_send, job)) {
+		log_stderr("The snapshot thread for %s could not be created\n", remote_node);
+		close(socket_fd);
+		free(remote_node);
+		free(job);
+		return;
+	}
+	pthread_detach(thread);
 }
 
-int trlmdb_txn_commit(struct trlmdb_txn *txn)
+/* read_snapshot reads the snap header into header and the database copy into the file fd */
+static int read_snapshot(int socket_fd, int fd, struct message **header)
 {
+	uint8_t *buf = tr_malloc(SNAP_READ_SIZE);
+	uint64_t size = 0;
 	int rc = 0;
 
-	rc = mdb_txn_commit(txn->mdb_txn);
-	free(txn->time);
-	free(txn);
-
-	return rc;
-}
-
-void trlmdb_txn_abort(struct trlmdb_txn *txn)
-{
-	mdb_txn_abort(txn->mdb_txn);
-	free(txn->time);
-	free(txn);
-}
+	/* The remote node sends its node and caps messages before the header */
+	for (;;) {
+		struct message *msg = msg_from_buf(buf, size);
+		if (msg) {
+			memmove(buf, buf + msg->size, size - msg->size);
+			size -= msg->size;
+			if (msg_is_type(msg, "snap")) {
+				*header = msg;
+				break;
+			}
+			msg_free(msg);
+			continue;
+		}
 
-static int trlmdb_node_put_time_all_nodes(struct trlmdb_env *env, MDB_txn *txn, uint8_t *time)
-{
-	MDB_cursor *cursor;
-	int rc = mdb_cursor_open(txn, env->dbi_nodes, &cursor);
-	if (rc)
-		return rc;
+		if (size == SNAP_READ_SIZE) {
+			rc = EINVAL;
+			goto out;
+		}
+		ssize_t nread = read(socket_fd, buf + size, SNAP_READ_SIZE - size);
+		if (nread < 1) {
+			rc = nread == 0 ? EIO : errno;
+			goto out;
+		}
+		size += nread;
+	}
 
-	MDB_val node_val;
-	MDB_val empty_val;
-	MDB_val node_time_val = {2, "ff"};
+	/* The copy may take a while to start on a large database */
+	struct timeval tv = {0, 0};
+	setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
 
-	while ((rc = mdb_cursor_get(cursor, &node_val, &empty_val, MDB_NEXT)) == 0) {
-		uint8_t *node_time = encode_node_time(node_val.mv_data, node_val.mv_size, time);
-		if (!node_time) {
-			rc = ENOMEM;
-			break;
+	uint64_t total = 0;
+	for (;;) {
+		if (size > 0) {
+			rc = write_all(fd, buf, size);
+			if (rc)
+				goto out;
+			total += size;
 		}
-		MDB_val node_time_key = {node_val.mv_size + 20, node_time};
-		rc = mdb_put(txn, env->dbi_node_time, &node_time_key, &node_time_val, 0);
-		free(node_time);
-		if (rc)
+		ssize_t nread = read(socket_fd, buf, SNAP_READ_SIZE);
+		if (nread == 0)
 			break;
+		if (nread < 0) {
+			rc = errno;
+			goto out;
+		}
+		size = nread;
 	}
 
-	mdb_cursor_close(cursor);
+	uint8_t trailer[SNAP_TRAILER_SIZE];
+	if (total < SNAP_TRAILER_SIZE || pread(fd, trailer, SNAP_TRAILER_SIZE, total - SNAP_TRAILER_SIZE) != SNAP_TRAILER_SIZE
+	    || memcmp(trailer, SNAP_TRAILER, SNAP_TRAILER_SIZE) != 0) {
+		rc = EIO;
+		goto out;
+	}
 
-	return rc == MDB_NOTFOUND ? 0 : rc;
+	if (ftruncate(fd, total - SNAP_TRAILER_SIZE) || fsync(fd))
+		rc = errno;
+
+out:
+	free(buf);
+	return rc;
 }
 
-static int trlmdb_insert_time_key_data(struct trlmdb_env *env, MDB_txn *txn, uint8_t *time, MDB_val *key, MDB_val *data)
+/* bootstrap_database copies the database of the bootstrap node into the database directory if it has
+ * no database file. It returns 1 if it did.
+ */
+static int bootstrap_database(struct conf_info *conf_info)
 {
-	MDB_txn *child_txn;
-	int rc = mdb_txn_begin(env->mdb_env, txn, 0, &child_txn);
-	if (rc)
-		return rc;	
+	char *node = conf_info->bootstrap_node;
+	size_t path_len = strlen(conf_info->database) + 20;
+	char *path = tr_malloc(path_len);
+	char *tmp_path = tr_malloc(path_len);
+	snprintf(path, path_len, "%s/data.mdb", conf_info->database);
+	snprintf(tmp_path, path_len, "%s/data.mdb.snap", conf_info->database);
+
+	int bootstrapped = 0;
+	int socket_fd = -1;
+	int fd = -1;
+	struct message *msg = msg_alloc_init(64);
+	struct message *header = NULL;
+
+	struct stat st;
+	if (stat(path, &st) == 0)
+		goto out;
+
+	char *address = NULL;
+	for (int i = 0; i < conf_info->nconnect; i++) {
+		if (strcmp(conf_info->connect_node[i], node) == 0)
+			address = conf_info->connect_address[i];
+	}
 
-	MDB_val time_val = {20, time};
-	
-	rc = mdb_put(child_txn, env->dbi_time_to_key, &time_val, key, 0);
-	if (rc)
-		goto abort_child_txn;
+	char *hostname, *servname;
+	split_address(address, &hostname, &servname);
+	socket_fd = create_connection(hostname, servname, conf_info->connect_timeout, NULL);
+	free(hostname);
+	free(servname);
+	if (socket_fd == -1)
+		goto failed;
 
-	if (time_is_put(time)) {
-		rc = mdb_put(child_txn, env->dbi_time_to_data, &time_val,data, 0);
-		if (rc)
-			goto abort_child_txn;
+	int rc = socket_set_blocking(socket_fd, SNAP_HEADER_TIMEOUT);
+	if (!rc) {
+		write_snap(msg, conf_info->node);
+		rc = write_all(socket_fd, msg->buf, msg->size);
 	}
 
-	int is_time_most_recent = 1;
-	MDB_val existing_time_val;
-	rc = mdb_get(child_txn, env->dbi_key_to_time, key, &existing_time_val);
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		rc = errno;
+
+	if (!rc)
+		rc = read_snapshot(socket_fd, fd, &header);
+
 	if (!rc) {
-		is_time_most_recent = time_cmp(time, existing_time_val.mv_data) > 0;
+		char *remote_node = read_snap(header);
+		if (!remote_node || strcmp(remote_node, node) != 0)
+			rc = EINVAL;
+		free(remote_node);
 	}
 
-	if (is_time_most_recent) {
-		rc = mdb_put(child_txn, env->dbi_key_to_time, key, &time_val, 0);
-		if (rc)
-			goto abort_child_txn;
+	if (!rc && rename(tmp_path, path))
+		rc = errno;
+
+	if (rc) {
+		log_stderr("The snapshot from %s failed: %s\n", node, mdb_strerror(rc));
+		unlink(tmp_path);
+		goto failed;
 	}
 
-	rc = trlmdb_node_put_time_all_nodes(env, child_txn, time);
-	if (rc)
-		goto abort_child_txn;
-	
-	rc = mdb_txn_commit(child_txn);
+	bootstrapped = 1;
+	printf("bootstrapped from %s\n", node);
 	goto out;
-	
-abort_child_txn:
-	mdb_txn_abort(child_txn);
-out:	
-	return rc;
-}	
-
-static int trlmdb_single_get(struct trlmdb_txn *txn, MDB_val *key, MDB_val *data)
-{
-	MDB_val time_val;
-	int rc = mdb_get(txn->mdb_txn, txn->env->dbi_key_to_time, key, &time_val);
-	if (rc)
-		return rc;
-
-	if (!time_is_put(time_val.mv_data)) return MDB_NOTFOUND;
 
-	return mdb_get(txn->mdb_txn, txn->env->dbi_time_to_data, &time_val, data);
+failed:
+	log_stderr("Starting with an empty database\n");
+out:
+	if (fd != -1)
+		close(fd);
+	if (socket_fd != -1)
+		close(socket_fd);
+	msg_free(msg);
+	if (header)
+		msg_free(header);
+	free(path);
+	free(tmp_path);
+	return bootstrapped;
 }
 
-static int trlmdb_single_put_del(struct trlmdb_txn *txn, MDB_val *key, MDB_val *data)
-{
-	int is_put = data != NULL;
-	uint8_t *time = encode_time(txn->time, is_put);
-	if (!time)
-		return ENOMEM;
-	
-	time_inc(txn->time);
-	
-	return trlmdb_insert_time_key_data(txn->env, txn->mdb_txn, time, key, data);
-}
+/* The replicator server 
+ * replicator(struct conf_info*) is called by main to start the replicator
+*/
 
-static int trlmdb_single_put(struct trlmdb_txn *txn, MDB_val *key, MDB_val *data)
+void replicator(struct conf_info *conf_info)
 {
-	return trlmdb_single_put_del(txn, key, data);
-}
+	int rc = 0;
+	struct trlmdb_env *env;
 
-static int trlmdb_single_del(struct trlmdb_txn *txn, MDB_val *key)
-{
-	MDB_val time_val;
-	int rc = mdb_get(txn->mdb_txn, txn->env->dbi_key_to_time, key, &time_val);
-	if (rc)
-		return rc;
+	rc = trlmdb_env_create(&env);
+	if (rc) {
+		log_stderr("The lmdb environment could not be created");
+		exit(1);
+	}
 
-	if (!time_is_put(time_val.mv_data)) return MDB_NOTFOUND;
+	if (conf_info->max_tables > 0)
+		trlmdb_env_set_maxtables(env, conf_info->max_tables);
+	trlmdb_env_set_flags(env, conf_info->database_flags);
 
-	return trlmdb_single_put_del(txn, key, NULL);
-}
+	int bootstrapped = conf_info->bootstrap_node && bootstrap_database(conf_info);
 
-static int trlmdb_node_put_all_times(struct trlmdb_env *env, MDB_txn *txn, char *node)
-{
-	size_t node_len = strlen(node);
-	MDB_val node_time_data = {2, "ff"};
-	
-	MDB_cursor *cursor;
-	int rc = mdb_cursor_open(txn, env->dbi_time_to_key, &cursor);
-	if (rc)
-		return rc;
 
-	MDB_val time_val, data;
-	while ((rc = mdb_cursor_get(cursor, &time_val, &data, MDB_NEXT)) == 0) {
-		uint8_t *node_time = encode_node_time(node, node_len, time_val.mv_data);
-		if (!node_time)
-			return ENOMEM;
+	/* A replicator thread keeps a read-only txn for the values it writes from the memory map */
+	rc = trlmdb_env_open(env, conf_info->database, MDB_NOTLS, 0644);
+	if (rc) {
+		log_stderr("The database could not be opened");
+		exit(1);
+	}
 
-		MDB_val node_time_key = {node_len + 20, node_time};
-		rc = mdb_put(txn, env->dbi_node_time, &node_time_key, &node_time_data, 0);
-		free(node_time);
+	/* The nodes of the copied database belong to the bootstrap node. The nodes are added again below
+	 * and reconciled by ranges, including the bootstrap node.
+	 */
+	if (bootstrapped) {
+		rc = trlmdb_nodes_clear(env);
 		if (rc)
-			return rc;
+			log_mdb_err(rc);
 	}
 
-	mdb_cursor_close(cursor);
-	return rc == MDB_NOTFOUND ? 0 : rc;
-}
+	for (int i = 0; i < conf_info->naccept; i++) {
+		char *node = conf_info->accept_node[i];
 
-static int trlmdb_node_add(struct trlmdb_env *env, char *node)
-{
-	MDB_txn *txn;
-	int rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
+		int rc = trlmdb_node_add(env, node);
+		if (rc)
+			log_mdb_err(rc);
+	}
+
+	rc = trlmdb_tables_priority_set(env, conf_info->priority_table, conf_info->npriority);
 	if (rc)
-		return rc;
+		log_mdb_err(rc);
 
-	MDB_val node_val = {strlen(node), node};
-	MDB_val data = {0, ""};
-	rc = mdb_put(txn, env->dbi_nodes, &node_val, &data, MDB_NOOVERWRITE);
-	if (rc) {
-		mdb_txn_commit(txn);
-		return rc == MDB_KEYEXIST ? 0 : rc;
-	}
+	notify_start(env, conf_info->notify_interval);
 
-	rc = trlmdb_node_put_all_times(env, txn, node);
-	if (rc) {
-		mdb_txn_abort(txn);
-		return rc;
+	struct applier *applier = NULL;
+	if (conf_info->group_commit)
+		applier = applier_create(env);
+
+	struct send_cache *send_cache = NULL;
+	if (conf_info->naccept + conf_info->nconnect > 1)
+		send_cache = send_cache_create();
+
+	struct conn_registry *registry = conn_registry_create();
+
+	struct event_pool *pool = NULL;
+	if (conf_info->event_threads > 0)
+		pool = event_pool_create(env, conf_info->event_threads);
+
+	pthread_t *threads;
+	if (conf_info->nconnect > 0) {
+		threads = calloc(conf_info->nconnect, sizeof threads);
 	}
 
-	rc = mdb_txn_commit(txn);
-	return rc;	
-}
+	for (int i = 0; i < conf_info->nconnect; i++) {
+		char *node = conf_info->connect_node[i];
 
-static int trlmdb_node_del(struct trlmdb_env *env, char *node)
-{
-	MDB_txn *txn;
-	int rc = mdb_txn_begin(env->mdb_env, NULL, 0, &txn);
-	if (rc)
-		return rc;
+		int rc = trlmdb_node_add(env, node);
+		if (rc)
+			log_mdb_err(rc);
+		
+		struct rstate *rs = rstate_alloc_init(env, conf_info);
+		if (!rs)
+			log_enomem();
+
+		rs->connect_now = 1;
+		rs->connect_node = node;
+		rs->applier = applier;
+		rs->send_cache = send_cache;
+		rs->registry = registry;
+		split_address(conf_info->connect_address[i], &rs->connect_hostname, &rs->connect_servname);
+
+		if (pool) {
+			event_pool_add(pool, rs);
+			continue;
+		}
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_t thread;
+
+		if (pthread_create(&thread, &attr, replicator_loop, rs) != 0) {
+			printf("error creating thread\n");
+			rstate_free(rs);
+			exit(1);
+		}
 
-	size_t node_len = strlen(node);
-	MDB_val node_val = {node_len, node};
-	rc = mdb_del(txn, env->dbi_nodes, &node_val, NULL);
-	if (rc) {
-		mdb_txn_abort(txn);
-		return rc;
+		threads[i] = thread;
 	}
 
-	MDB_cursor *cursor;
-	rc = mdb_cursor_open(txn, env->dbi_node_time, &cursor);
-	if (rc) {
-		mdb_txn_abort(txn);
-		return rc;
+	if (conf_info->port) {
+		int listen_fd = create_listener("localhost", conf_info->port);
+		printf("listen_fd = %d\n", listen_fd);
+		if (listen_fd != -1)
+			accept_loop(listen_fd, env, conf_info, pool, applier, send_cache, registry);
 	}
 
-	MDB_val node_time_val = {node_len, node};
-	MDB_val data;
-	rc = mdb_cursor_get(cursor, &node_time_val, &data, MDB_SET_RANGE);
-	for (;;) {
-		if (rc)
-			break;
-
-		if (node_time_val.mv_size >= node_len && memcmp(node_time_val.mv_data, node, node_len) == 0)
-			mdb_cursor_del(cursor, 0);
+	if (pool) {
+		event_pool_join(pool);
+		return;
+	}
 
-		rc = mdb_cursor_get(cursor, &node_time_val, &data, MDB_NEXT);
+	for (int i = 0; i < conf_info->nconnect; i++) {
+		pthread_join(threads[i], NULL);
 	}
+}
 
-	return mdb_txn_commit(txn);
+/* event handlers in the replicator loop */
+
+/* read_buf_shrink gives back the memory of an empty read buffer that has grown beyond the read budget
+ * for a large message.
+ */
+static void read_buf_shrink(struct rstate *rs)
+{
+	if (rs->read_buf_cap <= rs->read_budget)
+		return;
+
+	uint8_t *realloced = realloc(rs->read_buf, rs->read_budget);
+	if (!realloced)
+		return;
+	rs->read_buf = realloced;
+	rs->read_buf_cap = rs->read_budget;
 }
 
-static int trlmdb_node_time_update(struct trlmdb_txn *txn, char *node, uint8_t *time, uint8_t* flag)
+static void connect_to_remote(struct rstate *rs)
 {
-	size_t node_len = strlen(node);
-	uint8_t *node_time = encode_node_time(node, node_len, time);
-	if (!node_time)
-		return ENOMEM;
+	rs->node_msg_sent = 0;
+	rs->node_msg_received = 0;
+	rs->caps_msg_sent = 0;
+	rs->caps_msg_received = 0;
+	rs->opts_msg_sent = 0;
+	rs->remote_caps = 0;
+	rs->write_caps = 0;
+	rs->read_caps = 0;
+	rs->connect_now = 0;
+	rs->write_msg_head = 0;
+	rs->write_msg_loaded = 0;
+	rs->write_msg_nwritten = 0;
+	rs->write_bytes = 0;
+	rs->record_pending = 0;
+	send_txn_release(rs, 0);
+	send_txn_release(rs, 1);
+	rs->write_window = WRITE_WINDOW_MIN;
+	rs->read_buf_start = 0;
+	rs->read_buf_size = 0;
+	rs->read_buf_loaded = 0;
+	rs->read_buf_more = 0;
+	rs->napply_recs = 0;
+	rs->ack_dels.size = 0;
+	rs->ack_dels.count = 0;
+	read_buf_shrink(rs);
+	rstate_stream_end(rs);
+	rs->sync_state = SYNC_NONE;
+	rs->sync_outstanding = 0;
+	rs->sent_head = 0;
+	rs->sent_count = 0;
+	rs->sent_acked = 0;
+	rs->read_time_count = 0;
+	rs->read_time_acked = 0;
+	rs->read_time_failed = 0;
+
+	/* The remote node may have lost the chunks that were in flight */
+	if (rs->write_chunk > 0) {
+		rs->write_chunk = 0;
+		rs->write_time_size[rs->write_lane] = 0;
+	}
+	
+	rs->socket_fd = create_connection(rs->connect_hostname, rs->connect_servname, rs->connect_timeout, &rs->connecting);
+	if (rs->socket_fd == -1)
+		rs->connect_failures++;
+	rs->connect_deadline = time_ms() + rs->connect_timeout;
+}
 
-	MDB_val node_time_key = {node_len + 20, node_time};
-	int rc;
-	if (memcmp(flag, "tt", 2) == 0) {
-		rc = mdb_del(txn->mdb_txn, txn->env->dbi_node_time, &node_time_key, NULL);
-	} else {
-		MDB_val node_time_data = {2, flag}; 
-		rc = mdb_put(txn->mdb_txn, txn->env->dbi_node_time, &node_time_key, &node_time_data, 0);
+/* connect_finish ends a non-blocking connect when the socket is writable or the deadline has passed */
+static void connect_finish(struct rstate *rs)
+{
+	int err = 0;
+	socklen_t len = sizeof err;
+	if (!rs->socket_writable) {
+		err = ETIMEDOUT;
+	} else if (getsockopt(rs->socket_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+		err = errno;
 	}
 
-	free(node_time);
-	return rc;
+	if (err) {
+		log_stderr("connect error to %s:%s: %s. Trying again later\n", rs->connect_hostname, rs->connect_servname, strerror(err));
+		close_socket(rs);
+		return;
+	}
+
+	rs->connecting = 0;
+	printf("connected to %s:%s\n", rs->connect_hostname, rs->connect_servname);
 }
 
-/* returns 1 if node exists, 0 if the node does not exist, and -1 for an error */
-static int trlmdb_node_exists(struct trlmdb_env *env, char *node)
+/* reconnect_delay returns the milliseconds before the next connect. A lost connection is connected
+ * again at once. After failed connects, the delay doubles from reconnect_min up to reconnect_max, and
+ * a random jitter of up to half the delay spreads the connects of many replicators.
+ */
+static int reconnect_delay(struct rstate *rs)
 {
-	MDB_val key = {strlen(node), node};
-	MDB_val data = {0, ""};
-
-	MDB_txn *txn;
-	int rc = mdb_txn_begin(env->mdb_env, NULL, MDB_RDONLY, &txn);
-	if (rc)
-		return -1;
+	if (rs->connect_failures == 0)
+		return 0;
 
-	rc = mdb_get(txn, env->dbi_nodes, &key, &data);
+	int delay = rs->reconnect_min;
+	for (int i = 1; i < rs->connect_failures && delay < rs->reconnect_max; i++)
+		delay *= 2;
+	if (delay > rs->reconnect_max)
+		delay = rs->reconnect_max;
 
-	mdb_txn_commit(txn);
+	return delay - arc4random() % (delay / 2 + 1);
+}
 
-	return rc == MDB_NOTFOUND ? 0 : 1;
+static void send_node_msg(struct rstate *rs)
+{
+	write_node(write_msg_next(rs), rs->node);
+	write_msg_push(rs);
+	rs->node_msg_sent = 1;
 }
 
-static int trlmdb_get_key_for_time(struct trlmdb_txn *txn, uint8_t *time, MDB_val *key)
+static void send_caps_msg(struct rstate *rs)
 {
-	MDB_val time_val = {20, time};
-	return mdb_get(txn->mdb_txn, txn->env->dbi_time_to_key, &time_val, key);
+	write_caps(write_msg_next(rs), "caps", env_caps(rs->env));
+	write_msg_push(rs);
+	rs->caps_msg_sent = 1;
 }
 
-/* table_key encoding */
+/* send_opts_msg loads the opts message after the loaded messages, so that all messages loaded
+ * later use the capabilities.
+ */
+static void send_opts_msg(struct rstate *rs)
+{
+	rs->write_caps = env_caps(rs->env) & rs->remote_caps;
+	if (!rs->compress_stream)
+		rs->write_caps &= ~CAP_STREAM_LZ;
+	write_caps(write_msg_next(rs), "opts", rs->write_caps);
+	write_msg_push(rs);
+	rs->opts_msg_sent = 1;
+
+	/* The bytes after the opts message are compressed */
+	if (rs->write_caps & CAP_STREAM_LZ) {
+		rs->write_plain = rs->write_msg_loaded;
+		rs->zwrite = lz_stream_alloc();
+		rs->zwrite_buf = tr_malloc(LZ_STREAM_MAX_HEADER + LZ_STREAM_BLOCK);
+	}
+}
 
-static MDB_val *encode_table_key(char *table, MDB_val *key)
+static void read_node_msg_from_buf(struct rstate *rs)
 {
-	size_t table_len = strlen(table);
+	struct message view;
+	struct message *msg = &view;
+	if (msg_view(rs->read_buf + rs->read_buf_start, rs->read_buf_size - rs->read_buf_start, msg)) {
+		rs->read_buf_loaded = 0;
+		return;
+	}
 
-	MDB_val *table_key = malloc(sizeof *table_key);
-	if (!table_key)
-		return NULL;
+	rs->read_buf_start += msg->size;
+	rs->read_buf_loaded = rs->read_buf_start < rs->read_buf_size;
 
-	table_key->mv_size = table_len + 1 + key->mv_size;
-	table_key->mv_data = malloc(table_key->mv_size);
-	if (!table_key->mv_data) {
-		free(table_key);
-		return NULL;
+	if (!rs->connect_node && msg_is_type(msg, "snap")) {
+		send_snapshot(rs, msg);
+		return;
 	}
 
-	memcpy(table_key->mv_data, table, table_len);
-	memset((uint8_t*)table_key->mv_data + table_len, 0, 1);
-	memcpy((uint8_t*)table_key->mv_data + 1 + table_len, key->mv_data, key->mv_size);
+	char *remote_node = read_node(msg);
+	if (!remote_node)
+		return;
 
-	return table_key;
+	if (node_acceptable(rs, remote_node)) {
+		rs->node_msg_received = 1;
+		rs->connect_failures = 0;
+		rs->remote_node = remote_node;
+		rs->sync_state = trlmdb_node_sync_pending(rs->env, remote_node) ? SYNC_PENDING : SYNC_NONE;
+		if (rs->registry && conn_register(rs->registry, rs) == EEXIST) {
+			log_stderr("There is another connection with %s\n", remote_node);
+			close_socket(rs);
+		}
+	} else {
+		log_fatal_err("The remote node name is not acceptable\n");
+	}
 }
 
-static void free_table_key(MDB_val *table_key)
+/* read_buf_compact moves the unparsed bytes to the start of the read buffer. The parsed bytes are
+ * only reclaimed when the end of the buffer is reached, so a partial message is moved at most once.
+ */
+static void read_buf_compact(struct rstate *rs)
 {
-	free(table_key->mv_data);
-	free(table_key);
+	memmove(rs->read_buf, rs->read_buf + rs->read_buf_start, rs->read_buf_size - rs->read_buf_start);
+	rs->read_buf_size -= rs->read_buf_start;
+	rs->read_buf_start = 0;
 }
 
-static int remove_table_prefix(MDB_val *table_key, MDB_val *key)
+/* read_buf_reserve makes room for size more bytes in the read buffer */
+static int read_buf_reserve(struct rstate *rs, uint64_t size)
 {
-	size_t table_len = strnlen(table_key->mv_data, table_key->mv_size);
-	if (table_len == table_key->mv_size)
-		return EINVAL;
-	
-	key->mv_size = table_key->mv_size - table_len - 1;
-	key->mv_data = (uint8_t*)table_key->mv_data + table_len + 1;
-
+	uint64_t cap = rs->read_buf_cap;
+	while (cap - rs->read_buf_size < size)
+		cap *= 2;
+	if (cap == rs->read_buf_cap)
+		return 0;
+
+	uint8_t *realloced = realloc(rs->read_buf, cap);
+	if (!realloced)
+		return ENOMEM;
+	rs->read_buf = realloced;
+	rs->read_buf_cap = cap;
 	return 0;
 }
 
-/* public functions for accessing the database */
-
-/* trlmdb_get looks up the key in the table.
- * The table name must be null terminated.
- * The return value is
- * 0 at success and value will contain the result.
- * MDB_NOTFOUND if the key was absent.
- * ENOMEM if the operation failed due to memory allocation failure.
+/* read_decompress appends the raw bytes of the whole blocks in zread_buf to the read buffer. At least
+ * one block is decompressed, and no more blocks once the read buffer has reached the read budget. The
+ * remaining blocks are decompressed after the read buffer has been stored, before the socket is read
+ * again.
  */
-
-int trlmdb_get(struct trlmdb_txn *txn, char *table, MDB_val *key, MDB_val *value)
+static void read_decompress(struct rstate *rs)
 {
-	MDB_val *table_key = encode_table_key(table, key);
-	if (!table_key)
-		return ENOMEM;
+	uint64_t offset = 0;
+	rs->zread_pending = 0;
+	for (;;) {
+		if (offset > 0 && rs->read_buf_size >= rs->read_budget) {
+			rs->zread_pending = 1;
+			break;
+		}
+		size_t consumed, raw_size;
+		uint8_t *raw;
+		int rc = lz_stream_decompress(rs->zread, rs->zread_buf + offset, rs->zread_size - offset, &consumed, &raw, &raw_size);
+		if (rc == ENOENT)
+			break;
+		if (rc || read_buf_reserve(rs, raw_size)) {
+			close_socket(rs);
+			return;
+		}
+		memcpy(rs->read_buf + rs->read_buf_size, raw, raw_size);
+		rs->read_buf_size += raw_size;
+		rs->read_buf_loaded = 1;
+		offset += consumed;
+	}
 
-        int rc = trlmdb_single_get(txn, table_key, value);
-	free_table_key(table_key);
+	memmove(rs->zread_buf, rs->zread_buf + offset, rs->zread_size - offset);
+	rs->zread_size -= offset;
+}
 
-	return rc;
+/* read_stream_start is called when the opts message ending at offset switches on stream compression.
+ * The bytes after the opts message are compressed.
+ */
+static void read_stream_start(struct rstate *rs, uint64_t offset)
+{
+	rs->zread = lz_stream_alloc();
+	rs->zread_size = rs->read_buf_size - offset;
+	rs->zread_cap = rs->zread_size > LZ_STREAM_BLOCK ? rs->zread_size : LZ_STREAM_BLOCK;
+	rs->zread_buf = tr_malloc(rs->zread_cap);
+	memcpy(rs->zread_buf, rs->read_buf + offset, rs->zread_size);
+	rs->read_buf_size = offset;
+	read_decompress(rs);
 }
 
-int trlmdb_put(struct trlmdb_txn *txn, char *table, MDB_val *key, MDB_val *value)
+/* Range reconciliation
+ *
+ * range-sum-message = "rsum" lo hi count(8) hash(8)
+ * range-result-message = "rres" lo hi result(1)
+ *
+ * When a node is added, all times are marked for it in db_node_time. Instead of a time message for
+ * each of them, the replicator first compares ranges of times with the remote node. A range has the
+ * times from lo to hi, excluding hi, and an empty bound means no bound. The hash of a range is the
+ * sum of a hash of each time in the 20 byte format. The remote node answers a range sum with 'm' if it
+ * has the same times in the range, and then both nodes remove the node-times in the range. Otherwise
+ * it answers 'd', and the replicator splits the range in RANGE_SYNC_PARTS ranges with about the same
+ * number of times. Ranges of at most RANGE_SYNC_LEAF times are left to the time messages, which are
+ * held back until all range sums are answered.
+ */
+
+static uint64_t range_time_hash(struct trlmdb_env *env, MDB_val *time)
 {
-	MDB_val *table_key = encode_table_key(table, key);
-	if (!table_key)
-		return ENOMEM;
+	uint8_t buf[TIME_MAX_SIZE];
+	size_t size = time_convert(buf, time->mv_data, time->mv_size, env_compact_time(env), 0);
 
-        int rc = trlmdb_single_put(txn, table_key, value);
-	free_table_key(table_key);
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= buf[i];
+		hash *= 1099511628211ULL;
+	}
 
-	return rc;
+	/* The hashes are summed, so the bits are mixed once more */
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
 }
 
-int trlmdb_del(struct trlmdb_txn *txn, char *table, MDB_val *key)
+/* range_cursor_first positions cursor on db_time_to_key at the first time of range */
+static int range_cursor_first(MDB_cursor *cursor, struct range *range, MDB_val *time)
 {
-	MDB_val *table_key = encode_table_key(table, key);
-	if (!table_key)
-		return ENOMEM;
-
-        int rc = trlmdb_single_del(txn, table_key);
-	free_table_key(table_key);
+	MDB_val key;
+	if (range->lo_size == 0)
+		return mdb_cursor_get(cursor, time, &key, MDB_FIRST);
+	*time = (MDB_val) {range->lo_size, range->lo};
+	return mdb_cursor_get(cursor, time, &key, MDB_SET_RANGE);
+}
 
-	return rc;
+static int range_contains(struct range *range, MDB_val *time)
+{
+	MDB_val hi = {range->hi_size, range->hi};
+	return range->hi_size == 0 || time_cmp(time, &hi) < 0;
 }
 
-int trlmdb_cursor_open(struct trlmdb_txn *txn, char *table, struct trlmdb_cursor **cursor)
+/* range_stats sets the count and hash of range */
+static int range_stats(struct trlmdb_txn *txn, struct range *range)
 {
-	*cursor = malloc(sizeof **cursor);
-	if (!*cursor) return ENOMEM; 
+	MDB_cursor *cursor;
+	int rc = mdb_cursor_open(txn->mdb_txn, txn->env->dbi_time_to_key, &cursor);
+	if (rc)
+		return rc;
 
-	(*cursor)->txn = txn;
-	(*cursor)->table = strdup(table);
-	return mdb_cursor_open(txn->mdb_txn, txn->env->dbi_key_to_time, &((*cursor)->mdb_cursor));
-}
+	range->count = 0;
+	range->hash = 0;
+	MDB_val time, key;
+	rc = range_cursor_first(cursor, range, &time);
+	while (rc == 0 && range_contains(range, &time)) {
+		range->count++;
+		range->hash += range_time_hash(txn->env, &time);
+		rc = mdb_cursor_get(cursor, &time, &key, MDB_NEXT);
+	}
 
-void trlmdb_cursor_close(struct trlmdb_cursor *cursor){
-	mdb_cursor_close(cursor->mdb_cursor);
-	free(cursor->table);
-	free(cursor);
+	mdb_cursor_close(cursor);
+	return rc == MDB_NOTFOUND ? 0 : rc;
 }
 
-int trlmdb_cursor_first(struct trlmdb_cursor *cursor)
+/* range_split splits range, with its count, in parts and returns the number of parts */
+static int range_split(struct trlmdb_txn *txn, struct range *range, struct range *parts)
 {
-	size_t table_len = strlen(cursor->table);
-	MDB_val key = {table_len, cursor->table};
-	MDB_val time_val;
-	
-	int rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_SET_RANGE);
-	while (!rc && !time_is_put(time_val.mv_data)) {
-		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_NEXT);
+	MDB_cursor *cursor;
+	if (mdb_cursor_open(txn->mdb_txn, txn->env->dbi_time_to_key, &cursor))
+		return 0;
+
+	uint64_t per_part = (range->count + RANGE_SYNC_PARTS - 1) / RANGE_SYNC_PARTS;
+	int nparts = 0;
+	struct range *part = parts;
+	memcpy(part->lo, range->lo, range->lo_size);
+	part->lo_size = range->lo_size;
+	part->count = 0;
+	part->hash = 0;
+
+	MDB_val time, key;
+	int rc = range_cursor_first(cursor, range, &time);
+	while (rc == 0 && range_contains(range, &time)) {
+		if (part->count == per_part && nparts < RANGE_SYNC_PARTS - 1) {
+			memcpy(part->hi, time.mv_data, time.mv_size);
+			part->hi_size = time.mv_size;
+			nparts++;
+			part++;
+			memcpy(part->lo, time.mv_data, time.mv_size);
+			part->lo_size = time.mv_size;
+			part->count = 0;
+			part->hash = 0;
+		}
+		part->count++;
+		part->hash += range_time_hash(txn->env, &time);
+		rc = mdb_cursor_get(cursor, &time, &key, MDB_NEXT);
 	}
-		
-	if (rc)
-		return rc;
+	memcpy(part->hi, range->hi, range->hi_size);
+	part->hi_size = range->hi_size;
 
-	if (table_len + 1 > key.mv_size || memcmp(cursor->table, key.mv_data, table_len + 1))
-		return MDB_NOTFOUND;
+	mdb_cursor_close(cursor);
+	return nparts + 1;
+}
+
+/* range_from_msg reads the bounds of a range message in the time format of caps */
+static int range_from_msg(struct trlmdb_env *env, unsigned int caps, struct message *msg, struct range *range)
+{
+	uint8_t *data;
+	uint64_t size;
+	int compact = (caps & CAP_COMPACT_TIME) != 0;
+
+	msg_get_elem(msg, 1, &data, &size);
+	range->lo_size = size == 0 ? 0 : time_convert(range->lo, data, size, compact, env_compact_time(env));
+	if (size != 0 && range->lo_size == 0)
+		return EINVAL;
+
+	msg_get_elem(msg, 2, &data, &size);
+	range->hi_size = size == 0 ? 0 : time_convert(range->hi, data, size, compact, env_compact_time(env));
+	if (size != 0 && range->hi_size == 0)
+		return EINVAL;
 
 	return 0;
 }
 
-int trlmdb_cursor_last(struct trlmdb_cursor *cursor)
+/* load_range_msg loads a range sum, or a range result if result is not 0, for the remote node */
+static void load_range_msg(struct rstate *rs, struct range *range, uint8_t result)
 {
-	size_t table_len = strlen(cursor->table);
-	uint8_t *table_successor = malloc(table_len + 1);
-	if (!table_successor)
-		return ENOMEM;
-
-	memcpy(table_successor, cursor->table, table_len);
-	table_successor[table_len] = 1;
+	int compact = env_compact_time(rs->env);
+	int wire_compact = (rs->write_caps & CAP_COMPACT_TIME) != 0;
+	uint8_t lo[TIME_MAX_SIZE], hi[TIME_MAX_SIZE];
+	size_t lo_size = range->lo_size == 0 ? 0 : time_convert(lo, range->lo, range->lo_size, compact, wire_compact);
+	size_t hi_size = range->hi_size == 0 ? 0 : time_convert(hi, range->hi, range->hi_size, compact, wire_compact);
 
-	MDB_val key = {table_len + 1, table_successor};
-	MDB_val time_val;
-	
-	int rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_SET_RANGE);
-	if (rc) {
-		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_LAST);
-		if (rc)
-			return rc;
+	struct message *msg = write_msg_next(rs);
+	msg_reset(msg);
+	msg_append(msg, (uint8_t*) (result ? "rres" : "rsum"), 4);
+	msg_append(msg, lo, lo_size);
+	msg_append(msg, hi, hi_size);
+	if (result) {
+		msg_append(msg, &result, 1);
 	} else {
-		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_PREV);
-		if (rc)
-			return rc;
-	}
-		
-	while (!rc && !time_is_put(time_val.mv_data)) {
-		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_PREV);
+		uint8_t buf[8];
+		encode_uint64(buf, range->count);
+		msg_append(msg, buf, 8);
+		encode_uint64(buf, range->hash);
+		msg_append(msg, buf, 8);
 	}
-		
-	if (rc)
-		return rc;
-
-	if (table_len + 1 > key.mv_size || memcmp(cursor->table, key.mv_data, table_len + 1))
-		return MDB_NOTFOUND;
 
-	return 0;
+	if (rs->write_caps & CAP_WIRE_V2)
+		msg_to_v2(msg);
+	write_msg_push(rs);
 }
 
-int trlmdb_cursor_next(struct trlmdb_cursor *cursor)
+/* start_range_sync sends the range sum of all times, if the remote node knows range sums */
+static void start_range_sync(struct rstate *rs)
 {
-	size_t table_len = strlen(cursor->table);
-	MDB_val key;
-	MDB_val time_val;
+	struct trlmdb_txn *txn;
+	if (trlmdb_txn_begin(rs->env, 0, &txn))
+		return;
 
-	int rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_NEXT);
-	while (!rc && !time_is_put(time_val.mv_data)) {
-		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_NEXT);
+	if (rs->write_caps & CAP_RANGE_SYNC) {
+		struct range range = {.lo_size = 0, .hi_size = 0};
+		if (range_stats(txn, &range) == 0) {
+			load_range_msg(rs, &range, 0);
+			rs->sync_outstanding = 1;
+			rs->sync_state = SYNC_RUNNING;
+		}
+	} else {
+		trlmdb_node_sync_done(txn, rs->remote_node);
+		rs->sync_state = SYNC_NONE;
 	}
-		
+
+	trlmdb_txn_commit(txn);
+}
+
+/* read_range_sum answers a range sum and removes the node-times of a matching range */
+static int read_range_sum(struct rstate *rs, struct trlmdb_txn *txn, struct message *msg)
+{
+	if (msg_get_count(msg) != 5 || !(rs->read_caps & CAP_RANGE_SYNC))
+		return EINVAL;
+
+	struct range range;
+	if (range_from_msg(rs->env, rs->read_caps, msg, &range))
+		return EINVAL;
+
+	uint8_t *data;
+	uint64_t size;
+	msg_get_elem(msg, 3, &data, &size);
+	if (size != 8)
+		return EINVAL;
+	uint64_t count = decode_uint64(data);
+	msg_get_elem(msg, 4, &data, &size);
+	if (size != 8)
+		return EINVAL;
+	uint64_t hash = decode_uint64(data);
+
+	int rc = range_stats(txn, &range);
 	if (rc)
 		return rc;
 
-	if (table_len + 1 > key.mv_size || memcmp(cursor->table, key.mv_data, table_len + 1))
-		return MDB_NOTFOUND;
+	int match = range.count == count && range.hash == hash;
+	if (match) {
+		MDB_val lo = {range.lo_size, range.lo}, hi = {range.hi_size, range.hi};
+		rc = trlmdb_node_time_del_range(txn, rs->remote_node, &lo, &hi);
+		if (rc)
+			return rc;
+	}
 
+	load_range_msg(rs, &range, match ? 'm' : 'd');
 	return 0;
 }
 
-int trlmdb_cursor_prev(struct trlmdb_cursor *cursor)
+/* read_range_result removes the node-times of a matching range and splits a differing range */
+static int read_range_result(struct rstate *rs, struct trlmdb_txn *txn, struct message *msg)
 {
-	size_t table_len = strlen(cursor->table);
-	MDB_val key;
-	MDB_val time_val;
+	if (msg_get_count(msg) != 4 || rs->sync_state != SYNC_RUNNING)
+		return EINVAL;
 
-	int rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_PREV);
-	while (!rc && !time_is_put(time_val.mv_data)) {
-		rc = mdb_cursor_get(cursor->mdb_cursor, &key, &time_val, MDB_PREV);
+	struct range range;
+	if (range_from_msg(rs->env, rs->read_caps, msg, &range))
+		return EINVAL;
+
+	uint8_t *data;
+	uint64_t size;
+	msg_get_elem(msg, 3, &data, &size);
+	if (size != 1)
+		return EINVAL;
+
+	int rc = 0;
+	if (data[0] == 'm') {
+		MDB_val lo = {range.lo_size, range.lo}, hi = {range.hi_size, range.hi};
+		rc = trlmdb_node_time_del_range(txn, rs->remote_node, &lo, &hi);
+	} else {
+		rc = range_stats(txn, &range);
+		if (!rc && range.count > RANGE_SYNC_LEAF) {
+			struct range parts[RANGE_SYNC_PARTS];
+			int nparts = range_split(txn, &range, parts);
+			for (int i = 0; i < nparts; i++) {
+				load_range_msg(rs, parts + i, 0);
+			}
+			rs->sync_outstanding += nparts;
+		}
 	}
-		
-	if (rc)
-		return rc;
-
-	if (table_len + 1 > key.mv_size || memcmp(cursor->table, key.mv_data, table_len + 1))
-		return MDB_NOTFOUND;
 
-	return 0;
+	rs->sync_outstanding--;
+	if (rs->sync_outstanding == 0) {
+		trlmdb_node_sync_done(txn, rs->remote_node);
+		rs->sync_state = SYNC_NONE;
+		rs->end_of_write_loop = 0;
+	}
+	return rc;
 }
 
-int trlmdb_cursor_get(struct trlmdb_cursor *cursor, MDB_val *key, MDB_val *val)
+/* Acknowledgements
+ *
+ * ack-message = "ackn" count(8)
+ *
+ * A replicator that has switched on the capability "acks" remembers the time messages it sends.
+ * The remote node counts the time messages it reads after the "opts" message, and answers a batch
+ * of them with the total count in a single ack message after the batch is committed. The ack replaces
+ * the "tt" message for each time: the remote node removes a time from db_node_time when it reads
+ * "tf", and the sender removes the acknowledged times with one cursor. A time message that can not
+ * be read closes the connection, since the ack would cover it, and the times are sent again after
+ * the reconnect.
+ */
+
+/* sent_time_push remembers the time message of the last loaded time until it is acknowledged */
+static void sent_time_push(struct rstate *rs, int clear)
 {
-	MDB_val table_key, time_val;
-	int rc = mdb_cursor_get(cursor->mdb_cursor, &table_key, &time_val, MDB_GET_CURRENT);
-	if (rc || !time_is_put(time_val.mv_data))
-		return MDB_NOTFOUND;
+	if (rs->sent_count == rs->sent_cap) {
+		uint64_t cap = rs->sent_cap ? 2 * rs->sent_cap : 1024;
+		struct sent_time *ring = tr_malloc(cap * sizeof *ring);
+		for (uint64_t i = 0; i < rs->sent_count; i++) {
+			ring[i] = rs->sent[(rs->sent_head + i) % rs->sent_cap];
+		}
+		free(rs->sent);
+		rs->sent = ring;
+		rs->sent_cap = cap;
+		rs->sent_head = 0;
+	}
 
-	rc = remove_table_prefix(&table_key, key);
-	if (rc)
-		return rc;
-	
-	return mdb_get(cursor->txn->mdb_txn, cursor->txn->env->dbi_time_to_data, &time_val, val);
+	struct sent_time *sent = rs->sent + (rs->sent_head + rs->sent_count) % rs->sent_cap;
+	memcpy(sent->time, rs->write_time[rs->write_lane], rs->write_time_size[rs->write_lane]);
+	sent->size = rs->write_time_size[rs->write_lane];
+	sent->clear = clear;
+	rs->sent_count++;
 }
 
-/* time message */
-
-/* read_time_msg reads the msg, verifies that it is a time msg, and inserts the information in the database */
-static int read_time_msg(struct trlmdb_txn *txn, char *remote_node, struct message *msg)
+/* read_ack_msg adds the node-times of the acknowledged time messages to ack_dels, which are deleted
+ * in the txn of the read buffer.
+ */
+static int read_ack_msg(struct rstate *rs, struct message *msg)
 {
-	uint64_t count = msg_get_count(msg);
-	if (count < 3 || count > 5)
-		return EINVAL;
-
 	uint8_t *data;
 	uint64_t size;
-	
-	msg_get_elem(msg, 0, &data, &size);
-
-	if (size != 4 || memcmp(data, "time", 4) != 0)
+	if (msg_get_count(msg) != 2 || !(rs->write_caps & CAP_ACKS) || msg_get_elem(msg, 1, &data, &size) || size != 8)
 		return EINVAL;
 
-	uint8_t *flag;
-	msg_get_elem(msg, 1, &flag, &size);
-	if (size != 2 || (flag[0] != 't' && flag[0] != 'f') || (flag[1] != 't' && flag[1] != 'f'))
-		return EINVAL;
-	
-	uint8_t *time;
-	msg_get_elem(msg, 2, &time, &size);
-	if (size != 20)
+	uint64_t count = decode_uint64(data);
+	if (count < rs->sent_acked || count - rs->sent_acked > rs->sent_count)
 		return EINVAL;
 
-	int is_put = time_is_put(time);
-	
-	MDB_val key;
-	int key_absent = trlmdb_get_key_for_time(txn, time, &key);
-	
-	if (key_absent) {
-		if (count < 4)
-			return EINVAL;
+	int rc = 0;
+	size_t node_len = strlen(rs->remote_node);
+	for (; rs->sent_acked < count; rs->sent_acked++) {
+		struct sent_time *sent = rs->sent + rs->sent_head;
+		rs->sent_head = (rs->sent_head + 1) % rs->sent_cap;
+		rs->sent_count--;
+		if (!sent->clear)
+			continue;
 
-		uint8_t *key;
-		uint64_t key_size;
-		msg_get_elem(msg, 3, &key, &key_size); 
-		MDB_val key_val = {key_size, key};
+		MDB_val time_val = {sent->size, sent->time};
+		MDB_val node_time;
+		rc = encode_node_time(rs->env, rs->remote_node, node_len, &time_val, &node_time);
+		if (rc)
+			break;
+		rc = key_list_add(&rs->ack_dels, &node_time);
+		free(node_time.mv_data);
+		if (rc)
+			break;
+	}
 
-		if (is_put && count == 5) {
-			uint8_t *data;
-			uint64_t data_size;
-			msg_get_elem(msg, 4, &data, &data_size); 
+	return rc;
+}
 
-			MDB_val data_val = {data_size, data};
-			trlmdb_insert_time_key_data(txn->env, txn->mdb_txn, time, &key_val, &data_val);
-		} else {
-			trlmdb_insert_time_key_data(txn->env, txn->mdb_txn, time, &key_val, NULL);
-		}
-	}
-	
-	return trlmdb_node_time_update(txn, remote_node, time, flag);	
+static void write_ack(struct message *msg, uint64_t count)
+{
+	uint8_t count_buf[8];
+	encode_uint64(count_buf, count);
+
+	msg_reset(msg);
+	msg_append(msg, (uint8_t*) "ackn", 4);
+	msg_append(msg, count_buf, 8);
 }
 
-/* load_time_message reads from the database and writes a new message that can be sent on the network
- * It finds the next time to send to node.
- * It returns 0 if a msg is loaded, MDB_NOTFOUND if time is the last entry in node_time for that node 
- * and ENOMEM if there was a memory problem.
- */ 
-static int load_time_msg(struct trlmdb_txn *txn, uint8_t *time, char *node, struct message *msg)
+/* send_ack_msg acknowledges the time messages that are read and committed */
+static void send_ack_msg(struct rstate *rs)
 {
-	size_t node_len = strlen(node);
+	struct message *msg = write_msg_next(rs);
+	write_ack(msg, rs->read_time_count);
+	if (rs->write_caps & CAP_WIRE_V2)
+		msg_to_v2(msg);
+	write_msg_push(rs);
+	rs->read_time_acked = rs->read_time_count;
+}
 
-	uint8_t *node_time = encode_node_time(node, node_len, time);
-	if (!node_time)
-		return ENOMEM;
+/* read_record stores a time or chunk message, and counts a time message in count if the remote node
+ * has switched on acks. It returns 1 if the connection must be closed: only the acks of "tf"
+ * messages remove node-times, so only they must be stored.
+ */
+static int read_record(struct trlmdb_txn *txn, char *remote_node, unsigned int caps, struct message *msg, uint64_t *count)
+{
+	if (msg_is_type(msg, "chnk")) {
+		read_chunk_msg(txn, caps, msg);
+		return 0;
+	}
 
-	MDB_val node_time_val = {node_len + 20, node_time};
-	MDB_cursor *cursor;
-        mdb_cursor_open(txn->mdb_txn, txn->env->dbi_node_time, &cursor);
+	int rc = read_time_msg(txn, remote_node, caps, msg);
+	if (!(caps & CAP_ACKS) || !msg_is_type(msg, "time"))
+		return 0;
 
-	MDB_val flag_val;
-	int rc = mdb_cursor_get(cursor, &node_time_val, &flag_val, MDB_SET_RANGE);
-	if (rc) {
-		free(node_time);
-		return rc;
+	(*count)++;
+	uint8_t *flag;
+	uint64_t size;
+	if (rc && msg_get_elem(msg, 1, &flag, &size) == 0 && size >= 2 && flag[0] == 't' && flag[1] == 'f') {
+		log_stderr("A time message from %s failed: %s\n", remote_node, mdb_strerror(rc));
+		return 1;
 	}
+	return 0;
+}
 
-	if (node_time_val.mv_size == node_len + 20 && memcmp(node_time_val.mv_data, node_time, node_len + 20) == 0) {
-		rc = mdb_cursor_get(cursor, &node_time_val, &flag_val, MDB_NEXT);
-		if (rc) {
-			free(node_time);
-			return rc;
-		}
+/* msg_from_wire sets msg to the whole message at the start of data in the wire format of caps. A v1
+ * message is a view into data and a v2 message is decoded into decoded. It returns 1 if the message
+ * is incomplete, and an error code if it can not be decoded.
+ */
+static int msg_from_wire(unsigned int caps, uint8_t *data, uint64_t size, uint64_t *msg_size, struct message *view, struct message *decoded, struct message **msg)
+{
+	if (caps & CAP_WIRE_V2) {
+		*msg = decoded;
+		return msg_decode_v2(data, size, msg_size, decoded);
 	}
 
-	free(node_time);
-	mdb_cursor_close(cursor);
-	
-	if (node_time_val.mv_size != node_len + 20 || memcmp(node_time_val.mv_data, node, node_len) != 0)
-		return MDB_NOTFOUND;
+	*msg = view;
+	if (msg_view(data, size, view))
+		return 1;
+	*msg_size = view->size;
+	return 0;
+}
 
-	memcpy(time, (uint8_t*)node_time_val.mv_data + node_len, 20);
+/* read_frame stores the records of a frame, which are time and chunk messages. The v2 records are
+ * decoded into record_msg. It returns 1 if the frame is malformed or a record must close the connection,
+ * since the acks would count the records after it wrong.
+ */
+static int read_frame(struct trlmdb_txn *txn, char *remote_node, unsigned int caps, struct message *frame, struct message *record_msg, uint64_t *count)
+{
+	if (!(caps & CAP_FRAMES))
+		return 1;
 
-	MDB_val time_val = {20, time};
-	
-	MDB_val key;
-	int key_known = !mdb_get(txn->mdb_txn, txn->env->dbi_time_to_key, &time_val, &key);
+	uint64_t nfields = msg_get_count(frame);
+	for (uint64_t i = 1; i < nfields; i++) {
+		uint8_t *data;
+		uint64_t size, record_size;
+		msg_get_elem(frame, i, &data, &size);
+		struct message view;
+		struct message *record;
+		if (msg_from_wire(caps, data, size, &record_size, &view, record_msg, &record) || record_size != size)
+			return 1;
+		if (read_record(txn, remote_node, caps, record, count))
+			return 1;
+	}
 
-	uint8_t out_flag[2];
-	out_flag[0] = key_known ? 't' : 'f';
-	out_flag[1] = *(uint8_t*)flag_val.mv_data;
+	return 0;
+}
 
-	msg_reset(msg);
+/* A time, chunk or frame message in the read buffer, in the wire format of caps */
+struct apply_rec {
+	uint64_t offset;
+	uint64_t size;
+	unsigned int caps;
+};
 
-	rc = msg_append(msg, (uint8_t*) "time", 4);
-	if (rc)
-		return rc;
+/* apply_rec_add leaves the message at offset in the read buffer to the applier */
+static void apply_rec_add(struct rstate *rs, uint64_t offset, uint64_t size)
+{
+	if (rs->napply_recs == rs->apply_recs_cap) {
+		rs->apply_recs_cap = rs->apply_recs_cap ? 2 * rs->apply_recs_cap : 256;
+		rs->apply_recs = tr_realloc(rs->apply_recs, rs->apply_recs_cap * sizeof *rs->apply_recs);
+	}
+	rs->apply_recs[rs->napply_recs++] = (struct apply_rec) {offset, size, rs->read_caps};
+}
 
-	rc = msg_append(msg, out_flag, 2);
-	if (rc)
-		return rc;
+/* read_time_msgs handles the whole messages in the read buffer in txn. The messages are parsed in
+ * place: a v1 message is a view into the read buffer and a v2 message is decoded into the reused
+ * read_msg. The messages after a failed time message are left, since the connection is closed.
+ *
+ * With txn NULL, the messages are handed to the applier: the connection handles the caps, opts and ack
+ * messages itself and leaves the time, chunk and frame messages in apply_recs. A range message needs a
+ * txn of the connection, so the messages before it are left to the applier first, and the range
+ * message starts a txn of its own.
+ */
+static void read_time_msgs(struct rstate *rs, struct trlmdb_txn *txn)
+{
+	struct message view;
+	struct message *msg;
+	uint64_t msg_index = rs->read_buf_start;
+	struct trlmdb_txn *own_txn = NULL;
 
-	rc = msg_append(msg, time, 20);
-	if (rc)
-		return rc;
+	while (msg_index < rs->read_buf_size && !rs->read_time_failed && rs->socket_fd != -1) {
+		uint64_t msg_size;
+		int rc = msg_from_wire(rs->read_caps, rs->read_buf + msg_index, rs->read_buf_size - msg_index, &msg_size, &view, rs->read_msg, &msg);
+		if (rc == 1)
+			break;
+		if (rc) {
+			log_stderr("A message from %s could not be decoded: %s\n", rs->remote_node, strerror(rc));
+			rs->read_time_failed = 1;
+			break;
+		}
 
-	if (out_flag[1] == 'f' && key_known) {
-		rc = msg_append(msg, (uint8_t*)key.mv_data, key.mv_size);
-		if (rc)
-			return rc;
-	
-		if (time_is_put(time)) {
-			MDB_val data;
-			rc = mdb_get(txn->mdb_txn, txn->env->dbi_time_to_data, &time_val, &data);
-			if (rc)
-				return rc;
+		int is_range = msg_is_type(msg, "rsum") || msg_is_type(msg, "rres");
+		if (is_range && !txn) {
+			if (rs->napply_recs > 0 || rs->ack_dels.count > 0) {
+				rs->read_buf_more = 1;
+				break;
+			}
+			if (trlmdb_txn_begin(rs->env, 0, &own_txn)) {
+				rs->read_time_failed = 1;
+				break;
+			}
+			txn = own_txn;
+		}
 
-			rc = msg_append(msg, (uint8_t*)data.mv_data, data.mv_size);
-			if (rc)
-				return rc;
+		unsigned int caps;
+		if (read_caps(msg, "caps", &caps) == 0) {
+			rs->remote_caps = caps;
+			rs->caps_msg_received = 1;
+		} else if (read_caps(msg, "opts", &caps) == 0) {
+			rs->read_caps = caps & env_caps(rs->env);
+			if ((rs->read_caps & CAP_STREAM_LZ) && !rs->zread)
+				read_stream_start(rs, msg_index + msg_size);
+		} else if (msg_is_type(msg, "rsum")) {
+			read_range_sum(rs, txn, msg);
+		} else if (msg_is_type(msg, "rres")) {
+			read_range_result(rs, txn, msg);
+		} else if (msg_is_type(msg, "ackn")) {
+			read_ack_msg(rs, msg);
+		} else if (!txn) {
+			/* A frame that is not switched on would be counted wrong by the acks */
+			if (msg_is_type(msg, "frme") && !(rs->read_caps & CAP_FRAMES)) {
+				rs->read_time_failed = 1;
+				break;
+			}
+			apply_rec_add(rs, msg_index, msg_size);
+		} else if (msg_is_type(msg, "frme")) {
+			rs->read_time_failed = read_frame(txn, rs->remote_node, rs->read_caps, msg, rs->read_record_msg, &rs->read_time_count);
+		} else {
+			rs->read_time_failed = read_record(txn, rs->remote_node, rs->read_caps, msg, &rs->read_time_count);
 		}
+		if (rs->read_time_failed)
+			break;
+		msg_index += msg_size;
 	}
+	rs->read_buf_start = msg_index;
 
-	if (out_flag[0] == 't' && out_flag[1] == 't') {
-		mdb_del(txn->mdb_txn, txn->env->dbi_node_time, &node_time_val, NULL); 
+	if (txn && rs->ack_dels.count > 0) {
+		if (node_time_del_keys(rs->env, txn->mdb_txn, &rs->ack_dels))
+			rs->read_time_failed = 1;
+		rs->ack_dels.size = 0;
+		rs->ack_dels.count = 0;
 	}
+	if (own_txn && trlmdb_txn_commit(own_txn))
+		rs->read_time_failed = 1;
+}
 
-	return 0;
+/* read_buf_stored reclaims the read buffer when all its messages are stored */
+static void read_buf_stored(struct rstate *rs)
+{
+	rs->read_buf_loaded = rs->read_buf_more;
+	rs->read_buf_more = 0;
+	if (rs->read_buf_start == rs->read_buf_size) {
+		rs->read_buf_start = 0;
+		rs->read_buf_size = 0;
+		read_buf_shrink(rs);
+	}
 }
 
-/* The replicator server 
- * replicator(struct conf_info*) is called by main to start the replicator
-*/
+/* applier
+ *
+ * With the option group_commit, the connections hand their read buffers to one applier thread
+ * instead of committing them in txns of their own. The applier takes all buffers that are handed over
+ * while it commits, up to APPLY_MAX_JOBS buffers or APPLY_MAX_BYTES bytes, and handles them in one
+ * txn. A connection waits for the commit of its buffer and then sends its ack. With several remote
+ * nodes, the commits and fsyncs are shared instead of taking turns on the writer lock.
+ *
+ * The connection parses its read buffer and handles the messages that change its own state before it
+ * hands the buffer over, so the applier only stores the time and chunk messages, and deletes the
+ * node-times of the acks. The results are kept in the job.
+ *
+ * A connection of an event thread does not wait. The applier writes the wake_fd of the event thread
+ * after the commit, and the event thread runs the connection again.
+ */
 
-static void *replicator_loop(void *arg);
+struct apply_job {
+	struct rstate *rs;
+	int done;
+	int rc;
+	int wake_fd;  /* written when the job is done, or -1 */
+	uint64_t count;  /* the time messages that are counted by the acks */
+	int failed;  /* a time message must close the connection */
+	struct apply_job *next;
+};
 
-void replicator(struct conf_info *conf_info)
-{
-	int rc = 0;
+struct applier {
 	struct trlmdb_env *env;
+	struct message *msg;  /* the decoded v2 message */
+	struct message *record_msg;  /* the decoded v2 record of a frame */
+	pthread_mutex_t mutex;
+	pthread_cond_t job_cond;  /* signals a new job */
+	pthread_cond_t done_cond;  /* signals finished jobs */
+	struct apply_job *head;
+	struct apply_job *tail;
+};
 
-	rc = trlmdb_env_create(&env);
-	if (rc) {
-		log_stderr("The lmdb environment could not be created");
-		exit(1);
-	}
-	
-	rc = trlmdb_env_open(env, conf_info->database, 0, 0644);
-	if (rc) {
-		log_stderr("The database could not be opened");
-		exit(1);
-	}
-
-	for (int i = 0; i < conf_info->naccept; i++) {
-		char *node = conf_info->accept_node[i];
+/* apply_job_bytes returns the bytes of the messages that the job stores */
+static uint64_t apply_job_bytes(struct apply_job *job)
+{
+	struct rstate *rs = job->rs;
+	if (rs->napply_recs == 0)
+		return 0;
+	struct apply_rec *last = rs->apply_recs + rs->napply_recs - 1;
+	return last->offset + last->size - rs->apply_recs[0].offset;
+}
 
-		int rc = trlmdb_node_add(env, node);
-		if (rc)
-			log_mdb_err(rc);
+/* applier_take removes the next batch of jobs from the queue */
+static struct apply_job *applier_take(struct applier *applier)
+{
+	pthread_mutex_lock(&applier->mutex);
+	while (!applier->head)
+		pthread_cond_wait(&applier->job_cond, &applier->mutex);
+
+	struct apply_job *batch = applier->head;
+	struct apply_job *last = batch;
+	int njobs = 1;
+	uint64_t nbytes = apply_job_bytes(last);
+	while (last->next && njobs < APPLY_MAX_JOBS && nbytes < APPLY_MAX_BYTES) {
+		last = last->next;
+		njobs++;
+		nbytes += apply_job_bytes(last);
 	}
+	applier->head = last->next;
+	if (!applier->head)
+		applier->tail = NULL;
+	last->next = NULL;
+	pthread_mutex_unlock(&applier->mutex);
 
-	pthread_t *threads;
-	if (conf_info->nconnect > 0) {
-		threads = calloc(conf_info->nconnect, sizeof threads);
+	return batch;
+}
+
+/* applier_store stores the messages that the connection of job has left in apply_recs, and deletes
+ * the node-times of its acks. The connection is not changed.
+ */
+static void applier_store(struct applier *applier, struct trlmdb_txn *txn, struct apply_job *job)
+{
+	struct rstate *rs = job->rs;
+	for (int i = 0; i < rs->napply_recs && !job->failed; i++) {
+		struct apply_rec *rec = rs->apply_recs + i;
+		struct message view;
+		uint64_t msg_size;
+		struct message *msg;
+		if (msg_from_wire(rec->caps, rs->read_buf + rec->offset, rec->size, &msg_size, &view, applier->msg, &msg)) {
+			job->failed = 1;
+		} else if (msg_is_type(msg, "frme")) {
+			job->failed = read_frame(txn, rs->remote_node, rec->caps, msg, applier->record_msg, &job->count);
+		} else {
+			job->failed = read_record(txn, rs->remote_node, rec->caps, msg, &job->count);
+		}
 	}
 
-	for (int i = 0; i < conf_info->nconnect; i++) {
-		char *node = conf_info->connect_node[i];
+	if (node_time_del_keys(applier->env, txn->mdb_txn, &rs->ack_dels))
+		job->failed = 1;
+}
 
-		int rc = trlmdb_node_add(env, node);
-		if (rc)
-			log_mdb_err(rc);
-		
-		struct rstate *rs = rstate_alloc_init(env, conf_info);
-		if (!rs)
-			log_enomem();
+/* apply_job_finish takes the results of a job that is done */
+static int apply_job_finish(struct rstate *rs, struct apply_job *job)
+{
+	rs->read_time_count += job->count;
+	if (job->failed)
+		rs->read_time_failed = 1;
+	rs->napply_recs = 0;
+	rs->ack_dels.size = 0;
+	rs->ack_dels.count = 0;
+	return job->rc;
+}
 
-		rs->connect_now = 1;
-		rs->connect_node = node;
-		char *address = conf_info->connect_address[i];
-		char *colon = strchr(address, ':');
+/* The applier thread start routine */
+static void *applier_loop(void *arg)
+{
+	struct applier *applier = arg;
 
-		if (colon) {
-			rs->connect_hostname = strndup(address, colon - address);
-			rs->connect_servname = strndup(colon + 1, address + strlen(address) - colon - 1);
-		} else {
-			rs->connect_hostname = strdup(address);
-			rs->connect_servname = strdup("80");
+	for (;;) {
+		struct apply_job *batch = applier_take(applier);
+
+		struct trlmdb_txn *txn;
+		int rc = trlmdb_txn_begin(applier->env, 0, &txn);
+		if (!rc) {
+			for (struct apply_job *job = batch; job; job = job->next)
+				applier_store(applier, txn, job);
+			rc = trlmdb_txn_commit(txn);
 		}
 
-		pthread_attr_t attr;
-		pthread_attr_init(&attr);
-		pthread_t thread;
-
-		if (pthread_create(&thread, &attr, replicator_loop, rs) != 0) {
-			printf("error creating thread\n");
-			rstate_free(rs);
-			exit(1);
+		uint64_t one = 1;
+		pthread_mutex_lock(&applier->mutex);
+		for (struct apply_job *job = batch; job; job = job->next) {
+			job->rc = rc;
+			job->done = 1;
+			if (job->wake_fd != -1 && write(job->wake_fd, &one, sizeof one) != sizeof one && errno != EAGAIN)
+				perror("applier");
 		}
-
-		threads[i] = thread;
+		pthread_cond_broadcast(&applier->done_cond);
+		pthread_mutex_unlock(&applier->mutex);
 	}
 
-	if (conf_info->port) {
-		int listen_fd = create_listener("localhost", conf_info->port);
-		printf("listen_fd = %d\n", listen_fd);
-		if (listen_fd != -1)
-			accept_loop(listen_fd, env, conf_info, replicator_loop);
-	}
+	return NULL;
+}
 
-	for (int i = 0; i < conf_info->nconnect; i++) {
-		pthread_join(threads[i], NULL);
-	}
+static struct applier *applier_create(struct trlmdb_env *env)
+{
+	struct applier *applier = tr_malloc(sizeof *applier);
+	applier->env = env;
+	applier->msg = msg_alloc_init(256);
+	applier->record_msg = msg_alloc_init(256);
+	pthread_mutex_init(&applier->mutex, NULL);
+	pthread_cond_init(&applier->job_cond, NULL);
+	pthread_cond_init(&applier->done_cond, NULL);
+	applier->head = NULL;
+	applier->tail = NULL;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, applier_loop, applier))
+		log_fatal_err("error creating the applier thread\n");
+	pthread_detach(thread);
+
+	return applier;
 }
 
-/* event handlers in the replicator loop */
+/* applier_add hands job to the applier. The caller holds the mutex */
+static void applier_add(struct applier *applier, struct apply_job *job)
+{
+	if (applier->tail)
+		applier->tail->next = job;
+	else
+		applier->head = job;
+	applier->tail = job;
+	pthread_cond_signal(&applier->job_cond);
+}
 
-static void connect_to_remote(struct rstate *rs)
+/* applier_run hands the read buffer of rs to the applier and returns the result of its commit */
+static int applier_run(struct applier *applier, struct rstate *rs)
 {
-	rs->node_msg_sent = 0;
-	rs->node_msg_received = 0;
-	rs->connect_now = 0;
-	rs->write_msg_loaded = 0;
-	rs->read_buf_size = 0;
-	rs->read_buf_loaded = 0;
-	
-	rs->socket_fd = create_connection(rs->connect_hostname, rs->connect_servname);
+	struct apply_job job = {rs, 0, 0, -1, 0, 0, NULL};
+
+	pthread_mutex_lock(&applier->mutex);
+	applier_add(applier, &job);
+	while (!job.done)
+		pthread_cond_wait(&applier->done_cond, &applier->mutex);
+	pthread_mutex_unlock(&applier->mutex);
+
+	return apply_job_finish(rs, &job);
 }
 
-static void send_node_msg(struct rstate *rs)
+static void event_idle(struct rstate *rs, int timeout);
+
+/* apply_job_pending returns 1 while the applier has the read buffer of rs. The event thread does not
+ * touch the connection meanwhile, since the applier handles its messages.
+ */
+static int apply_job_pending(struct rstate *rs)
 {
-	write_node(rs->write_msg[0], rs->node);
-	rs->node_msg_sent = 1;
-	rs->write_msg_loaded = 1;
+	if (!rs->apply_job)
+		return 0;
+
+	pthread_mutex_lock(&rs->applier->mutex);
+	int done = rs->apply_job->done;
+	pthread_mutex_unlock(&rs->applier->mutex);
+	return !done;
 }
 
-static void read_node_msg_from_buf(struct rstate *rs)
+/* applier_poll hands the read buffer of an event thread connection to the applier, or checks the
+ * handed over buffer. It returns EAGAIN until the buffer is committed, and then the result of the
+ * commit. The socket is removed from epoll meanwhile, since the applier uses the connection.
+ */
+static int applier_poll(struct applier *applier, struct rstate *rs)
 {
-	struct message *msg = msg_from_buf(rs->read_buf, rs->read_buf_size);
-	if (!msg) {
-		rs->read_buf_loaded = 0;
-		return;
+	if (!rs->apply_job) {
+#ifdef __linux__
+		if (rs->epoll_events)
+			epoll_ctl(rs->epoll_fd, EPOLL_CTL_DEL, rs->socket_fd, NULL);
+#endif
+		rs->epoll_events = 0;
+		rs->apply_job = tr_malloc(sizeof *rs->apply_job);
+		*rs->apply_job = (struct apply_job) {rs, 0, 0, rs->wake_fd, 0, 0, NULL};
+		pthread_mutex_lock(&applier->mutex);
+		applier_add(applier, rs->apply_job);
+		pthread_mutex_unlock(&applier->mutex);
+		return EAGAIN;
 	}
 
-	memmove(rs->read_buf, rs->read_buf + msg->size, rs->read_buf_size - msg->size);
-	rs->read_buf_size -= msg->size;
-	rs->read_buf_loaded = rs->read_buf_size > 0;
-
-	char *remote_node = read_node(msg);
-	if (!remote_node)
-		return;
+	if (apply_job_pending(rs))
+		return EAGAIN;
 
-	int acceptable = 0;
-	if (rs->connect_node && strcmp(rs->connect_node, remote_node) == 0) {
-		acceptable = 1;
-	} else if (!rs->connect_node) {
-		for (int i = 0; i < rs->naccept; i++) {
-			if (strcmp(remote_node, rs->accept_node[i]) == 0) {
-				acceptable = 1;
-				break;
-			}
-		}
-	}
-	
-	if (acceptable) {
-		rs->node_msg_received = 1;
-		rs->remote_node = remote_node;
-	} else {
-		log_fatal_err("The remote node name is not acceptable\n");
-	}
+	int rc = apply_job_finish(rs, rs->apply_job);
+	free(rs->apply_job);
+	rs->apply_job = NULL;
+	return rc;
 }
 
+/* read_time_msg_from_buf stores the whole messages in the read buffer and acknowledges them */
 static void read_time_msg_from_buf(struct rstate *rs)
 {
-	struct message *msg;
-	uint64_t msg_index = 0;
+	int rc = 0;
+	if (rs->applier) {
+		if (!rs->apply_job)
+			read_time_msgs(rs, NULL);
+		if (rs->socket_fd == -1)
+			return;
 
-	struct trlmdb_txn *txn;
-	int rc = trlmdb_txn_begin(rs->env, 0, &txn);
-	if (rc) return;
+		int apply = rs->napply_recs > 0 || rs->ack_dels.count > 0;
+		if (apply && rs->epoll_fd != -1) {
+			rc = applier_poll(rs->applier, rs);
+			if (rc == EAGAIN) {
+				event_idle(rs, rs->poll_timeout);
+				return;
+			}
+		} else if (apply) {
+			rc = applier_run(rs->applier, rs);
+		}
+	} else {
+		struct trlmdb_txn *txn;
+		rc = trlmdb_txn_begin(rs->env, 0, &txn);
+		if (rc) return;
+		read_time_msgs(rs, txn);
+		rc = trlmdb_txn_commit(txn);
+	}
 
-	while (msg_index < rs->read_buf_size && ((msg = msg_from_buf(rs->read_buf + msg_index, rs->read_buf_size - msg_index)) != NULL)) {
-		int rc = read_time_msg(txn, rs->remote_node, msg);
-		msg_index += msg->size;
+	if (rc || rs->read_time_failed) {
+		log_stderr("The time messages from %s could not be stored\n", rs->remote_node);
+		close_socket(rs);
+		return;
 	}
 
-	trlmdb_txn_commit(txn);
+	if (rs->read_time_count > rs->read_time_acked)
+		send_ack_msg(rs);
 
-	if (msg_index > 0) {
-		memmove(rs->read_buf, rs->read_buf + msg_index, rs->read_buf_size - msg_index);
-		rs->read_buf_size -= msg_index;
-	}
-	rs->read_buf_loaded = 0;
+	read_buf_stored(rs);
 }
 
+/* read_from_socket reads the socket into the empty or partial read buffer. The socket is only read
+ * when the messages in the read buffer have been stored, so a remote node that sends faster than the
+ * messages can be stored is held back by TCP flow control.
+ */
 static void read_from_socket(struct rstate *rs)
 {
-	if (rs->read_buf_size == rs->read_buf_cap) {
+	if (rs->zread && rs->zread_pending) {
+		if (rs->read_buf_start > 0)
+			read_buf_compact(rs);
+		read_decompress(rs);
+		return;
+	}
+
+	if (rs->zread) {
+		if (rs->zread_size == rs->zread_cap) {
+			uint8_t *realloced = realloc(rs->zread_buf, 2 * rs->zread_cap);
+			if (!realloced) {
+				close_socket(rs);
+				return;
+			}
+			rs->zread_buf = realloced;
+			rs->zread_cap *= 2;
+		}
+
+		ssize_t nread = read(rs->socket_fd, rs->zread_buf + rs->zread_size, rs->zread_cap - rs->zread_size);
+		if (nread < 1) {
+			close_socket(rs);
+			return;
+		}
+
+		rs->zread_size += nread;
+		rs->socket_readable = 0;
+		if (rs->read_buf_start > 0)
+			read_buf_compact(rs);
+		read_decompress(rs);
+		return;
+	}
+
+	if (rs->read_buf_size == rs->read_buf_cap && rs->read_buf_start > 0) {
+		read_buf_compact(rs);
+	} else if (rs->read_buf_size == rs->read_buf_cap) {
 		uint8_t *realloced = (uint8_t*) realloc(rs->read_buf, 2 * rs->read_buf_cap);
 		if (!realloced) {
-			rs->socket_fd = -1;
+			close_socket(rs);
 			return;
 		}
 		rs->read_buf = realloced;
@@ -1663,7 +6275,7 @@ static void read_from_socket(struct rstate *rs)
 
 	ssize_t nread = read(rs->socket_fd, rs->read_buf + rs->read_buf_size, rs->read_buf_cap - rs->read_buf_size);
 	if (nread < 1) {
-		rs->socket_fd = -1;
+		close_socket(rs);
 		return;
 	}
 
@@ -1673,136 +6285,472 @@ static void read_from_socket(struct rstate *rs)
 	/* printf("nread = %zu\n", nread); */
 }
 
+/* frame message
+ *
+ * frame-message = "frme" record-1 record-2 ...
+ *
+ * A replicator that has switched on the capability "frames" packs its time and chunk messages, the
+ * records, into frames. Each record is a whole message in the wire format of the connection.
+ */
+
+/* write_lane_next returns the lane of the next time to load, or -1 if the lanes have no more
+ * node-times. The chunks of a time are loaded together.
+ */
+static int write_lane_next(struct rstate *rs)
+{
+	if (rs->write_chunk > 0 && !rs->lane_end[rs->write_lane])
+		return rs->write_lane;
+
+	int high = !rs->lane_end[LANE_HIGH];
+	int normal = !rs->lane_end[LANE_NORMAL];
+	if (high && (rs->lane_credit > 0 || !normal))
+		return LANE_HIGH;
+	return normal ? LANE_NORMAL : -1;
+}
+
+/* load_record loads the next time or chunk message for the remote node into msg */
+static int load_record(struct rstate *rs, struct trlmdb_txn *txn, struct message *msg)
+{
+	MDB_txn *map_txn = rs->send_txn_load ? rs->send_txn[rs->send_txn_cur] : NULL;
+	int cached;
+	int rc;
+	for (;;) {
+		int lane = write_lane_next(rs);
+		if (lane == -1) {
+			/* The next scan starts from the first node-times of the lanes */
+			rs->end_of_write_loop = 1;
+			for (lane = 0; lane < NLANES; lane++) {
+				rs->write_time_size[lane] = 0;
+			}
+			return MDB_NOTFOUND;
+		}
+
+		rc = load_time_msg(txn, map_txn, rs->scan_cursor[lane], &rs->scan_positioned[lane], rs->write_time[lane], &rs->write_time_size[lane], &rs->write_chunk, rs->remote_node, rs->write_caps, &rs->node_time_dels, rs->send_cache, &cached, msg);
+		if (rc != MDB_NOTFOUND) {
+			rs->write_lane = lane;
+			if (lane == LANE_HIGH)
+				rs->lane_credit--;
+			else
+				rs->lane_credit = rs->priority_weight;
+			break;
+		}
+		rs->lane_end[lane] = 1;
+		rs->write_chunk = 0;
+	}
+	if (rc == ENOMEM)
+		log_mdb_err(rc);
+
+	if (rc == 0 && cached) {
+		/* Only time messages with a known key are cached */
+		if (rs->write_caps & CAP_ACKS)
+			sent_time_push(rs, 1);
+		return 0;
+	}
+
+	/* A time message with a known key, for a remote node that does not know it, is put in the send cache */
+	int cache_put = 0;
+	if (rc == 0 && msg_is_type(msg, "time")) {
+		uint8_t *flag;
+		uint64_t size;
+		msg_get_elem(msg, 1, &flag, &size);
+		if (rs->write_caps & CAP_ACKS)
+			sent_time_push(rs, flag[0] == 't' && flag[1] == 'f');
+		cache_put = rs->send_cache && size >= 2 && flag[0] == 't' && flag[1] == 'f' && (size == 2 || flag[2] != 'c');
+	}
+
+	if (rc == 0 && (rs->write_caps & CAP_WIRE_V2))
+		rc = msg_to_v2(msg);
+
+	if (rc == 0 && cache_put) {
+		MDB_val time = {rs->write_time_size[rs->write_lane], rs->write_time[rs->write_lane]};
+		send_cache_put(rs->send_cache, &time, rs->write_caps, msg);
+	}
+	return rc;
+}
+
+/* load_frame fills msg with a frame of records. It returns MDB_NOTFOUND if the frame is empty. */
+static int load_frame(struct rstate *rs, struct trlmdb_txn *txn, struct message *msg)
+{
+	msg_reset(msg);
+	msg_append(msg, (uint8_t*) "frme", 4);
+
+	int nrecords = 0;
+	while (nrecords < FRAME_MAX_RECORDS && msg->size < FRAME_MAX_SIZE) {
+		int rc = load_record(rs, txn, rs->record_msg);
+		if (rc == MDB_NOTFOUND)
+			break;
+		if (rc)
+			continue;
+		if (rs->record_msg->ext) {
+			/* A record from the memory map is written after the frame */
+			rs->record_pending = 1;
+			break;
+		}
+		if (msg_append(msg, rs->record_msg->buf, rs->record_msg->size))
+			log_enomem();
+		nrecords++;
+	}
+
+	if (nrecords == 0)
+		return MDB_NOTFOUND;
+
+	if (rs->write_caps & CAP_WIRE_V2)
+		return msg_to_v2(msg);
+	return 0;
+}
+
+/* load_write_msg loads messages in a read-only txn, so the application writers are not blocked. The
+ * node-times that both nodes know are deleted afterwards in a small write txn, when the scan reaches
+ * the end or many of them are collected.
+ */
 static void load_write_msg(struct rstate *rs)
 {
 	struct trlmdb_txn *txn;
-	int rc = trlmdb_txn_begin(rs->env, 0, &txn);
+	/* The send txn is begun first, so its snapshot has the values of the times loaded by txn */
+	rs->send_txn_load = send_txn_get(rs) != NULL;
+
+	int rc = trlmdb_txn_begin(rs->env, MDB_RDONLY, &txn);
 	if (rc)
 		log_mdb_err(rc);
 
-	for (int i = rs->write_msg_loaded; i < N_WRITE_MSG; i++) {
-		rc = load_time_msg(txn, rs->write_time, rs->remote_node, rs->write_msg[i]);
-		if (rc == ENOMEM)
+	/* One cursor per lane walks the node-times of the remote node for the whole txn */
+	for (int lane = 0; lane < NLANES; lane++) {
+		rc = mdb_cursor_open(txn->mdb_txn, rs->env->dbi_node_time[lane], &rs->scan_cursor[lane]);
+		if (rc)
 			log_mdb_err(rc);
-	
-		if (rc == 0)
-			rs->write_msg_loaded++;
+		rs->scan_positioned[lane] = 0;
+		rs->lane_end[lane] = 0;
+	}
 
-		if (rc == MDB_NOTFOUND) {
-			rs->end_of_write_loop = 1;
-			memset(rs->write_time, 0, 20);
-			break;
+	while (rs->write_bytes < rs->write_window && !rs->end_of_write_loop) {
+		struct message *msg = write_msg_next(rs);
+		if (rs->write_caps & CAP_FRAMES) {
+			rc = load_frame(rs, txn, msg);
+		} else {
+			rc = load_record(rs, txn, msg);
 		}
+
+		if (rc == 0)
+			write_msg_push(rs);
+		if (rs->record_pending)
+			write_msg_push_record(rs);
 	}
 
+	for (int lane = 0; lane < NLANES; lane++) {
+		mdb_cursor_close(rs->scan_cursor[lane]);
+		rs->scan_cursor[lane] = NULL;
+	}
 	rc = trlmdb_txn_commit(txn);
 	if (rc)
 		log_mdb_err(rc);
+
+	if (rs->send_txn_load && rs->send_refs[rs->send_txn_cur] == 0)
+		send_txn_release(rs, rs->send_txn_cur);
+	rs->send_txn_load = 0;
+
+	if (rs->end_of_write_loop || rs->node_time_dels.count >= NODE_TIME_DELS_MAX) {
+		rc = node_time_del_list(rs->env, &rs->node_time_dels);
+		if (rc)
+			log_mdb_err(rc);
+	}
+}
+
+/* write_scan_ready returns 0 while a new scan of db_node_time would send times that are waiting for
+ * an ack again. The scan starts when the acks of the previous scan have arrived.
+ */
+static int write_scan_ready(struct rstate *rs)
+{
+	int started = 0;
+	for (int lane = 0; lane < NLANES; lane++) {
+		started |= rs->write_time_size[lane] > 0;
+	}
+	return !(rs->write_caps & CAP_ACKS) || started || rs->sent_count == 0;
+}
+
+/* write_pending returns 1 if there are loaded messages or compressed bytes to write */
+static int write_pending(struct rstate *rs)
+{
+	return rs->write_msg_loaded > 0 || rs->zwrite_nwritten < rs->zwrite_size;
+}
+
+/* write_msg_consume removes n written bytes from the loaded messages and returns the number of
+ * messages that are completely written.
+ */
+static int write_msg_consume(struct rstate *rs, uint64_t n)
+{
+	int nmsg = 0;
+	rs->write_bytes -= n;
+	while (rs->write_msg_loaded > 0) {
+		struct message *msg = rs->write_msg[rs->write_msg_head];
+		uint64_t len = msg_wire_size(msg) - rs->write_msg_nwritten;
+		if (n < len) {
+			rs->write_msg_nwritten += n;
+			break;
+		}
+		n -= len;
+		if (msg->ext)
+			send_txn_unref(rs);
+		msg_reset(msg);
+		rs->write_msg_head = (rs->write_msg_head + 1) % rs->write_msg_cap;
+		rs->write_msg_loaded--;
+		rs->write_msg_nwritten = 0;
+		nmsg++;
+	}
+	return nmsg;
+}
+
+/* write_window_update adapts the send window after the socket took nwritten of the nrequested bytes */
+static void write_window_update(struct rstate *rs, uint64_t nrequested, uint64_t nwritten)
+{
+	if (nwritten < nrequested) {
+		if (rs->write_window > WRITE_WINDOW_MIN)
+			rs->write_window /= 2;
+	} else if (nrequested >= rs->write_window && rs->write_window < WRITE_WINDOW_MAX) {
+		rs->write_window *= 2;
+	}
+}
+
+/* write_compressed compresses the loaded messages block by block and writes the blocks until the
+ * socket is full or all loaded messages are written. The send window counts uncompressed bytes.
+ */
+static void write_compressed(struct rstate *rs)
+{
+	uint64_t nrequested = rs->write_bytes;
+	int socket_full = 0;
+
+	for (;;) {
+		if (rs->zwrite_nwritten == rs->zwrite_size) {
+			if (rs->write_bytes == 0)
+				break;
+
+			size_t size = rs->write_bytes < LZ_STREAM_BLOCK ? rs->write_bytes : LZ_STREAM_BLOCK;
+			uint8_t *dst = lz_stream_reserve(rs->zwrite, size);
+			size_t copied = 0;
+			for (int i = 0; copied < size; i++) {
+				struct message *msg = rs->write_msg[(rs->write_msg_head + i) % rs->write_msg_cap];
+				uint64_t offset = i == 0 ? rs->write_msg_nwritten : 0;
+				size_t len = msg_wire_size(msg) - offset < size - copied ? msg_wire_size(msg) - offset : size - copied;
+				msg_wire_copy(msg, offset, dst + copied, len);
+				copied += len;
+			}
+			write_msg_consume(rs, size);
+			rs->zwrite_size = lz_stream_compress(rs->zwrite, size, rs->zwrite_buf);
+			rs->zwrite_nwritten = 0;
+		}
+
+		ssize_t nwritten = write(rs->socket_fd, rs->zwrite_buf + rs->zwrite_nwritten, rs->zwrite_size - rs->zwrite_nwritten);
+		if (nwritten < 1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			socket_full = 1;
+			break;
+		}
+		if (nwritten < 1) {
+			perror("write");
+			close_socket(rs);
+			return;
+		}
+
+		rs->zwrite_nwritten += nwritten;
+		if (rs->zwrite_nwritten < rs->zwrite_size) {
+			socket_full = 1;
+			break;
+		}
+	}
+
+	write_window_update(rs, nrequested, socket_full ? 0 : nrequested);
+	rs->socket_writable = 0;
 }
 
+/* write_to_socket writes the loaded messages in the order they were loaded, so chunks precede their
+ * time message. The send window doubles when a whole window is written at once and halves when the
+ * socket only takes part of the messages, so the loaded bytes follow what the connection can carry.
+ */
 static void write_to_socket(struct rstate *rs)
 {
-	struct iovec iov[N_WRITE_MSG];
-	/* printf("write_msg_loaded = %d\n", rs->write_msg_loaded); */
-	for (int i = rs->write_msg_loaded - 1; i >=0; i--) {
-		struct iovec *iovec = iov + (rs->write_msg_loaded - 1 - i);
-		uint64_t offset = i == (rs->write_msg_loaded - 1) ? rs->write_msg_nwritten : 0;
-		iovec->iov_base = rs->write_msg[i]->buf + offset;
-		iovec->iov_len = rs->write_msg[i]->size - offset;
+	if (rs->zwrite && rs->write_plain == 0) {
+		write_compressed(rs);
+		return;
+	}
+
+	/* A message with data in the memory map has a second iovec */
+	struct iovec iov[WRITE_MAX_IOV];
+	int nmsg = rs->write_msg_loaded;
+	if (rs->zwrite && nmsg > rs->write_plain)
+		nmsg = rs->write_plain;
+	int iovcnt = 0;
+	uint64_t nrequested = 0;
+	for (int i = 0; i < nmsg && iovcnt + 2 <= WRITE_MAX_IOV; i++) {
+		struct message *msg = rs->write_msg[(rs->write_msg_head + i) % rs->write_msg_cap];
+		uint64_t offset = i == 0 ? rs->write_msg_nwritten : 0;
+		if (offset < msg->size) {
+			iov[iovcnt].iov_base = msg->buf + offset;
+			iov[iovcnt].iov_len = msg->size - offset;
+			nrequested += iov[iovcnt++].iov_len;
+			offset = msg->size;
+		}
+		if (msg->ext) {
+			iov[iovcnt].iov_base = msg->ext + offset - msg->size;
+			iov[iovcnt].iov_len = msg_wire_size(msg) - offset;
+			nrequested += iov[iovcnt++].iov_len;
+		}
 	}
-	int iovcnt = rs->write_msg_loaded;
 
 	ssize_t nwritten = writev(rs->socket_fd, iov, iovcnt);
 	if (nwritten < 1) {
 		perror("writev");
-		rs->socket_fd = -1;
+		close_socket(rs);
 		return;
 	}
 
 	/* printf("nwritten = %zd\n", nwritten); */
-	
-	for (int i = rs->write_msg_loaded - 1; i >=0; i--) {
-		uint64_t len = rs->write_msg[i]->size - rs->write_msg_nwritten;
-		if (nwritten < len) {
-			rs->write_msg_nwritten += nwritten;
-			break;
-		}
-		nwritten -= len;
-		msg_reset(rs->write_msg[i]);
-		rs->write_msg_loaded--;
-		rs->write_msg_nwritten = 0;
-	}
+
+	write_window_update(rs, nrequested, nwritten);
+	nmsg = write_msg_consume(rs, nwritten);
+	if (rs->zwrite)
+		rs->write_plain -= nmsg;
 
 	/* printf("write_msg_loaded = %d\n", rs->write_msg_loaded); */
 
 	rs->socket_writable = 0;
 }
 
+/* poll_socket waits for the socket, and for local commits and duplicates if the connection has a notify_fd */
 static void poll_socket(struct rstate *rs)
 {
-	struct pollfd pollfd;
-	pollfd.fd = rs->socket_fd;
-	if (rs->write_msg_loaded) {
-		pollfd.events = POLLRDNORM | POLLWRNORM;
+	struct pollfd pollfd[2];
+	pollfd[0].fd = rs->socket_fd;
+	if (write_pending(rs) || rs->connecting) {
+		pollfd[0].events = POLLRDNORM | POLLWRNORM;
 	} else {
-		pollfd.events = POLLRDNORM;
+		pollfd[0].events = POLLRDNORM;
 	}
-	int rc = poll(&pollfd, 1, rs->poll_timeout);
+	pollfd[1].fd = rs->notify_fd;
+	pollfd[1].events = POLLIN;
+	int timeout = rs->poll_timeout;
+	if (rs->connecting) {
+		uint64_t now = time_ms();
+		timeout = rs->connect_deadline > now ? rs->connect_deadline - now : 0;
+	}
+	int rc = poll(pollfd, rs->notify_fd == -1 ? 1 : 2, timeout);
 	if (rc == 0) {
 		/* printf("POLL timeout\n"); */
 		rs->end_of_write_loop = 0;
-	} else if (rc == 1) {
-		if (pollfd.revents & (POLLHUP | POLLNVAL)) {
+	} else if (rc > 0) {
+		if (rs->notify_fd != -1 && (pollfd[1].revents & POLLIN)) {
+			uint64_t count;
+			if (read(rs->notify_fd, &count, sizeof count) == sizeof count)
+				rs->end_of_write_loop = 0;
+		}
+		if (pollfd[0].revents & (POLLHUP | POLLNVAL)) {
 			/* printf("POLLHUP\n"); */
-			close(rs->socket_fd);
-			rs->socket_fd = -1;
+			close_socket(rs);
 			return;
 		}
-		if (pollfd.revents & POLLRDNORM) {
+		if (pollfd[0].revents & POLLRDNORM) {
 			/* printf("POLLRDNORM\n"); */
 			rs->end_of_write_loop = 0;
 			rs->socket_readable = 1;
 		}
-		if (pollfd.revents & POLLWRNORM) {
+		if (pollfd[0].revents & POLLWRNORM) {
 			/* printf("POLLWRNORM\n"); */
 			rs->socket_writable = 1;
 		}
 	}
 }
 
+/* event threads
+ *
+ * With the option event_threads, a fixed number of event threads run all connections. Each connection
+ * belongs to one event thread, which registers its socket with epoll. Instead of polling, the
+ * iteration makes the connection idle, and the event thread runs it again when the socket is ready or
+ * the timeout has passed.
+ */
+
+/* event_idle makes the connection wait for an event for at most timeout milliseconds */
+static void event_idle(struct rstate *rs, int timeout)
+{
+	rs->idle = 1;
+	rs->idle_until = time_ms() + timeout;
+}
+
+/* connect_wait finishes a non-blocking connect or waits for it */
+static void connect_wait(struct rstate *rs)
+{
+	uint64_t now = time_ms();
+	if (rs->socket_writable || now >= rs->connect_deadline) {
+		connect_finish(rs);
+	} else if (rs->epoll_fd != -1) {
+		event_idle(rs, rs->connect_deadline - now);
+	} else {
+		poll_socket(rs);
+	}
+}
+
 static void replicator_iteration(struct rstate *rs)
 {
 	/* printf("\n\n\nIteration\n"); */
 	
-	if (rs->socket_fd == -1 && rs->connect_node && rs->connect_now) {
+	if (rs->apply_job) {
+		/* printf("Wait for the applier\n"); */
+		read_time_msg_from_buf(rs);
+	} else if (rs->socket_fd != -1 && __atomic_load_n(&rs->duplicate, __ATOMIC_SEQ_CST)) {
+		/* printf("close duplicate connection\n"); */
+		log_stderr("There is another connection with %s\n", rs->remote_node);
+		close_socket(rs);
+	} else if (rs->socket_fd == -1 && rs->connect_node && rs->registry && conn_waiting(rs->registry, rs)) {
+		/* printf("the accepted connection is kept\n"); */
+		if (rs->epoll_fd != -1)
+			event_idle(rs, rs->poll_timeout);
+		else
+			usleep(1000 * rs->poll_timeout);
+	} else if (rs->socket_fd == -1 && rs->connect_node && rs->connect_now) {
 		/* printf("connect to remote\n"); */
 		connect_to_remote(rs);
 	} else if (rs->socket_fd == -1 && rs->connect_node) {
 		/* printf("sleeping before connecting again\n"); */
+		int delay = reconnect_delay(rs);
 		rs->connect_now = 1;
-		sleep(10);
+		if (rs->epoll_fd != -1)
+			event_idle(rs, delay);
+		else if (delay > 0)
+			usleep(1000 * delay);
+	} else if (rs->socket_fd == -1 && rs->epoll_fd != -1) {
+		rs->finished = 1;
 	} else if (rs->socket_fd == -1) {
 		/* printf("acceptor exits\n"); */
 		rstate_free(rs);
 		pthread_exit(NULL);
+	} else if (rs->connecting) {
+		/* printf("Wait for connect\n"); */
+		connect_wait(rs);
 	} else if (!rs->node_msg_sent) {
 		/* printf("send_node_msg\n"); */
 		send_node_msg(rs);
+	} else if (!rs->caps_msg_sent) {
+		/* printf("send_caps_msg\n"); */
+		send_caps_msg(rs);
 	} else if (rs->read_buf_loaded && !rs->node_msg_received) {
 		/* printf("Read node message from buffer\n"); */
 		read_node_msg_from_buf(rs);
 	} else if (rs->read_buf_loaded) {
 		/* printf("Read time message from buffer\n"); */
 		read_time_msg_from_buf(rs);
-	} else if (rs->socket_readable) {
+	} else if (rs->socket_readable || rs->zread_pending) {
 		/* printf("Read from socket\n"); */
 		read_from_socket(rs);
-	} else if (!rs->write_msg_loaded && !rs->end_of_write_loop && rs->remote_node) {
+	} else if (rs->caps_msg_received && !rs->opts_msg_sent) {
+		/* printf("Send opts msg\n"); */
+		send_opts_msg(rs);
+	} else if (rs->sync_state == SYNC_PENDING && rs->opts_msg_sent) {
+		/* printf("Start range reconciliation\n"); */
+		start_range_sync(rs);
+	} else if (rs->write_bytes < rs->write_window / 2 && !rs->end_of_write_loop && rs->remote_node && rs->sync_state != SYNC_RUNNING && write_scan_ready(rs)) {
 		/* printf("Load write msg\n"); */
 		load_write_msg(rs);
-	} else if (rs->write_msg_loaded && rs->socket_writable) {
+	} else if (write_pending(rs) && rs->socket_writable) {
 		/* printf("Write to socket\n"); */
 		write_to_socket(rs);
+	} else if (rs->epoll_fd != -1) {
+		event_idle(rs, rs->poll_timeout);
 	} else {
 		/* printf("Poll\n"); */
 		poll_socket(rs);
@@ -1817,7 +6765,264 @@ static void *replicator_loop(void *arg)
 {
 	struct rstate *rs = (struct rstate*) arg;
 
+#ifdef __linux__
+	/* The notify_fd also wakes the thread when the connection becomes a duplicate */
+	rs->notify_fd = eventfd(0, EFD_NONBLOCK);
+	rs->wake_fd = rs->notify_fd;
+	if (rs->notify_fd != -1 && rs->env->notify)
+		env_notify_add_fd(rs->env, rs->notify_fd);
+#endif
+
 	for (;;) {
 		replicator_iteration(rs);
 	}
 }
+
+#ifdef __linux__
+
+/* event_register updates the events that the socket of the connection is registered for */
+static void event_register(struct rstate *rs)
+{
+	if (rs->socket_fd == -1 || rs->apply_job)
+		return;
+
+	uint32_t events = EPOLLIN | (write_pending(rs) || rs->connecting ? EPOLLOUT : 0);
+	if (events == rs->epoll_events)
+		return;
+
+	struct epoll_event event = {0};
+	event.events = events;
+	event.data.ptr = rs;
+	int op = rs->epoll_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(rs->epoll_fd, op, rs->socket_fd, &event) == -1) {
+		perror("epoll_ctl");
+		close_socket(rs);
+		return;
+	}
+	rs->epoll_events = events;
+}
+
+/* event_dispatch sets the socket flags of the connection like poll_socket */
+static void event_dispatch(struct rstate *rs, uint32_t events)
+{
+	rs->idle = 0;
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		close_socket(rs);
+		return;
+	}
+	if (events & EPOLLIN) {
+		rs->end_of_write_loop = 0;
+		rs->socket_readable = 1;
+	}
+	if (events & EPOLLOUT)
+		rs->socket_writable = 1;
+}
+
+/* event_thread_wake moves the connections added by other threads to the connections of et. The
+ * wake_fd is also written after local commits, so all connections look for new times.
+ */
+static void event_thread_wake(struct event_thread *et)
+{
+	uint64_t count;
+	if (read(et->wake_fd, &count, sizeof count) != sizeof count)
+		return;
+
+	for (int i = 0; i < et->nconns; i++) {
+		if (apply_job_pending(et->conns[i]))
+			continue;
+		et->conns[i]->idle = 0;
+		et->conns[i]->end_of_write_loop = 0;
+	}
+
+	pthread_mutex_lock(&et->mutex);
+	for (int i = 0; i < et->nadded; i++) {
+		if (et->nconns == et->conns_cap) {
+			et->conns_cap = et->conns_cap ? 2 * et->conns_cap : 16;
+			et->conns = tr_realloc(et->conns, et->conns_cap * sizeof *et->conns);
+		}
+		et->conns[et->nconns++] = et->added[i];
+	}
+	et->nadded = 0;
+	pthread_mutex_unlock(&et->mutex);
+}
+
+/* event_thread_timeout returns the milliseconds until the first idle connection times out */
+static int event_thread_timeout(struct event_thread *et)
+{
+	if (et->nconns == 0)
+		return -1;
+
+	uint64_t now = time_ms();
+	uint64_t first = UINT64_MAX;
+	for (int i = 0; i < et->nconns; i++) {
+		struct rstate *rs = et->conns[i];
+		if (!rs->idle || rs->idle_until <= now)
+			return 0;
+		if (rs->idle_until < first)
+			first = rs->idle_until;
+	}
+	return (int) (first - now);
+}
+
+/* The event thread start routine */
+static void *event_thread_loop(void *arg)
+{
+	struct event_thread *et = arg;
+	struct epoll_event events[EVENT_MAX_EVENTS];
+
+	for (;;) {
+		int n = epoll_wait(et->epoll_fd, events, EVENT_MAX_EVENTS, event_thread_timeout(et));
+		for (int i = 0; i < n; i++) {
+			struct rstate *rs = events[i].data.ptr;
+			if (rs)
+				event_dispatch(rs, events[i].events);
+			else
+				event_thread_wake(et);
+		}
+
+		uint64_t now = time_ms();
+		for (int i = 0; i < et->nconns; i++) {
+			struct rstate *rs = et->conns[i];
+			if (apply_job_pending(rs)) {
+				if (rs->idle_until <= now)
+					event_idle(rs, rs->poll_timeout);
+				continue;
+			}
+			if (rs->idle && rs->idle_until <= now) {
+				rs->idle = 0;
+				rs->end_of_write_loop = 0;
+			}
+			for (int j = 0; j < EVENT_BATCH && !rs->idle && !rs->finished; j++)
+				replicator_iteration(rs);
+			event_register(rs);
+		}
+
+		for (int i = et->nconns - 1; i >= 0; i--) {
+			if (et->conns[i]->finished) {
+				rstate_free(et->conns[i]);
+				et->conns[i] = et->conns[--et->nconns];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static struct event_pool *event_pool_create(struct trlmdb_env *env, int nthreads)
+{
+	struct event_pool *pool = tr_malloc(sizeof *pool);
+	pool->threads = calloc(nthreads, sizeof *pool->threads);
+	if (!pool->threads)
+		log_enomem();
+	pool->nthreads = nthreads;
+	pool->next = 0;
+
+	for (int i = 0; i < nthreads; i++) {
+		struct event_thread *et = &pool->threads[i];
+		et->epoll_fd = epoll_create1(0);
+		et->wake_fd = eventfd(0, EFD_NONBLOCK);
+		if (et->epoll_fd == -1 || et->wake_fd == -1)
+			log_fatal_err("The event threads could not be created: %s\n", strerror(errno));
+
+		struct epoll_event event = {0};
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(et->epoll_fd, EPOLL_CTL_ADD, et->wake_fd, &event) == -1)
+			log_fatal_err("The event threads could not be created: %s\n", strerror(errno));
+
+		if (env->notify)
+			env_notify_add_fd(env, et->wake_fd);
+
+		pthread_mutex_init(&et->mutex, NULL);
+		if (pthread_create(&et->thread, NULL, event_thread_loop, et))
+			log_fatal_err("error creating an event thread\n");
+	}
+
+	return pool;
+}
+
+/* event_pool_add hands the connection to the next event thread */
+static void event_pool_add(struct event_pool *pool, struct rstate *rs)
+{
+	struct event_thread *et = &pool->threads[pool->next];
+	pool->next = (pool->next + 1) % pool->nthreads;
+
+	rs->epoll_fd = et->epoll_fd;
+	rs->wake_fd = et->wake_fd;
+
+	pthread_mutex_lock(&et->mutex);
+	if (et->nadded == et->added_cap) {
+		et->added_cap = et->added_cap ? 2 * et->added_cap : 16;
+		et->added = tr_realloc(et->added, et->added_cap * sizeof *et->added);
+	}
+	et->added[et->nadded++] = rs;
+	pthread_mutex_unlock(&et->mutex);
+
+	uint64_t one = 1;
+	if (write(et->wake_fd, &one, sizeof one) != sizeof one)
+		log_fatal_err("The event thread could not be woken: %s\n", strerror(errno));
+}
+
+static void event_pool_join(struct event_pool *pool)
+{
+	for (int i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i].thread, NULL);
+}
+
+/* The notify thread writes the registered eventfds when the commit counter changes */
+static void *notify_loop(void *arg)
+{
+	struct trlmdb_env *env = arg;
+	uint32_t seq = __atomic_load_n(&env->notify->seq, __ATOMIC_SEQ_CST);
+	uint64_t one = 1;
+
+	for (;;) {
+		seq = env_notify_wait(env, seq);
+		pthread_mutex_lock(&env->notify_mutex);
+		for (size_t i = 0; i < env->nnotify_fds; i++) {
+			if (write(env->notify_fds[i], &one, sizeof one) != sizeof one && errno != EAGAIN)
+				perror("notify");
+		}
+		pthread_mutex_unlock(&env->notify_mutex);
+
+		/* The commits during the interval are replicated together */
+		if (env->notify_interval > 0)
+			usleep(1000 * env->notify_interval);
+	}
+
+	return NULL;
+}
+
+static void notify_start(struct trlmdb_env *env, int interval)
+{
+	if (!env->notify)
+		return;
+
+	env->notify_interval = interval;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, notify_loop, env))
+		log_fatal_err("error creating the notify thread\n");
+	pthread_detach(thread);
+}
+
+#else
+
+static struct event_pool *event_pool_create(struct trlmdb_env *env, int nthreads)
+{
+	log_fatal_err("The option event_threads needs epoll, which is only available on Linux\n");
+	return NULL;
+}
+
+static void event_pool_add(struct event_pool *pool, struct rstate *rs)
+{
+}
+
+static void event_pool_join(struct event_pool *pool)
+{
+}
+
+static void notify_start(struct trlmdb_env *env, int interval)
+{
+}
+
+#endif
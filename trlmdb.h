@@ -30,14 +30,16 @@
  * A trlmdb_env environemnt is used to access a given database.  
  * A trlmdb_txn transaction is used to access the database in an atomic manner.
  * A cursor is used to traverse a table.
+ * A blob is used to write or read a large value in chunks.
  */
 typedef struct trlmdb_env trlmdb_env;
 typedef struct trlmdb_txn trlmdb_txn;
 typedef struct trlmdb_cursor trlmdb_cursor;
+typedef struct trlmdb_blob trlmdb_blob;
 
 
 /* trlmdb_env is the first function to call.  It creates an MDB_env, generates a random id
- * associated with each trlmd environment, and sets the number of LMDB databases to 5, which is the
+ * associated with each trlmd environment, and sets the number of LMDB databases to 8, which is the
  * number of LMDB databases used internally by trlmdb. To close the environment, call
  * trlmdb_env_close(). Before the environment may be used, it must be opened using trlmdb_env_open().
  */
@@ -51,8 +53,64 @@ int trlmdb_env_create(trlmdb_env **env);
 int  trlmdb_env_set_mapsize(trlmdb_env *env, uint64_t size);
 
 
+/* Database flags.
+ * TRLMDB_TABLE_IDS replaces the table name in extended keys with a 4 byte table id. The ids are hashes
+ * of the table names and are recorded in a replicated catalog. Two table names with the same id can
+ * not be used in the same database.
+ * TRLMDB_COMPACT_TIME stores time stamps with a variable length counter. Most time stamps take 13
+ * bytes instead of 20 in each of the four databases that contain them.
+ * TRLMDB_TABLE_DBIS keeps the most recent time of each key in a separate LMDB database for each table,
+ * which is created when the table is first used. Keys can not be empty with this flag. The number of
+ * tables is limited by trlmdb_env_set_maxtables.
+ */
+#define TRLMDB_TABLE_IDS 0x01
+#define TRLMDB_COMPACT_TIME 0x02
+#define TRLMDB_TABLE_DBIS 0x04
+
+
+/* trlmdb_env_set_flags sets the database flags above. The flags only take effect when the
+ * database is created by trlmdb_env_open. An existing database keeps the flags it was created with.
+ * @param[in] env created by trlmdb_env_create.
+ * @param[in] flags, a combination of the database flags.
+ * @return 0 on success, EINVAL for unknown flags.
+ */
+int trlmdb_env_set_flags(trlmdb_env *env, unsigned int flags);
+
+
+/* trlmdb_env_set_maxtables sets the maximum number of tables in a database with TRLMDB_TABLE_DBIS.
+ * The default is 120. It must be called before trlmdb_env_open.
+ * @param[in] env created by trlmdb_env_create.
+ * @param[in] max_tables, the maximum number of tables.
+ * @return 0 on success, and non-zero on failure.
+ */
+int trlmdb_env_set_maxtables(trlmdb_env *env, unsigned int max_tables);
+
+
+/* Value codecs.
+ * TRLMDB_CODEC_NONE stores values as they are.
+ * TRLMDB_CODEC_LZ is a built-in fast LZ77 compressor.
+ * TRLMDB_CODEC_ZLIB is available when trlmdb.c is compiled with -DTRLMDB_ZLIB and linked with -lz.
+ */
+#define TRLMDB_CODEC_NONE 0
+#define TRLMDB_CODEC_LZ 1
+#define TRLMDB_CODEC_ZLIB 2
+
+
+/* trlmdb_env_set_codec chooses the codec used to compress values written through this environment.
+ * Values shorter than min_size, and values that do not get smaller, are stored uncompressed.
+ * Reading is transparent; all codecs are understood regardless of this setting.
+ * The default is TRLMDB_CODEC_NONE.
+ * @param[in] env created by trlmdb_env_create.
+ * @param[in] codec, one of the codecs above.
+ * @param[in] min_size, the smallest value size in bytes that is compressed.
+ * @return 0 on success, EINVAL if the codec is not compiled in.
+ */
+int trlmdb_env_set_codec(trlmdb_env *env, int codec, size_t min_size);
+
+
 /* trlmdb_env_open opens the lmdb environment and opens the internal databases
- * used bny trlmdb.
+ * used bny trlmdb. Unless flags contains MDB_RDONLY, it also creates the file trlmdb.notify next to
+ * the lmdb files, whose commit counter wakes the replicator.
  * @param[in] trlmdb_env created by trlmdb_env_create
  * @param[in] path to directory of lmdb files.
  * @param[in] flags goes directly through to lmdb, choosing 0 is fine.
@@ -100,7 +158,8 @@ void trlmdb_txn_abort(trlmdb_txn *txn);
  *           void *mv_data;
  *   } MDB_val;
  * @param[out] value, the result will be available in value. Copy the buffer before the transaction
- * is done if the result is needed.
+ * is done if the result is needed. Compressed values are decompressed into memory owned by the
+ * transaction.
  * @return, 0 on success, MDB_NOTFOUND if the key is absent, ENOMEM if memory allocation fails. 
  */
 int trlmdb_get(trlmdb_txn *txn, char *table, MDB_val *key, MDB_val *value);
@@ -111,7 +170,8 @@ int trlmdb_get(trlmdb_txn *txn, char *table, MDB_val *key, MDB_val *value);
  * @param[in] table, a null-terminated string
  * @param[in] key, a byte buffer and a length in an MDB_val struct.
  * @param[in] value, the value to store in trlmdb.
- * @return, 0 on success, ENOMEM if memory allocation fails, LMDB error codes for mdb_put. 
+ * @return, 0 on success, ENOMEM if memory allocation fails, EEXIST if the table id of the table is
+ * used by another table, LMDB error codes for mdb_put. 
  */
 int trlmdb_put(trlmdb_txn *txn, char *table, MDB_val *key, MDB_val *value);
 
@@ -178,4 +238,53 @@ int trlmdb_cursor_prev(struct trlmdb_cursor *cursor);
 */
 int trlmdb_cursor_get(struct trlmdb_cursor *cursor, MDB_val *key, MDB_val *val);
 
+
+/* trlmdb_blob_put starts a put of a large value for a key in a table. The value is written with
+ * trlmdb_blob_write and stored in chunks of 64 KB. The put takes effect when trlmdb_blob_close is
+ * called. The replicator sends the value in chunks, so neither end holds the whole value in memory.
+ * trlmdb_get returns the whole value of a blob as usual.
+ * @param[in] txn, an open transaction.
+ * @param[in] table, a null-terminated string
+ * @param[in] key, a byte buffer and a length in an MDB_val struct.
+ * @param[out] blob, a pointer to the blob to create.
+ * @return 0 on success, ENOMEM if memory allocation fails, EEXIST as for trlmdb_put. 
+ */
+int trlmdb_blob_put(trlmdb_txn *txn, char *table, MDB_val *key, trlmdb_blob **blob);
+
+
+/* trlmdb_blob_write appends bytes to a blob created by trlmdb_blob_put.
+ * @param[in] blob.
+ * @param[in] data, size, the bytes to append.
+ * @return 0 on success, EINVAL for a blob opened for reading, LMDB error codes for mdb_put.
+ */
+int trlmdb_blob_write(trlmdb_blob *blob, const void *data, size_t size);
+
+
+/* trlmdb_blob_open opens the value of a key in a table for reading in chunks. Values that were not
+ * written as blobs are read as a single chunk.
+ * @param[in] txn, an open transaction.
+ * @param[in] table, a null-terminated string
+ * @param[in] key, a byte buffer and a length in an MDB_val struct.
+ * @param[out] blob, a pointer to the blob to create.
+ * @return 0 on success, MDB_NOTFOUND if the key is absent, ENOMEM if memory allocation fails.
+ */
+int trlmdb_blob_open(trlmdb_txn *txn, char *table, MDB_val *key, trlmdb_blob **blob);
+
+
+/* trlmdb_blob_read gets the next chunk of a blob opened by trlmdb_blob_open. The chunk is valid until
+ * the transaction ends.
+ * @param[in] blob.
+ * @param[out] chunk, the next chunk.
+ * @return 0 on success, MDB_NOTFOUND after the last chunk, EINVAL for a blob that is written.
+ */
+int trlmdb_blob_read(trlmdb_blob *blob, MDB_val *chunk);
+
+
+/* trlmdb_blob_close completes a put started by trlmdb_blob_put, and frees the blob. It must be called
+ * before the transaction is committed.
+ * @param[in] blob.
+ * @return 0 on success, LMDB error codes if the put could not be completed.
+ */
+int trlmdb_blob_close(trlmdb_blob *blob);
+
 #endif